@@ -1,6 +1,6 @@
 @echo off
 cd /d "%~dp0"
-gcc -Wall -std=c99 -Isrc -o clox src/clox.c src/chunk.c src/compiler.c src/debug.c src/object.c src/scanner.c src/value.c src/vm.c
+gcc -Wall -std=c99 -Isrc -o clox src/allocator.c src/clox.c src/cache.c src/chunk.c src/compiler.c src/debug.c src/emitc.c src/jit.c src/loxc.c src/memory.c src/object.c src/optimizer.c src/scanner.c src/table.c src/trace.c src/value.c src/vm.c
 if errorlevel 1 (
     echo Build failed.
     exit /b 1
@@ -0,0 +1,230 @@
+/**
+ * allocator.c - Slabs, large blocks and arenas behind reallocate().
+ *
+ * A slot's size class is all that's needed to free it, and reallocate()
+ * callers always pass the old size, so slots carry no header. A free slot
+ * holds the next one of its class. A new slot comes off its class's free
+ * list, or else is bumped off the newest slab; what is left of a slab too
+ * small for the next slot is abandoned, which wastes under SLAB_MAX_SIZE
+ * bytes per slab.
+ *
+ * Large blocks keep their Block header in a doubly linked list, so one
+ * can be freed or moved by realloc without walking it.
+ */
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS and madvise under -std=c99 */
+#include "allocator.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+#define HUGE_PAGES 1
+#else
+#define HUGE_PAGES 0
+#endif
+
+#define SIZE_CLASS(size) (((size) - 1) / 16)
+#define CLASS_SIZE(sizeClass) (((size_t)(sizeClass) + 1) * 16)
+
+void initAllocator(Allocator* allocator) {
+    allocator->blocks = NULL;
+    for (int i = 0; i < SIZE_CLASSES; i++) allocator->freeSlots[i] = NULL;
+    allocator->slabTop = NULL;
+    allocator->slabEnd = NULL;
+    allocator->hugePages = false;
+}
+
+static void outOfMemory(void) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(1);
+}
+
+/* Maps `*size` bytes rounded up to whole huge pages, aligned so the kernel
+   can back them with huge pages. Returns NULL if it can't. */
+static Block* mapHugePages(size_t* size) {
+#if HUGE_PAGES
+    size_t length = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    uint8_t* mapping = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return NULL;
+    uint8_t* start = (uint8_t*)(((uintptr_t)mapping + HUGE_PAGE_SIZE - 1) &
+                                ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (start > mapping) munmap(mapping, (size_t)(start - mapping));
+    size_t tail = (size_t)(mapping + length + HUGE_PAGE_SIZE - (start + length));
+    if (tail > 0) munmap(start + length, tail);
+    madvise(start, length, MADV_HUGEPAGE);
+    *size = length;
+    return (Block*)start;
+#else
+    (void)size;
+    return NULL;
+#endif
+}
+
+static void linkBlock(Allocator* allocator, Block* block) {
+    block->prev = NULL;
+    block->next = allocator->blocks;
+    if (allocator->blocks != NULL) allocator->blocks->prev = block;
+    allocator->blocks = block;
+}
+
+static void unlinkBlock(Allocator* allocator, Block* block) {
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        allocator->blocks = block->next;
+    }
+    if (block->next != NULL) block->next->prev = block->prev;
+}
+
+/* A block with room for at least `size` bytes after its header. */
+static Block* newBlock(Allocator* allocator, size_t size) {
+    size_t total = sizeof(Block) + size;
+    Block* block = NULL;
+    if (allocator->hugePages && total >= HUGE_PAGE_SIZE) block = mapHugePages(&total);
+    bool mapped = block != NULL;
+    if (!mapped) block = malloc(total);
+    if (block == NULL) outOfMemory();
+    block->size = total - sizeof(Block);
+    block->mapped = mapped;
+    linkBlock(allocator, block);
+    return block;
+}
+
+static void releaseBlock(Block* block) {
+#if HUGE_PAGES
+    if (block->mapped) {
+        munmap(block, sizeof(Block) + block->size);
+        return;
+    }
+#endif
+    free(block);
+}
+
+static void freeBlock(Allocator* allocator, Block* block) {
+    unlinkBlock(allocator, block);
+    releaseBlock(block);
+}
+
+static void* allocateSlot(Allocator* allocator, size_t size) {
+    int sizeClass = SIZE_CLASS(size);
+    FreeSlot* slot = allocator->freeSlots[sizeClass];
+    if (slot != NULL) {
+        allocator->freeSlots[sizeClass] = slot->next;
+        return slot;
+    }
+    size_t slotSize = CLASS_SIZE(sizeClass);
+    if ((size_t)(allocator->slabEnd - allocator->slabTop) < slotSize) {
+        size_t slabSize = allocator->hugePages ? HUGE_PAGE_SIZE - sizeof(Block) : SLAB_SIZE;
+        Block* slab = newBlock(allocator, slabSize);
+        allocator->slabTop = (uint8_t*)(slab + 1);
+        allocator->slabEnd = allocator->slabTop + slab->size;
+    }
+    void* result = allocator->slabTop;
+    allocator->slabTop += slotSize;
+    return result;
+}
+
+static void freeSlot(Allocator* allocator, void* pointer, size_t size) {
+    int sizeClass = SIZE_CLASS(size);
+    FreeSlot* slot = pointer;
+    slot->next = allocator->freeSlots[sizeClass];
+    allocator->freeSlots[sizeClass] = slot;
+}
+
+/* Grows or shrinks a large block to another large size. */
+static void* resizeLarge(Allocator* allocator, void* pointer, size_t newSize) {
+    Block* block = (Block*)pointer - 1;
+    if (newSize <= block->size && (block->mapped || newSize > block->size / 2)) {
+        return pointer;
+    }
+    bool mapNew = allocator->hugePages && sizeof(Block) + newSize >= HUGE_PAGE_SIZE;
+    if (block->mapped || mapNew) {
+        Block* moved = newBlock(allocator, newSize);
+        memcpy(moved + 1, pointer, newSize < block->size ? newSize : block->size);
+        freeBlock(allocator, block);
+        return moved + 1;
+    }
+    unlinkBlock(allocator, block);
+    Block* moved = realloc(block, sizeof(Block) + newSize);
+    if (moved == NULL) outOfMemory();
+    moved->size = newSize;
+    linkBlock(allocator, moved);
+    return moved + 1;
+}
+
+void* allocatorResize(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize) {
+    bool wasSmall = oldSize <= SLAB_MAX_SIZE;
+    bool isSmall = newSize <= SLAB_MAX_SIZE;
+    if (pointer == NULL) {
+        if (newSize == 0) return NULL;
+        return isSmall ? allocateSlot(allocator, newSize)
+                       : (void*)(newBlock(allocator, newSize) + 1);
+    }
+    if (newSize == 0) {
+        if (wasSmall) {
+            freeSlot(allocator, pointer, oldSize);
+        } else {
+            freeBlock(allocator, (Block*)pointer - 1);
+        }
+        return NULL;
+    }
+    if (!wasSmall && !isSmall) return resizeLarge(allocator, pointer, newSize);
+    if (wasSmall && isSmall && SIZE_CLASS(oldSize) == SIZE_CLASS(newSize)) return pointer;
+
+    void* result = allocatorResize(allocator, NULL, 0, newSize);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    allocatorResize(allocator, pointer, oldSize, 0);
+    return result;
+}
+
+void freeAllocator(Allocator* allocator) {
+    Block* block = allocator->blocks;
+    while (block != NULL) {
+        Block* next = block->next;
+        releaseBlock(block);
+        block = next;
+    }
+    initAllocator(allocator);
+}
+
+/* --- Arenas --------------------------------------------------------------- */
+
+void initArena(Arena* arena) {
+    arena->chunks = NULL;
+    arena->top = NULL;
+    arena->end = NULL;
+}
+
+void* arenaAllocate(Arena* arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if ((size_t)(arena->end - arena->top) < size) {
+        /* Each chunk is twice the last, so a big compile takes few. */
+        size_t chunkSize = arena->chunks == NULL ? ARENA_CHUNK_SIZE : arena->chunks->size * 2;
+        if (chunkSize < size) chunkSize = size;
+        ArenaChunk* chunk = reallocate(NULL, 0, sizeof(ArenaChunk) + chunkSize);
+        chunk->next = arena->chunks;
+        chunk->size = chunkSize;
+        arena->chunks = chunk;
+        arena->top = (uint8_t*)(chunk + 1);
+        arena->end = arena->top + chunkSize;
+    }
+    void* result = arena->top;
+    arena->top += size;
+    return result;
+}
+
+void freeArena(Arena* arena) {
+    ArenaChunk* chunk = arena->chunks;
+    while (chunk != NULL) {
+        ArenaChunk* next = chunk->next;
+        reallocate(chunk, sizeof(ArenaChunk) + chunk->size, 0);
+        chunk = next;
+    }
+    initArena(arena);
+}
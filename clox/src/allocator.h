@@ -0,0 +1,75 @@
+/**
+ * allocator.h - The VM's memory: size-class slabs, large blocks, arenas.
+ *
+ * Every block the VM allocates comes from vm.allocator, through
+ * reallocate() (memory.h). Blocks of up to SLAB_MAX_SIZE bytes are slots
+ * carved from slabs, with one free list per 16-byte size class, so small
+ * objects cost no malloc call and no header. Bigger blocks are allocated
+ * separately, behind a header that links them into the same list as the
+ * slabs. freeAllocator() releases that list, so tearing the VM down costs
+ * one free per slab or large block, not one per object.
+ *
+ * An Arena bump-allocates short-lived data from large blocks and frees
+ * all of it at once.
+ *
+ * With hugePages set (--huge-pages), slabs and blocks of HUGE_PAGE_SIZE
+ * or more are mapped on their own aligned pages and advised for
+ * transparent huge pages. That covers the heap and, once it is big
+ * enough to matter, the stack. Where there is no madvise they come
+ * from malloc as usual.
+ */
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include "common.h"
+
+#define SLAB_MAX_SIZE 256
+#define SIZE_CLASSES (SLAB_MAX_SIZE / 16)
+#define SLAB_SIZE (256 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+/* Header in front of each slab and large block. */
+typedef struct Block {
+    struct Block* prev;
+    struct Block* next;
+    size_t size;       /* bytes after the header */
+    bool mapped;       /* on huge pages of its own, not from malloc */
+} Block;
+
+typedef struct FreeSlot {
+    struct FreeSlot* next;
+} FreeSlot;
+
+typedef struct {
+    Block* blocks;     /* every slab and large block */
+    FreeSlot* freeSlots[SIZE_CLASSES];
+    uint8_t* slabTop;  /* unused part of the newest slab */
+    uint8_t* slabEnd;
+    bool hugePages;    /* Back big blocks with huge pages (--huge-pages) */
+} Allocator;
+
+typedef struct ArenaChunk {
+    struct ArenaChunk* next;
+    size_t size;       /* bytes after the header */
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk* chunks;  /* newest first */
+    uint8_t* top;
+    uint8_t* end;
+} Arena;
+
+void initAllocator(Allocator* allocator);
+/* realloc() with the caller supplying the old size: NULL `pointer`
+   allocates, zero `newSize` frees. Exits if memory runs out. */
+void* allocatorResize(Allocator* allocator, void* pointer, size_t oldSize, size_t newSize);
+/* Frees every block at once. Whatever was allocated is gone. */
+void freeAllocator(Allocator* allocator);
+
+void initArena(Arena* arena);
+/* Returns `size` uninitialized bytes, 16-byte aligned. */
+void* arenaAllocate(Arena* arena, size_t size);
+void freeArena(Arena* arena);
+
+#endif
@@ -0,0 +1,179 @@
+/**
+ * cache.c - Content-addressed cache of compiled scripts.
+ *
+ * Entries are plain .loxc files, so everything about their layout and
+ * validation is loxc.c's. The key covers the source bytes, the -O flag
+ * and the build of clox that compiled them: a rebuilt clox may compile
+ * the same source differently even when LOXC_VERSION has not changed,
+ * so it starts from an empty cache rather than trusting old entries.
+ * Hits touch their file, which makes modification time the LRU order
+ * eviction uses.
+ */
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#endif
+#include "cache.h"
+#include "loxc.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+
+InterpretResult interpretCached(const char* source) {
+    return interpret(source);
+}
+
+#else
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+/* FNV-1a over eight bytes at a time; the cache only needs a key that
+   changes whenever the source does, and this keeps hashing far cheaper
+   than the scan it replaces. */
+static uint64_t hashBytes(uint64_t hash, const void* bytes, size_t length) {
+    const uint8_t* p = bytes;
+    for (; length >= 8; p += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+    for (; length > 0; p++, length--) hash = (hash ^ *p) * FNV_PRIME;
+    return hash;
+}
+
+static uint64_t cacheKey(const char* source) {
+    static const char build[] = __DATE__ " " __TIME__;
+    uint32_t config[3] = {LOXC_VERSION, vm.optimize, (uint32_t)sizeof(Value)};
+    uint64_t hash = hashBytes(FNV_OFFSET, config, sizeof(config));
+    hash = hashBytes(hash, build, sizeof(build));
+    return hashBytes(hash, source, strlen(source));
+}
+
+static char* joinPath(const char* directory, const char* name) {
+    size_t size = strlen(directory) + strlen(name) + 2;
+    char* path = malloc(size);
+    snprintf(path, size, "%s/%s", directory, name);
+    return path;
+}
+
+static char* cacheDirectory(void) {
+    const char* directory = getenv("CLOX_CACHE_DIR");
+    if (directory != NULL && directory[0] != '\0') {
+        char* copy = malloc(strlen(directory) + 1);
+        return strcpy(copy, directory);
+    }
+    directory = getenv("XDG_CACHE_HOME");
+    if (directory != NULL && directory[0] != '\0') return joinPath(directory, "clox");
+    directory = getenv("HOME");
+    if (directory != NULL && directory[0] != '\0') return joinPath(directory, ".cache/clox");
+    return NULL;
+}
+
+/* mkdir -p. */
+static bool makeDirectories(char* path) {
+    for (char* slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash != NULL) *slash = '\0';
+        bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        if (slash != NULL) *slash = '/';
+        if (!ok) return false;
+        if (slash == NULL) return true;
+    }
+}
+
+typedef struct {
+    char* path;
+    time_t used;
+    off_t size;
+} CacheEntry;
+
+static int compareEntries(const void* a, const void* b) {
+    time_t usedA = ((const CacheEntry*)a)->used;
+    time_t usedB = ((const CacheEntry*)b)->used;
+    return (usedA > usedB) - (usedA < usedB);
+}
+
+/* Deletes least recently used entries, never `keep`, until the cache is
+   within CACHE_LIMIT. Runs after each write, i.e. only on misses. */
+static void evict(const char* directory, const char* keep) {
+    DIR* dir = opendir(directory);
+    if (dir == NULL) return;
+    CacheEntry* entries = NULL;
+    int count = 0;
+    int capacity = 0;
+    off_t total = 0;
+    struct dirent* dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        size_t length = strlen(dirent->d_name);
+        if (length < 5 || strcmp(dirent->d_name + length - 5, ".loxc") != 0) continue;
+        char* path = joinPath(directory, dirent->d_name);
+        struct stat info;
+        bool kept = strcmp(path, keep) == 0;
+        if (stat(path, &info) != 0 || kept) {
+            if (kept) total += info.st_size;
+            free(path);
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity < 16 ? 16 : capacity * 2;
+            entries = realloc(entries, sizeof(CacheEntry) * capacity);
+        }
+        entries[count].path = path;
+        entries[count].used = info.st_mtime;
+        entries[count].size = info.st_size;
+        count++;
+        total += info.st_size;
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof(CacheEntry), compareEntries);
+    for (int i = 0; i < count; i++) {
+        if (total > CACHE_LIMIT && unlink(entries[i].path) == 0) {
+            total -= entries[i].size;
+        }
+        free(entries[i].path);
+    }
+    free(entries);
+}
+
+InterpretResult interpretCached(const char* source) {
+    char* directory = cacheDirectory();
+    if (directory == NULL) return interpret(source);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.loxc", (unsigned long long)cacheKey(source));
+    char* path = joinPath(directory, name);
+
+    InterpretResult result;
+    LoxcFile file;
+    if (loadLoxcFile(path, &file) == NULL) {
+        utime(path, NULL);
+        result = interpretChunk(&file.chunk);
+        closeLoxcFile(&file);
+    } else {
+        /* A missing or unreadable entry is just a miss; the write below
+           replaces a bad one. */
+        Chunk chunk;
+        if (!compileSource(source, &chunk)) {
+            result = INTERPRET_COMPILE_ERROR;
+        } else {
+            if (makeDirectories(directory) && writeLoxcFile(&chunk, path)) {
+                evict(directory, path);
+            }
+            result = interpretChunk(&chunk);
+            freeChunk(&chunk);
+        }
+    }
+    free(path);
+    free(directory);
+    return result;
+}
+
+#endif
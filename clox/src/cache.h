@@ -0,0 +1,30 @@
+/**
+ * cache.h - Content-addressed cache of compiled scripts.
+ *
+ * runFile() goes through interpretCached() unless clox is started with
+ * --no-cache. The first run of a script compiles it as usual and saves
+ * the chunk as a .loxc file named after a hash of the source and of the
+ * clox build; later runs of the unchanged script map that file instead
+ * of scanning and compiling.
+ *
+ * The cache lives in $CLOX_CACHE_DIR, else $XDG_CACHE_HOME/clox, else
+ * ~/.cache/clox. Files are written atomically, so several clox processes
+ * can share it, and the least recently used ones are deleted once it
+ * grows past CACHE_LIMIT bytes.
+ */
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "vm.h"
+
+/* Bytes of .loxc files kept; override with -DCACHE_LIMIT=... */
+#ifndef CACHE_LIMIT
+#define CACHE_LIMIT (64 * 1024 * 1024)
+#endif
+
+/* Like interpret(), but through the cache. Needs a VM with no globals
+   defined yet, as loadLoxcFile() does. Falls back to interpret() if there
+   is no usable cache directory (and always on Windows). */
+InterpretResult interpretCached(const char* source);
+
+#endif
@@ -3,9 +3,12 @@
  * 
  * The chunk grows dynamically as we add instructions.
  * writeChunk adds a byte; addConstant adds a value and returns its index.
+ * Lines are stored as runs rather than one int per byte: a statement
+ * compiles to many bytes on the same line, so this is a fraction of the
+ * size of the code instead of four times it.
  */
 #include "chunk.h"
-#include <stdlib.h>
+#include "memory.h"
 #include <string.h>
 
 void initChunk(Chunk* chunk) {
@@ -13,12 +16,15 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->maxStack = 0;
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-    free(chunk->code);
-    free(chunk->lines);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(LineRun, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -26,16 +32,52 @@ void freeChunk(Chunk* chunk) {
 void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
-        chunk->capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
-        chunk->code = realloc(chunk->code, chunk->capacity);
-        chunk->lines = realloc(chunk->lines, sizeof(int) * chunk->capacity);
+        chunk->capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    if (chunk->lineCount == 0 || chunk->lines[chunk->lineCount - 1].line != line) {
+        if (chunk->lineCapacity < chunk->lineCount + 1) {
+            int oldCapacity = chunk->lineCapacity;
+            chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+            chunk->lines = GROW_ARRAY(LineRun, chunk->lines, oldCapacity,
+                                      chunk->lineCapacity);
+        }
+        LineRun* run = &chunk->lines[chunk->lineCount++];
+        run->offset = chunk->count;
+        run->line = line;
+    }
     chunk->count++;
 }
 
+/* Inserts `byte` before the one at `offset`, as part of the same line as
+   the byte before it. Used to widen an already written operand. */
+void insertByte(Chunk* chunk, int offset, uint8_t byte) {
+    writeChunk(chunk, 0, getLine(chunk, chunk->count - 1));
+    memmove(chunk->code + offset + 1, chunk->code + offset,
+            chunk->count - 1 - offset);
+    chunk->code[offset] = byte;
+    for (int i = chunk->lineCount - 1; i > 0 && chunk->lines[i].offset >= offset; i--) {
+        chunk->lines[i].offset++;
+    }
+}
+
 int addConstant(Chunk* chunk, Value value) {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1;
 }
+
+/* Binary search for the last run starting at or before `offset`. */
+int getLine(Chunk* chunk, int offset) {
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
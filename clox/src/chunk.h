@@ -4,9 +4,15 @@
  * A chunk is the compiled form of a Lox program. It contains:
  * - code: array of opcodes (bytes)
  * - constants: array of values (numbers, strings) - instructions reference by index
- * - lines: source line number for each instruction (for error reporting)
+ * - lines: run-length encoded source lines (for error reporting); look
+ *   one up with getLine()
+ * - maxStack: computed by the compiler so the VM can size its stack once
  * 
  * Think of it like: code[0]=OP_CONSTANT, code[1]=0 means "load constant at index 0"
+ *
+ * Operands are big-endian. Constant indexes, global slots and jump offsets
+ * have a _LONG form with a 3-byte operand; the compiler only uses it when
+ * the short form can't hold the value, so small scripts never see it.
  */
 #ifndef clox_chunk_h
 #define clox_chunk_h
@@ -17,18 +23,25 @@
 // Opcodes - each byte in the chunk's code array
 typedef enum {
     OP_CONSTANT,   // Push constant onto stack (1 byte: constant index)
+    OP_CONSTANT_LONG, // Push constant onto stack (3 bytes: constant index)
     OP_NIL,        // Push nil
     OP_TRUE,       // Push true
     OP_FALSE,      // Push false
     OP_POP,        // Pop and discard top of stack
     OP_GET_LOCAL,  // Get local variable (1 byte: slot index)
     OP_SET_LOCAL,  // Set local variable (1 byte: slot index)
-    OP_GET_GLOBAL, // Get global variable (1 byte: constant index for name)
-    OP_DEFINE_GLOBAL,
-    OP_SET_GLOBAL,
+    OP_GET_GLOBAL_SLOT,    // Get global variable (2 bytes: global slot index)
+    OP_DEFINE_GLOBAL_SLOT, // Define global variable (2 bytes: global slot index)
+    OP_SET_GLOBAL_SLOT,    // Set global variable (2 bytes: global slot index)
+    OP_GET_GLOBAL_LONG,    // As above with 3-byte slot indexes, for slots
+    OP_DEFINE_GLOBAL_LONG, // past UINT16_MAX
+    OP_SET_GLOBAL_LONG,
     OP_EQUAL,      // Pop two, push a == b
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,     // !(a == b); produced by the optimizer
+    OP_GREATER_EQUAL, // !(a < b); produced by the optimizer
+    OP_LESS_EQUAL,    // !(a > b); produced by the optimizer
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -37,22 +50,55 @@ typedef enum {
     OP_NEGATE,     // Unary minus
     OP_PRINT,      // Pop and print
     OP_JUMP,       // Unconditional jump (2 bytes)
-    OP_JUMP_IF_FALSE,  // Pop, jump if falsy (2 bytes)
+    OP_JUMP_IF_FALSE,  // Jump if top is falsy, leaving it pushed (2 bytes)
     OP_LOOP,       // Jump backward (2 bytes)
+    OP_JUMP_LONG,          // The three jumps above with 3-byte offsets, for
+    OP_JUMP_IF_FALSE_LONG, // code too long for 16 bits
+    OP_LOOP_LONG,
+    /* Superinstructions, only produced by the optimizer. */
+    OP_SET_LOCAL_POP,   // OP_SET_LOCAL + OP_POP (1 byte: slot index)
+    OP_SET_GLOBAL_POP,  // OP_SET_GLOBAL_SLOT + OP_POP (2 bytes: global slot)
+    OP_INCREMENT_LOCAL,  // local += constant (1 byte: slot, 1 byte: constant)
+    OP_INCREMENT_GLOBAL, // global += constant (2 bytes: slot, 1 byte: constant)
+    OP_POP_JUMP_IF_FALSE, // Pop, jump if falsy (2 bytes)
+    OP_JUMP_IF_NOT_LESS_CONST,    // Pop a, jump unless a < constant (1 + 2 bytes)
+    OP_JUMP_IF_NOT_GREATER_CONST, // Pop a, jump unless a > constant (1 + 2 bytes)
+    /* Quickened forms, only written by the VM into a running chunk: the
+       generic opcode rewrites itself to one of these after seeing two
+       numbers, and they rewrite themselves back when that stops holding. */
+    OP_ADD_NUM,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_LESS_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_GREATER_EQUAL_NUM,
     OP_RETURN,     // Return from script
 } OpCode;
 
+// Every byte from `offset` up to the next run's offset is from `line`.
+typedef struct {
+    int offset;
+    int line;
+} LineRun;
+
 typedef struct {
     int count;      // Number of used elements
     int capacity;   // Allocated size
     uint8_t* code;
-    int* lines;     // Line number for each instruction
+    LineRun* lines; // One run per change of line, in offset order
+    int lineCount;
+    int lineCapacity;
+    int maxStack;   // Deepest operand stack the code can reach
     ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void insertByte(Chunk* chunk, int offset, uint8_t byte);
 int addConstant(Chunk* chunk, Value value);
+int getLine(Chunk* chunk, int offset);
 
 #endif
@@ -2,9 +2,40 @@
  * clox.c - Main entry point for the Lox bytecode VM.
  * 
  * Usage:
- *   clox           - REPL
- *   clox script    - Run file
+ *   clox [-O] [--jit] [--trace-jit] [gc options] [--huge-pages]          - REPL
+ *   clox [-O] [--jit] [--trace-jit] [gc options] [--huge-pages] [--no-cache] script   - Run file
+ *   clox [-O] --emit-c out.c script          - Translate file to C
+ *   clox [-O] --compile out.loxc script      - Compile file to bytecode
+ *   clox [--jit] [--trace-jit] [--huge-pages] file.loxc     - Run compiled bytecode
+ *
+ *   -O     run the peephole optimizer on compiled bytecode
+ *   --jit  run chunks as x86-64 machine code, falling back to the
+ *          interpreter where the JIT is unavailable
+ *   --trace-jit  interpret, but record hot loops as traces and run
+ *          those as machine code
+ *   --emit-c  write a standalone C program for the script instead of
+ *          running it (see emitc.h for how to build it)
+ *   --compile  save the compiled bytecode instead of running it; a
+ *          path ending in .loxc is run as such a file (see loxc.h)
+ *   --huge-pages  back the VM's slabs and big blocks with transparent
+ *          huge pages where the OS offers them (see allocator.h)
+ *   --no-cache  always compile the script, neither reading nor writing
+ *          the compile cache (see cache.h)
+ *
+ * gc options:
+ *   --gc-stress  collect garbage before every allocation, to shake out
+ *          objects the collector can't see (see memory.h)
+ *   --gc-generational  allocate new objects in a nursery that is emptied
+ *          by cheap minor collections, promoting what survives
+ *   --gc-incremental  collect the old heap in short slices between
+ *          allocations instead of all at once
+ *   --gc-pause us  the longest a slice should take, in microseconds
+ *          (default 500); implies --gc-incremental
+ *   --gc-stats  print a histogram of each collection's pauses
  */
+#include "cache.h"
+#include "emitc.h"
+#include "loxc.h"
 #include "vm.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +43,8 @@
 
 #define LINE_BUF_SIZE 1024
 
+static bool useCache = true;
+
 static void repl(void) {
     char line[LINE_BUF_SIZE];
     printf("Lox Bytecode VM - Type exit to quit\n");
@@ -47,22 +80,115 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
+static bool hasExtension(const char* path, const char* extension) {
+    size_t length = strlen(path);
+    size_t extensionLength = strlen(extension);
+    return length >= extensionLength &&
+           strcmp(path + length - extensionLength, extension) == 0;
+}
+
+static void runCompiledFile(const char* path) {
+    LoxcFile file;
+    const char* problem = loadLoxcFile(path, &file);
+    if (problem != NULL) {
+        fprintf(stderr, "Could not load \"%s\": %s.\n", path, problem);
+        exit(65);
+    }
+    InterpretResult result = interpretChunk(&file.chunk);
+    closeLoxcFile(&file);
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
 static void runFile(const char* path) {
+    if (hasExtension(path, ".loxc")) {
+        runCompiledFile(path);
+        return;
+    }
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+    InterpretResult result = useCache ? interpretCached(source) : interpret(source);
     free(source);
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void emitFile(const char* path, const char* outPath) {
+    char* source = readFile(path);
+    FILE* out = fopen(outPath, "w");
+    if (!out) {
+        fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+        exit(74);
+    }
+    InterpretResult result = emitC(source, out);
+    fclose(out);
+    free(source);
+    if (result == INTERPRET_COMPILE_ERROR) {
+        remove(outPath);
+        exit(65);
+    }
+}
+
+static void compileFile(const char* path, const char* outPath) {
+    char* source = readFile(path);
+    InterpretResult result = compileToFile(source, outPath);
+    free(source);
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+}
+
 int main(int argc, char* argv[]) {
     initVM();
-    if (argc == 1) {
+    const char* emitPath = NULL;
+    const char* compilePath = NULL;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-O") == 0) {
+            vm.optimize = true;
+        } else if (strcmp(argv[arg], "--jit") == 0) {
+            vm.jit = true;
+        } else if (strcmp(argv[arg], "--trace-jit") == 0) {
+            vm.traceJit = true;
+        } else if (strcmp(argv[arg], "--gc-stress") == 0) {
+            vm.gcStress = true;
+        } else if (strcmp(argv[arg], "--gc-generational") == 0) {
+            vm.generational = true;
+        } else if (strcmp(argv[arg], "--gc-incremental") == 0) {
+            vm.incremental = true;
+        } else if (strcmp(argv[arg], "--gc-pause") == 0 && arg + 1 < argc) {
+            vm.incremental = true;
+            vm.pauseTarget = strtod(argv[++arg], NULL);
+        } else if (strcmp(argv[arg], "--gc-stats") == 0) {
+            vm.logGCStats = true;
+        } else if (strcmp(argv[arg], "--huge-pages") == 0) {
+            vm.allocator.hugePages = true;
+        } else if (strcmp(argv[arg], "--no-cache") == 0) {
+            useCache = false;
+        } else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc) {
+            emitPath = argv[++arg];
+        } else if (strcmp(argv[arg], "--compile") == 0 && arg + 1 < argc) {
+            compilePath = argv[++arg];
+        } else {
+            fprintf(stderr, "Unknown option '%s'.\n", argv[arg]);
+            fprintf(stderr, "Usage: clox [-O] [--jit] [--trace-jit] [gc options] [--huge-pages] [--no-cache] [script]\n");
+            exit(64);
+        }
+    }
+    if (emitPath != NULL) {
+        if (arg != argc - 1) {
+            fprintf(stderr, "Usage: clox [-O] --emit-c out.c script\n");
+            exit(64);
+        }
+        emitFile(argv[arg], emitPath);
+    } else if (compilePath != NULL) {
+        if (arg != argc - 1) {
+            fprintf(stderr, "Usage: clox [-O] --compile out.loxc script\n");
+            exit(64);
+        }
+        compileFile(argv[arg], compilePath);
+    } else if (arg == argc) {
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (arg == argc - 1) {
+        runFile(argv[arg]);
     } else {
-        fprintf(stderr, "Usage: clox [script]\n");
+        fprintf(stderr, "Usage: clox [-O] [--jit] [--trace-jit] [gc options] [--huge-pages] [--no-cache] [script]\n");
         exit(64);
     }
     freeVM();
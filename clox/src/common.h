@@ -4,6 +4,11 @@
  * This header is included by all clox source files. It defines:
  * - DEBUG_PRINT_CODE: when enabled, disassembles bytecode on compile
  * - DEBUG_TRACE_EXECUTION: when enabled, traces each VM instruction
+ * - DEBUG_OPCODE_PAIRS: when enabled, profiles adjacent opcode pairs
+ * - DEBUG_PRINT_TRACES: when enabled, dumps each compiled trace's IR
+ * - DEBUG_LOG_GC: when enabled, logs each collection and freed object
+ * - NAN_BOXING: pack every Value into a single 64-bit word
+ * - COMPUTED_GOTO: threaded instruction dispatch in the VM
  * - Common integer types and limits
  */
 #ifndef clox_common_h
@@ -13,10 +18,40 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define UINT8_COUNT (UINT8_MAX + 1)
+// Largest 3-byte (_LONG) operand
+#define UINT24_MAX 0xffffff
+
 // Set to 1 to print bytecode when compiling
 #define DEBUG_PRINT_CODE 0
 
 // Set to 1 to trace each instruction as VM executes
 #define DEBUG_TRACE_EXECUTION 0
 
+// Set to 1 to count executed opcode pairs and print the most frequent
+// ones at exit (used to pick superinstructions)
+#define DEBUG_OPCODE_PAIRS 0
+
+// Set to 1 to print the optimized IR of each trace (--trace-jit)
+#define DEBUG_PRINT_TRACES 0
+
+// Set to 1 to log the garbage collector's marks and frees
+#define DEBUG_LOG_GC 0
+
+// NaN-boxed 8-byte Values. Build with -DNAN_BOXING=0 for the 16-byte
+// tagged-union representation.
+#ifndef NAN_BOXING
+#define NAN_BOXING 1
+#endif
+
+// Threaded dispatch via labels-as-values (GCC/Clang). Build with
+// -DCOMPUTED_GOTO=0 to force the portable switch loop.
+#ifndef COMPUTED_GOTO
+#if defined(__GNUC__)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+#endif
+
 #endif
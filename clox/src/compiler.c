@@ -1,10 +1,19 @@
 /**
  * compiler.c - Recursive descent compiler for Lox.
  * Emits bytecode directly (no AST).
+ *
+ * Tables that only matter while compiling (constant deduplication, and
+ * the names and string literals already resolved) live in an arena that
+ * is dropped as compile() returns. So does the constant pool, which is
+ * copied into the chunk in one pass at the end. Code and line runs grow
+ * in the chunk itself: copying them out of an arena would only add a
+ * pass.
  */
 #include "compiler.h"
 #include "scanner.h"
+#include "memory.h"
 #include "object.h"
+#include "vm.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,7 +25,58 @@ typedef struct {
     bool panicMode;
 } Parser;
 
+/* A block-scoped variable living in a VM stack slot. depth is -1 while
+   its initializer is being compiled. */
+typedef struct {
+    Token name;
+    int depth;
+} Local;
+
+/* Maps each value already in the constant pool to its index, so a
+   literal that appears many times is stored once. Open addressing with
+   linear probing, like table.c; there are no deletions. */
+typedef struct {
+    Value key;
+    int index;         /* -1 for an empty slot */
+} ConstantEntry;
+
+typedef struct {
+    int count;
+    int capacity;
+    ConstantEntry* entries;
+} ConstantTable;
+
+/* Maps source text to what it resolved to the first time it was seen,
+   so a name or literal that recurs is not interned and looked up again. */
+typedef struct {
+    const char* start;  /* NULL for an empty slot; points into the source */
+    int length;
+    uint32_t hash;
+    int value;          /* -1 until the caller fills it in */
+} LexemeEntry;
+
+typedef struct {
+    int count;
+    int capacity;
+    LexemeEntry* entries;
+} LexemeTable;
+
+typedef struct {
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;    /* 0 = top level, where variables are globals */
+    int stackDepth;    /* operand-stack depth at the current emit point */
+    Arena arena;       /* everything below; freed when compile() returns */
+    ConstantTable constants;
+    LexemeTable globals;   /* identifier -> global slot */
+    LexemeTable strings;   /* string literal -> constant index */
+    Value* pool;       /* constants not yet copied into the chunk */
+    int poolCount;
+    int poolCapacity;
+} Compiler;
+
 static Parser parser;
+static Compiler* current = NULL;
 static Chunk* compilingChunk;
 
 static void errorAt(Token* token, const char* message) {
@@ -60,41 +120,390 @@ static void consume(TokenType type, const char* message) {
     errorAtCurrent(message);
 }
 
+/* Most bytes fit in the chunk's spare capacity and continue the current
+   line run; only the rest need writeChunk() to grow something. */
 static void emitByte(uint8_t byte, int line) {
-    writeChunk(compilingChunk, byte, line);
+    Chunk* chunk = compilingChunk;
+    if (chunk->count < chunk->capacity &&
+        chunk->lines[chunk->lineCount - 1].line == line) {
+        chunk->code[chunk->count++] = byte;
+        return;
+    }
+    writeChunk(chunk, byte, line);
+}
+
+/* Net effect of each opcode on the operand stack. */
+static const int stackEffects[] = {
+    [OP_CONSTANT] = 1,
+    [OP_CONSTANT_LONG] = 1,
+    [OP_NIL] = 1,
+    [OP_TRUE] = 1,
+    [OP_FALSE] = 1,
+    [OP_POP] = -1,
+    [OP_GET_LOCAL] = 1,
+    [OP_SET_LOCAL] = 0,
+    [OP_GET_GLOBAL_SLOT] = 1,
+    [OP_DEFINE_GLOBAL_SLOT] = -1,
+    [OP_SET_GLOBAL_SLOT] = 0,
+    [OP_GET_GLOBAL_LONG] = 1,
+    [OP_DEFINE_GLOBAL_LONG] = -1,
+    [OP_SET_GLOBAL_LONG] = 0,
+    [OP_EQUAL] = -1,
+    [OP_GREATER] = -1,
+    [OP_LESS] = -1,
+    [OP_NOT_EQUAL] = -1,
+    [OP_GREATER_EQUAL] = -1,
+    [OP_LESS_EQUAL] = -1,
+    [OP_ADD] = -1,
+    [OP_SUBTRACT] = -1,
+    [OP_MULTIPLY] = -1,
+    [OP_DIVIDE] = -1,
+    [OP_NOT] = 0,
+    [OP_NEGATE] = 0,
+    [OP_PRINT] = -1,
+    [OP_JUMP] = 0,
+    [OP_JUMP_IF_FALSE] = 0,
+    [OP_LOOP] = 0,
+    [OP_JUMP_LONG] = 0,
+    [OP_JUMP_IF_FALSE_LONG] = 0,
+    [OP_LOOP_LONG] = 0,
+    [OP_SET_LOCAL_POP] = -1,
+    [OP_SET_GLOBAL_POP] = -1,
+    [OP_INCREMENT_LOCAL] = 0,
+    [OP_INCREMENT_GLOBAL] = 0,
+    [OP_POP_JUMP_IF_FALSE] = -1,
+    [OP_JUMP_IF_NOT_LESS_CONST] = -1,
+    [OP_JUMP_IF_NOT_GREATER_CONST] = -1,
+    [OP_ADD_NUM] = -1,
+    [OP_SUBTRACT_NUM] = -1,
+    [OP_MULTIPLY_NUM] = -1,
+    [OP_DIVIDE_NUM] = -1,
+    [OP_LESS_NUM] = -1,
+    [OP_GREATER_NUM] = -1,
+    [OP_LESS_EQUAL_NUM] = -1,
+    [OP_GREATER_EQUAL_NUM] = -1,
+    [OP_RETURN] = 0,
+};
+
+/* Tracks the operand-stack depth as code is emitted, so the chunk can
+   record the deepest point the VM will ever reach. */
+static void adjustStack(int delta) {
+    current->stackDepth += delta;
+    if (current->stackDepth > compilingChunk->maxStack) {
+        compilingChunk->maxStack = current->stackDepth;
+    }
+}
+
+static void emitOp(uint8_t op, int line) {
+    emitByte(op, line);
+    adjustStack(stackEffects[op]);
+}
+
+static void emitBytes(uint8_t op, uint8_t operand, int line) {
+    emitOp(op, line);
+    emitByte(operand, line);
+}
+
+/* Writes the low `bytes` bytes of `operand`, most significant first. */
+static void emitOperand(int operand, int bytes, int line) {
+    for (int byte = bytes - 1; byte >= 0; byte--) {
+        emitByte((operand >> (8 * byte)) & 0xff, line);
+    }
+}
+
+/* Constants are matched by bit pattern rather than valuesEqual, which
+   keeps 0 and -0 apart and lets a NaN literal match itself. */
+static uint64_t constantBits(Value value) {
+#if NAN_BOXING
+    return value;
+#else
+    if (IS_OBJ(value)) return (uint64_t)(uintptr_t)AS_OBJ(value);
+    if (IS_BOOL(value)) return AS_BOOL(value);
+    uint64_t bits = 0;
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        memcpy(&bits, &number, sizeof(bits));
+    }
+    return bits;
+#endif
+}
+
+static bool sameConstant(Value a, Value b) {
+#if NAN_BOXING
+    return a == b;
+#else
+    return a.type == b.type && constantBits(a) == constantBits(b);
+#endif
+}
+
+static ConstantEntry* findConstant(ConstantEntry* entries, int capacity, Value key) {
+    /* Fibonacci hashing: the top half of the product depends on every
+       bit, and number literals differ mostly in their high bits. */
+    uint32_t index = (uint32_t)((constantBits(key) * 0x9e3779b97f4a7c15u) >> 32) &
+                     (capacity - 1);
+    for (;;) {
+        ConstantEntry* entry = &entries[index];
+        if (entry->index == -1 || sameConstant(entry->key, key)) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+/* Arena tables are never freed one by one: an outgrown one is left for
+   the arena to drop with the rest. */
+static void growConstants(ConstantTable* table) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    ConstantEntry* entries = arenaAllocate(&current->arena, sizeof(ConstantEntry) * capacity);
+    for (int i = 0; i < capacity; i++) entries[i].index = -1;
+    for (int i = 0; i < table->capacity; i++) {
+        ConstantEntry* entry = &table->entries[i];
+        if (entry->index != -1) *findConstant(entries, capacity, entry->key) = *entry;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+static int addToPool(Value value) {
+    if (current->poolCount == current->poolCapacity) {
+        int capacity = GROW_CAPACITY(current->poolCapacity);
+        Value* pool = arenaAllocate(&current->arena, sizeof(Value) * capacity);
+        if (current->poolCount > 0) memcpy(pool, current->pool, sizeof(Value) * current->poolCount);
+        current->pool = pool;
+        current->poolCapacity = capacity;
+    }
+    current->pool[current->poolCount++] = value;
+    return compilingChunk->constants.count + current->poolCount - 1;
+}
+
+/* Index of `value` in the constant pool, adding it the first time. */
+static int makeConstant(Value value) {
+    ConstantTable* table = &current->constants;
+    if (table->count + 1 > table->capacity * 3 / 4) growConstants(table);
+    ConstantEntry* entry = findConstant(table->entries, table->capacity, value);
+    if (entry->index == -1) {
+        entry->key = value;
+        entry->index = addToPool(value);
+        table->count++;
+    }
+    return entry->index;
+}
+
+/* Moves the pool into the chunk with one exactly sized copy. */
+static void finishConstants(void) {
+    ValueArray* constants = &compilingChunk->constants;
+    int count = constants->count + current->poolCount;
+    if (count > constants->capacity) {
+        constants->values = GROW_ARRAY(Value, constants->values, constants->capacity, count);
+        constants->capacity = count;
+    }
+    if (current->poolCount > 0) {
+        memcpy(constants->values + constants->count, current->pool,
+               sizeof(Value) * current->poolCount);
+    }
+    constants->count = count;
+    current->poolCount = 0;
+}
+
+static LexemeEntry* findLexeme(LexemeEntry* entries, int capacity,
+                               const char* start, int length, uint32_t hash) {
+    uint32_t index = hash & (capacity - 1);
+    for (;;) {
+        LexemeEntry* entry = &entries[index];
+        if (entry->start == NULL ||
+            (entry->hash == hash && entry->length == length &&
+             memcmp(entry->start, start, length) == 0)) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
 }
 
-static void emitBytes(uint8_t b1, uint8_t b2, int line) {
-    emitByte(b1, line);
-    emitByte(b2, line);
+static void growLexemes(LexemeTable* table) {
+    int capacity = GROW_CAPACITY(table->capacity);
+    LexemeEntry* entries = arenaAllocate(&current->arena, sizeof(LexemeEntry) * capacity);
+    for (int i = 0; i < capacity; i++) entries[i].start = NULL;
+    for (int i = 0; i < table->capacity; i++) {
+        LexemeEntry* entry = &table->entries[i];
+        if (entry->start == NULL) continue;
+        *findLexeme(entries, capacity, entry->start, entry->length, entry->hash) = *entry;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+/* The entry for this text, added with value -1 the first time. */
+static LexemeEntry* findOrAddLexeme(LexemeTable* table, const char* start, int length) {
+    if (table->count + 1 > table->capacity * 3 / 4) growLexemes(table);
+    uint32_t hash = hashString(start, length);
+    LexemeEntry* entry = findLexeme(table->entries, table->capacity, start, length, hash);
+    if (entry->start == NULL) {
+        entry->start = start;
+        entry->length = length;
+        entry->hash = hash;
+        entry->value = -1;
+        table->count++;
+    }
+    return entry;
+}
+
+static void emitConstantIndex(int constant, int line) {
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CONSTANT, (uint8_t)constant, line);
+    } else if (constant <= UINT24_MAX) {
+        emitOp(OP_CONSTANT_LONG, line);
+        emitOperand(constant, 3, line);
+    } else {
+        error("Too many constants in one chunk.");
+    }
 }
 
 static void emitConstant(Value value, int line) {
-    emitBytes(OP_CONSTANT, (uint8_t)addConstant(compilingChunk, value), line);
+    emitConstantIndex(makeConstant(value), line);
 }
 
 static int emitJump(uint8_t op, int line) {
-    emitByte(op, line);
+    emitOp(op, line);
     emitByte(0xff, line);
     emitByte(0xff, line);
     return compilingChunk->count - 2;
 }
 
+static bool isLongJump(uint8_t op) {
+    return op == OP_JUMP_LONG || op == OP_JUMP_IF_FALSE_LONG;
+}
+
+/* Forward jumps are emitted with a 2-byte offset and widened to the _LONG
+   form once their target turns out to be further away. Widening inserts
+   a byte after the operand, moving all later code along, so it has to
+   happen before anything that jumps across or onto that point is emitted:
+   `extra` is how many more bytes will be written before the jump's
+   target. */
+static void fitJump(int offset, int extra) {
+    uint8_t op = compilingChunk->code[offset - 1];
+    if (isLongJump(op)) return;
+    if (compilingChunk->count + extra - offset - 2 <= UINT16_MAX) return;
+    compilingChunk->code[offset - 1] = op == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG;
+    insertByte(compilingChunk, offset + 2, 0xff);
+}
+
+/* Length of the operand of the jump whose operand starts at `offset`. */
+static int jumpOperandLength(int offset) {
+    return isLongJump(compilingChunk->code[offset - 1]) ? 3 : 2;
+}
+
+static void setJump(int offset, int target) {
+    int bytes = jumpOperandLength(offset);
+    int jump = target - offset - bytes;
+    if (jump > UINT24_MAX) {
+        error("Too much code to jump over.");
+        return;
+    }
+    for (int byte = 0; byte < bytes; byte++) {
+        compilingChunk->code[offset + byte] = (jump >> (8 * (bytes - 1 - byte))) & 0xff;
+    }
+}
+
 static void patchJump(int offset) {
-    int jump = compilingChunk->count - offset - 2;
-    compilingChunk->code[offset] = (jump >> 8) & 0xff;
-    compilingChunk->code[offset + 1] = jump & 0xff;
+    fitJump(offset, 0);
+    setJump(offset, compilingChunk->count);
+}
+
+static void emitLoop(int loopStart, int line) {
+    int offset = compilingChunk->count + 3 - loopStart;
+    if (offset <= UINT16_MAX) {
+        emitOp(OP_LOOP, line);
+        emitOperand(offset, 2, line);
+        return;
+    }
+    offset++;
+    if (offset > UINT24_MAX) error("Loop body too large.");
+    emitOp(OP_LOOP_LONG, line);
+    emitOperand(offset, 3, line);
+}
+
+/* Globals are bound to VM slots at compile time, so the name never needs
+   to reach the constant pool or be looked up at runtime. Each name is
+   interned only the first time this compile sees it. */
+static int globalVariable(Token* name) {
+    LexemeEntry* entry = findOrAddLexeme(&current->globals, name->start, name->length);
+    if (entry->value == -1) {
+        entry->value = globalSlot(copyString(name->start, name->length));
+    }
+    int slot = entry->value;
+    if (slot > UINT24_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return slot;
 }
 
-static void patchJumpBack(int offset) {
-    int jump = offset - compilingChunk->count - 2;
-    compilingChunk->code[offset] = (jump >> 8) & 0xff;
-    compilingChunk->code[offset + 1] = jump & 0xff;
+/* `op` is the 2-byte form; slots past it use the matching _LONG op. */
+static void emitGlobalOp(uint8_t op, int slot, int line) {
+    if (slot <= UINT16_MAX) {
+        emitOp(op, line);
+        emitOperand(slot, 2, line);
+        return;
+    }
+    switch (op) {
+        case OP_GET_GLOBAL_SLOT: op = OP_GET_GLOBAL_LONG; break;
+        case OP_DEFINE_GLOBAL_SLOT: op = OP_DEFINE_GLOBAL_LONG; break;
+        default: op = OP_SET_GLOBAL_LONG; break;
+    }
+    emitOp(op, line);
+    emitOperand(slot, 3, line);
 }
 
-static uint8_t identifierConstant(Token* name) {
-    ObjString* str = copyString(name->start, name->length);
-    return (uint8_t)addConstant(compilingChunk, OBJ_VAL(str));
+static bool identifiersEqual(Token* a, Token* b) {
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+/* Returns the stack slot of the innermost local with this name, or -1 if
+   the name refers to a global. */
+static int resolveLocal(Token* name) {
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        Local* local = &current->locals[i];
+        if (identifiersEqual(name, &local->name)) {
+            if (local->depth == -1) {
+                error("Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void addLocal(Token name) {
+    if (current->localCount == UINT8_COUNT) {
+        error("Too many local variables in scope.");
+        return;
+    }
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;
+}
+
+static void declareLocal(Token* name) {
+    for (int i = current->localCount - 1; i >= 0; i--) {
+        Local* local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth) break;
+        if (identifiersEqual(name, &local->name)) {
+            error("Already a variable with this name in this scope.");
+        }
+    }
+    addLocal(*name);
+}
+
+static void beginScope(void) {
+    current->scopeDepth++;
+}
+
+/* Locals of the closing block are popped off the VM stack. */
+static void endScope(int line) {
+    current->scopeDepth--;
+    while (current->localCount > 0 &&
+           current->locals[current->localCount - 1].depth > current->scopeDepth) {
+        emitOp(OP_POP, line);
+        current->localCount--;
+    }
 }
 
 static void expression(void);
@@ -110,17 +519,28 @@ static void parsePrecedence1(void) {
     if (match(TOKEN_BANG) || match(TOKEN_MINUS)) {
         TokenType op = parser.previous.type;
         parsePrecedence1();
-        if (op == TOKEN_BANG) emitByte(OP_NOT, parser.previous.line);
-        else emitByte(OP_NEGATE, parser.previous.line);
+        if (op == TOKEN_BANG) emitOp(OP_NOT, parser.previous.line);
+        else emitOp(OP_NEGATE, parser.previous.line);
         return;
     }
-    if (match(TOKEN_FALSE)) { emitByte(OP_FALSE, parser.previous.line); return; }
-    if (match(TOKEN_TRUE)) { emitByte(OP_TRUE, parser.previous.line); return; }
-    if (match(TOKEN_NIL)) { emitByte(OP_NIL, parser.previous.line); return; }
+    if (match(TOKEN_FALSE)) { emitOp(OP_FALSE, parser.previous.line); return; }
+    if (match(TOKEN_TRUE)) { emitOp(OP_TRUE, parser.previous.line); return; }
+    if (match(TOKEN_NIL)) { emitOp(OP_NIL, parser.previous.line); return; }
     if (match(TOKEN_NUMBER)) {
         emitConstant(NUMBER_VAL(strtod(parser.previous.start, NULL)), parser.previous.line);
         return;
     }
+    if (match(TOKEN_STRING)) {
+        /* Interned the first time, so equal literals share one constant. */
+        const char* chars = parser.previous.start + 1;
+        int length = parser.previous.length - 2;
+        LexemeEntry* entry = findOrAddLexeme(&current->strings, chars, length);
+        if (entry->value == -1) {
+            entry->value = makeConstant(OBJ_VAL(copyString(chars, length)));
+        }
+        emitConstantIndex(entry->value, parser.previous.line);
+        return;
+    }
     if (match(TOKEN_LEFT_PAREN)) {
         expression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
@@ -128,16 +548,27 @@ static void parsePrecedence1(void) {
     }
     if (match(TOKEN_IDENTIFIER)) {
         Token name = parser.previous;
-        uint8_t arg = identifierConstant(&name);
+        int local = resolveLocal(&name);
+        if (local != -1) {
+            if (match(TOKEN_EQUAL)) {
+                expression();
+                emitBytes(OP_SET_LOCAL, (uint8_t)local, parser.previous.line);
+            } else {
+                emitBytes(OP_GET_LOCAL, (uint8_t)local, parser.previous.line);
+            }
+            return;
+        }
+        int slot = globalVariable(&name);
         if (match(TOKEN_EQUAL)) {
             expression();
-            emitBytes(OP_SET_GLOBAL, arg, parser.previous.line);
+            emitGlobalOp(OP_SET_GLOBAL_SLOT, slot, parser.previous.line);
         } else {
-            emitBytes(OP_GET_GLOBAL, arg, parser.previous.line);
+            emitGlobalOp(OP_GET_GLOBAL_SLOT, slot, parser.previous.line);
         }
         return;
     }
-    errorAtCurrent("Expect expression.");
+    advance();  /* consume the bad token so error recovery makes progress */
+    error("Expect expression.");
 }
 
 /* expression with binary ops - loop for * / + - == != < <= > >= */
@@ -146,61 +577,90 @@ static void expression(void) {
     while (1) {
         if (match(TOKEN_STAR)) {
             parsePrecedence1();
-            emitByte(OP_MULTIPLY, parser.previous.line);
+            emitOp(OP_MULTIPLY, parser.previous.line);
         } else if (match(TOKEN_SLASH)) {
             parsePrecedence1();
-            emitByte(OP_DIVIDE, parser.previous.line);
+            emitOp(OP_DIVIDE, parser.previous.line);
         } else if (match(TOKEN_PLUS)) {
             parsePrecedence1();
-            emitByte(OP_ADD, parser.previous.line);
+            emitOp(OP_ADD, parser.previous.line);
         } else if (match(TOKEN_MINUS)) {
             parsePrecedence1();
-            emitByte(OP_SUBTRACT, parser.previous.line);
+            emitOp(OP_SUBTRACT, parser.previous.line);
         } else if (match(TOKEN_EQUAL_EQUAL)) {
             parsePrecedence1();
-            emitByte(OP_EQUAL, parser.previous.line);
+            emitOp(OP_EQUAL, parser.previous.line);
         } else if (match(TOKEN_BANG_EQUAL)) {
             parsePrecedence1();
-            emitByte(OP_EQUAL, parser.previous.line);
-            emitByte(OP_NOT, parser.previous.line);
+            emitOp(OP_EQUAL, parser.previous.line);
+            emitOp(OP_NOT, parser.previous.line);
         } else if (match(TOKEN_LESS)) {
             parsePrecedence1();
-            emitByte(OP_LESS, parser.previous.line);
+            emitOp(OP_LESS, parser.previous.line);
         } else if (match(TOKEN_LESS_EQUAL)) {
             parsePrecedence1();
-            emitByte(OP_GREATER, parser.previous.line);
-            emitByte(OP_NOT, parser.previous.line);
+            emitOp(OP_GREATER, parser.previous.line);
+            emitOp(OP_NOT, parser.previous.line);
         } else if (match(TOKEN_GREATER)) {
             parsePrecedence1();
-            emitByte(OP_GREATER, parser.previous.line);
+            emitOp(OP_GREATER, parser.previous.line);
         } else if (match(TOKEN_GREATER_EQUAL)) {
             parsePrecedence1();
-            emitByte(OP_LESS, parser.previous.line);
-            emitByte(OP_NOT, parser.previous.line);
+            emitOp(OP_LESS, parser.previous.line);
+            emitOp(OP_NOT, parser.previous.line);
         } else {
             break;
         }
     }
 }
 
+/* After an error, skip tokens until a likely statement boundary so one
+   mistake doesn't cascade (or spin forever on the same token). */
+static void synchronize(void) {
+    parser.panicMode = false;
+    while (parser.current.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_SEMICOLON) return;
+        switch (parser.current.type) {
+            case TOKEN_VAR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+                return;
+            default:
+                advance();
+        }
+    }
+}
+
 static void declaration(void) {
     if (match(TOKEN_VAR)) {
         consume(TOKEN_IDENTIFIER, "Expect variable name.");
-        uint8_t arg = identifierConstant(&parser.previous);
+        Token name = parser.previous;
+        int slot = 0;
+        if (current->scopeDepth > 0) {
+            declareLocal(&name);
+        } else {
+            slot = globalVariable(&name);
+        }
         if (match(TOKEN_EQUAL)) {
             expression();
         } else {
-            emitByte(OP_NIL, parser.previous.line);
+            emitOp(OP_NIL, parser.previous.line);
         }
         consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
-        emitBytes(OP_DEFINE_GLOBAL, arg, parser.previous.line);
+        if (current->scopeDepth > 0) {
+            /* The initializer's value stays on the stack as the local's slot. */
+            current->locals[current->localCount - 1].depth = current->scopeDepth;
+        } else {
+            emitGlobalOp(OP_DEFINE_GLOBAL_SLOT, slot, parser.previous.line);
+        }
         return;
     }
     /* statement */
     if (match(TOKEN_PRINT)) {
         expression();
         consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-        emitByte(OP_PRINT, parser.previous.line);
+        emitOp(OP_PRINT, parser.previous.line);
         return;
     }
     if (match(TOKEN_IF)) {
@@ -208,15 +668,18 @@ static void declaration(void) {
         expression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after if condition.");
         int thenJump = emitJump(OP_JUMP_IF_FALSE, parser.previous.line);
-        emitByte(OP_POP, parser.previous.line);
+        emitOp(OP_POP, parser.previous.line);
         declaration();
+        fitJump(thenJump, 4);  /* it lands past the else jump */
         int elseJump = emitJump(OP_JUMP, parser.previous.line);
-        patchJump(thenJump);
-        emitByte(OP_POP, parser.previous.line);
+        adjustStack(1);  /* the jump arrives with the condition still pushed */
+        emitOp(OP_POP, parser.previous.line);
         if (match(TOKEN_ELSE)) {
             declaration();
         }
         patchJump(elseJump);
+        /* Patched last: widening the else jump moves where this lands. */
+        setJump(thenJump, elseJump + jumpOperandLength(elseJump));
         return;
     }
     if (match(TOKEN_WHILE)) {
@@ -225,32 +688,43 @@ static void declaration(void) {
         expression();
         consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
         int exitJump = emitJump(OP_JUMP_IF_FALSE, parser.previous.line);
-        emitByte(OP_POP, parser.previous.line);
+        emitOp(OP_POP, parser.previous.line);
         declaration();
-        {
-            int offset = loopStart - compilingChunk->count - 2;
-            emitByte(OP_LOOP, parser.previous.line);
-            emitByte((offset >> 8) & 0xff, parser.previous.line);
-            emitByte(offset & 0xff, parser.previous.line);
-        }
+        fitJump(exitJump, 4);  /* it lands past the (at most 4-byte) loop */
+        emitLoop(loopStart, parser.previous.line);
         patchJump(exitJump);
-        emitByte(OP_POP, parser.previous.line);
+        adjustStack(1);  /* the jump arrives with the condition still pushed */
+        emitOp(OP_POP, parser.previous.line);
         return;
     }
     if (match(TOKEN_LEFT_BRACE)) {
-        while (parser.current.type != TOKEN_RIGHT_BRACE && !parser.hadError) {
+        beginScope();
+        while (parser.current.type != TOKEN_RIGHT_BRACE && parser.current.type != TOKEN_EOF) {
             declaration();
         }
         consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+        endScope(parser.previous.line);
         return;
     }
     /* Expression statement */
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-    emitByte(OP_POP, parser.previous.line);
+    emitOp(OP_POP, parser.previous.line);
 }
 
 bool compile(const char* source, Chunk* chunk) {
+    Compiler compiler;
+    compiler.localCount = 0;
+    compiler.scopeDepth = 0;
+    compiler.stackDepth = 0;
+    initArena(&compiler.arena);
+    compiler.constants = (ConstantTable){0, 0, NULL};
+    compiler.globals = (LexemeTable){0, 0, NULL};
+    compiler.strings = (LexemeTable){0, 0, NULL};
+    compiler.pool = NULL;
+    compiler.poolCount = 0;
+    compiler.poolCapacity = 0;
+    current = &compiler;
     initScanner(source);
     compilingChunk = chunk;
     parser.hadError = false;
@@ -258,7 +732,21 @@ bool compile(const char* source, Chunk* chunk) {
     advance();
     while (!match(TOKEN_EOF)) {
         declaration();
+        if (parser.panicMode) synchronize();
     }
-    emitByte(OP_RETURN, parser.previous.line);
+    emitOp(OP_RETURN, parser.previous.line);
+    finishConstants();
+    freeArena(&compiler.arena);
+    compilingChunk = NULL;
     return !parser.hadError;
 }
+
+void markCompilerRoots(void) {
+    if (compilingChunk == NULL) return;
+    for (int i = 0; i < compilingChunk->constants.count; i++) {
+        markValue(compilingChunk->constants.values[i]);
+    }
+    for (int i = 0; i < current->poolCount; i++) {
+        markValue(current->pool[i]);
+    }
+}
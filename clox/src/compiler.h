@@ -8,5 +8,7 @@
 #include "chunk.h"
 
 bool compile(const char* source, Chunk* chunk);
+/* Marks the constants of the chunk being compiled, if any. */
+void markCompilerRoots(void);
 
 #endif
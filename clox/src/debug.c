@@ -3,6 +3,7 @@
  */
 #include "debug.h"
 #include "object.h"
+#include "vm.h"
 #include <stdio.h>
 
 static int simpleInstruction(const char* name, int offset) {
@@ -10,12 +11,19 @@ static int simpleInstruction(const char* name, int offset) {
     return offset + 1;
 }
 
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
-    uint8_t constant = chunk->code[offset + 1];
+/* The `bytes`-byte big-endian operand starting at `offset`. */
+static int readOperand(Chunk* chunk, int offset, int bytes) {
+    int operand = 0;
+    for (int i = 0; i < bytes; i++) operand = (operand << 8) | chunk->code[offset + i];
+    return operand;
+}
+
+static int constantInstruction(const char* name, int bytes, Chunk* chunk, int offset) {
+    int constant = readOperand(chunk, offset + 1, bytes);
     printf("%-16s %4d '", name, constant);
     printValue(chunk->constants.values[constant]);
     printf("'\n");
-    return offset + 2;
+    return offset + 1 + bytes;
 }
 
 static int byteInstruction(const char* name, Chunk* chunk, int offset) {
@@ -24,35 +32,86 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
     return offset + 2;
 }
 
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
-    uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
-    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
-    return offset + 3;
+static int globalInstruction(const char* name, int bytes, Chunk* chunk, int offset) {
+    int slot = readOperand(chunk, offset + 1, bytes);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("'\n");
+    return offset + 1 + bytes;
+}
+
+static int jumpInstruction(const char* name, int sign, int bytes, Chunk* chunk,
+                           int offset) {
+    int jump = readOperand(chunk, offset + 1, bytes);
+    int end = offset + 1 + bytes;
+    printf("%-16s %4d -> %d\n", name, offset, end + sign * jump);
+    return end;
+}
+
+static int incrementInstruction(const char* name, int slotBytes, Chunk* chunk,
+                                int offset) {
+    int slot = chunk->code[offset + 1];
+    if (slotBytes == 2) slot = (slot << 8) | chunk->code[offset + 2];
+    uint8_t constant = chunk->code[offset + 1 + slotBytes];
+    printf("%-16s %4d", name, slot);
+    if (slotBytes == 2) {
+        printf(" '");
+        printValue(vm.globalNames.values[slot]);
+        printf("'");
+    }
+    printf(" += '");
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 2 + slotBytes;
+}
+
+static int constantJumpInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 1];
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8) | chunk->code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("' -> %d\n", offset + 4 + jump);
+    return offset + 4;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction("OP_CONSTANT", 1, chunk, offset);
+        case OP_CONSTANT_LONG:
+            return constantInstruction("OP_CONSTANT_LONG", 3, chunk, offset);
         case OP_NIL: return simpleInstruction("OP_NIL", offset);
         case OP_TRUE: return simpleInstruction("OP_TRUE", offset);
         case OP_FALSE: return simpleInstruction("OP_FALSE", offset);
         case OP_POP: return simpleInstruction("OP_POP", offset);
         case OP_GET_LOCAL: return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL: return byteInstruction("OP_SET_LOCAL", chunk, offset);
-        case OP_GET_GLOBAL: return constantInstruction("OP_GET_GLOBAL", chunk, offset);
-        case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
-        case OP_SET_GLOBAL: return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_SLOT:
+            return globalInstruction("OP_GET_GLOBAL_SLOT", 2, chunk, offset);
+        case OP_DEFINE_GLOBAL_SLOT:
+            return globalInstruction("OP_DEFINE_GLOBAL_SLOT", 2, chunk, offset);
+        case OP_SET_GLOBAL_SLOT:
+            return globalInstruction("OP_SET_GLOBAL_SLOT", 2, chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return globalInstruction("OP_GET_GLOBAL_LONG", 3, chunk, offset);
+        case OP_DEFINE_GLOBAL_LONG:
+            return globalInstruction("OP_DEFINE_GLOBAL_LONG", 3, chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return globalInstruction("OP_SET_GLOBAL_LONG", 3, chunk, offset);
         case OP_EQUAL: return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER: return simpleInstruction("OP_GREATER", offset);
         case OP_LESS: return simpleInstruction("OP_LESS", offset);
+        case OP_NOT_EQUAL: return simpleInstruction("OP_NOT_EQUAL", offset);
+        case OP_GREATER_EQUAL: return simpleInstruction("OP_GREATER_EQUAL", offset);
+        case OP_LESS_EQUAL: return simpleInstruction("OP_LESS_EQUAL", offset);
         case OP_ADD: return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT: return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY: return simpleInstruction("OP_MULTIPLY", offset);
@@ -60,9 +119,35 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_NOT: return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE: return simpleInstruction("OP_NEGATE", offset);
         case OP_PRINT: return simpleInstruction("OP_PRINT", offset);
-        case OP_JUMP: return jumpInstruction("OP_JUMP", 1, chunk, offset);
-        case OP_JUMP_IF_FALSE: return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-        case OP_LOOP: return jumpInstruction("OP_LOOP", -1, chunk, offset);
+        case OP_JUMP: return jumpInstruction("OP_JUMP", 1, 2, chunk, offset);
+        case OP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_JUMP_IF_FALSE", 1, 2, chunk, offset);
+        case OP_LOOP: return jumpInstruction("OP_LOOP", -1, 2, chunk, offset);
+        case OP_JUMP_LONG: return jumpInstruction("OP_JUMP_LONG", 1, 3, chunk, offset);
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, 3, chunk, offset);
+        case OP_LOOP_LONG: return jumpInstruction("OP_LOOP_LONG", -1, 3, chunk, offset);
+        case OP_SET_LOCAL_POP: return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+        case OP_SET_GLOBAL_POP:
+            return globalInstruction("OP_SET_GLOBAL_POP", 2, chunk, offset);
+        case OP_INCREMENT_LOCAL:
+            return incrementInstruction("OP_INCREMENT_LOCAL", 1, chunk, offset);
+        case OP_INCREMENT_GLOBAL:
+            return incrementInstruction("OP_INCREMENT_GLOBAL", 2, chunk, offset);
+        case OP_POP_JUMP_IF_FALSE:
+            return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, 2, chunk, offset);
+        case OP_JUMP_IF_NOT_LESS_CONST:
+            return constantJumpInstruction("OP_JUMP_IF_NOT_LESS_CONST", chunk, offset);
+        case OP_JUMP_IF_NOT_GREATER_CONST:
+            return constantJumpInstruction("OP_JUMP_IF_NOT_GREATER_CONST", chunk, offset);
+        case OP_ADD_NUM: return simpleInstruction("OP_ADD_NUM", offset);
+        case OP_SUBTRACT_NUM: return simpleInstruction("OP_SUBTRACT_NUM", offset);
+        case OP_MULTIPLY_NUM: return simpleInstruction("OP_MULTIPLY_NUM", offset);
+        case OP_DIVIDE_NUM: return simpleInstruction("OP_DIVIDE_NUM", offset);
+        case OP_LESS_NUM: return simpleInstruction("OP_LESS_NUM", offset);
+        case OP_GREATER_NUM: return simpleInstruction("OP_GREATER_NUM", offset);
+        case OP_LESS_EQUAL_NUM: return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+        case OP_GREATER_EQUAL_NUM: return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
         case OP_RETURN: return simpleInstruction("OP_RETURN", offset);
         default:
             printf("Unknown opcode %d\n", instruction);
@@ -70,6 +155,93 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     }
 }
 
+#if DEBUG_OPCODE_PAIRS
+#define OPCODE_COUNT (OP_RETURN + 1)
+
+static const char* opcodeNames[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL_SLOT] = "OP_GET_GLOBAL_SLOT",
+    [OP_DEFINE_GLOBAL_SLOT] = "OP_DEFINE_GLOBAL_SLOT",
+    [OP_SET_GLOBAL_SLOT] = "OP_SET_GLOBAL_SLOT",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_JUMP_LONG] = "OP_JUMP_LONG",
+    [OP_JUMP_IF_FALSE_LONG] = "OP_JUMP_IF_FALSE_LONG",
+    [OP_LOOP_LONG] = "OP_LOOP_LONG",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_INCREMENT_LOCAL] = "OP_INCREMENT_LOCAL",
+    [OP_INCREMENT_GLOBAL] = "OP_INCREMENT_GLOBAL",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_NOT_LESS_CONST] = "OP_JUMP_IF_NOT_LESS_CONST",
+    [OP_JUMP_IF_NOT_GREATER_CONST] = "OP_JUMP_IF_NOT_GREATER_CONST",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_EQUAL_NUM] = "OP_LESS_EQUAL_NUM",
+    [OP_GREATER_EQUAL_NUM] = "OP_GREATER_EQUAL_NUM",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+static uint64_t pairCounts[OPCODE_COUNT][OPCODE_COUNT];
+static int previousOp = -1;
+
+void recordOpcode(uint8_t op) {
+    if (previousOp >= 0) pairCounts[previousOp][op]++;
+    previousOp = op == OP_RETURN ? -1 : op;
+}
+
+/* Prints the 20 most frequent executed pairs to stderr. */
+void printOpcodePairs(void) {
+    uint64_t total = 0;
+    for (int a = 0; a < OPCODE_COUNT; a++) {
+        for (int b = 0; b < OPCODE_COUNT; b++) total += pairCounts[a][b];
+    }
+    fprintf(stderr, "== opcode pairs (%llu total) ==\n", (unsigned long long)total);
+    for (int rank = 0; rank < 20 && total > 0; rank++) {
+        int bestA = 0, bestB = 0;
+        for (int a = 0; a < OPCODE_COUNT; a++) {
+            for (int b = 0; b < OPCODE_COUNT; b++) {
+                if (pairCounts[a][b] > pairCounts[bestA][bestB]) { bestA = a; bestB = b; }
+            }
+        }
+        if (pairCounts[bestA][bestB] == 0) break;
+        fprintf(stderr, "%12llu %5.1f%%  %s -> %s\n",
+                (unsigned long long)pairCounts[bestA][bestB],
+                100.0 * pairCounts[bestA][bestB] / total,
+                opcodeNames[bestA], opcodeNames[bestB]);
+        pairCounts[bestA][bestB] = 0;
+    }
+}
+#endif
+
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
@@ -9,4 +9,9 @@
 void disassembleChunk(Chunk* chunk, const char* name);
 int disassembleInstruction(Chunk* chunk, int offset);
 
+#if DEBUG_OPCODE_PAIRS
+void recordOpcode(uint8_t op);
+void printOpcodePairs(void);
+#endif
+
 #endif
@@ -0,0 +1,714 @@
+/**
+ * emitc.c - Lowers a compiled chunk to a standalone C program.
+ *
+ * The operand stack depth at every instruction is fixed at compile time,
+ * and a script has no functions, so every stack slot and every global
+ * becomes a local of main() (s0, s1, ... and g0, g1, ...). Pushes, pops
+ * and variable accesses turn into plain assignments the host compiler
+ * keeps in registers, and jumps become gotos. Arithmetic and comparisons
+ * test for numbers inline and leave the fast path only to report an
+ * error, or for + to concatenate strings. String constants become locals
+ * too, c0, c1, ... after their index in the constant pool. The messages
+ * and exit code (70) are run()'s, so a script fails the same way compiled
+ * or interpreted.
+ *
+ * Strings behave as they do in the VM: long concatenations are ropes,
+ * and a mark-sweep collector frees the ones no variable holds. Since only
+ * main() can see its variables, a + that finds a collection due jumps to
+ * a block at the end of main() that marks them all and jumps back.
+ *
+ * Two passes share one translator: the first only records jump targets
+ * and stack depths, the second writes the code, with a label in front of
+ * each instruction some jump lands on.
+ */
+#include "emitc.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    Chunk* chunk;
+    FILE* out;         /* NULL during the first pass */
+    int* depthAt;      /* stack depth before each offset, or -1 */
+    bool* isTarget;
+    bool* isResume;    /* an OP_ADD the collector returns to */
+    bool* isUsed;      /* string constants main() reads */
+    int depth;         /* depth before the instruction being translated */
+    int maxDepth;      /* how many s<n> variables main() needs */
+    int sourceLine;    /* of the instruction being translated */
+    bool ok;           /* false if the chunk has a constant C can't spell */
+} Emitter;
+
+/* Writes one indented line of main()'s body. */
+static void line(Emitter* em, const char* format, ...) {
+    if (em->out == NULL) return;
+    fprintf(em->out, "    ");
+    va_list args;
+    va_start(args, format);
+    vfprintf(em->out, format, args);
+    va_end(args);
+    fprintf(em->out, "\n");
+}
+
+static void jumpTo(Emitter* em, int target, int depth) {
+    em->isTarget[target] = true;
+    em->depthAt[target] = depth;
+}
+
+static int readShort(uint8_t* code) {
+    return (code[0] << 8) | code[1];
+}
+
+static int readLong(uint8_t* code) {
+    return (code[0] << 16) | readShort(code + 1);
+}
+
+/* Writes a C expression for `value` into `buffer`. Numbers are spelled
+   in hex so they round-trip exactly. */
+static bool literal(Value value, char* buffer, size_t size) {
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        if (isfinite(number)) {
+            snprintf(buffer, size, "NUMBER_VAL(%a)", number);
+        } else {
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            snprintf(buffer, size, "NUMBER_VAL(bitsToDouble(0x%016llxull))",
+                     (unsigned long long)bits);
+        }
+    } else if (IS_BOOL(value)) {
+        snprintf(buffer, size, "BOOL_VAL(%s)", AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        snprintf(buffer, size, "NIL_VAL");
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void checkDefined(Emitter* em, int slot) {
+    line(em, "if (IS_UNDEFINED(g%d)) undefinedVariable(%d, %d);", slot, slot,
+         em->sourceLine);
+}
+
+/* s[a] = s[a] <op> s[b] for the two values on top of the stack. */
+static void arithmetic(Emitter* em, const char* op) {
+    int a = em->depth - 2;
+    int b = em->depth - 1;
+    line(em, "if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) operandsError(%d);", a, b,
+         em->sourceLine);
+    line(em, "s%d = NUMBER_VAL(AS_NUMBER(s%d) %s AS_NUMBER(s%d));", a, a, op, b);
+    em->depth--;
+}
+
+/* Like arithmetic() with a bool result; `negate` for <= and >=, which
+   are !(a > b) and !(a < b) so that NaN compares the way run() does. */
+static void comparison(Emitter* em, const char* op, bool negate) {
+    int a = em->depth - 2;
+    int b = em->depth - 1;
+    line(em, "if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) operandsError(%d);", a, b,
+         em->sourceLine);
+    line(em, "s%d = BOOL_VAL(%sAS_NUMBER(s%d) %s AS_NUMBER(s%d)%s);", a,
+         negate ? "!(" : "", a, op, b, negate ? ")" : "");
+    em->depth--;
+}
+
+static void equality(Emitter* em, bool negate) {
+    int a = em->depth - 2;
+    int b = em->depth - 1;
+    line(em, "s%d = BOOL_VAL(%s(IS_NUMBER(s%d) && IS_NUMBER(s%d) ? "
+             "AS_NUMBER(s%d) == AS_NUMBER(s%d) : equal(s%d, s%d)));",
+         a, negate ? "!" : "", a, b, a, b, a, b);
+    em->depth--;
+}
+
+/* Pops a and jumps to `target` unless a <op> constant. */
+static void compareConstantBranch(Emitter* em, const char* op, Value bound,
+                                  int target) {
+    int a = em->depth - 1;
+    char value[64];
+    if (!IS_NUMBER(bound) || !literal(bound, value, sizeof(value))) {
+        line(em, "operandsError(%d);", em->sourceLine);
+    } else {
+        line(em, "if (!IS_NUMBER(s%d)) operandsError(%d);", a, em->sourceLine);
+        line(em, "if (!(AS_NUMBER(s%d) %s AS_NUMBER(%s))) goto L%04d;", a, op,
+             value, target);
+    }
+    em->depth--;
+    jumpTo(em, target, em->depth);
+}
+
+/* Numbers are added inline; anything else goes to concatenate(), which
+   reports the error unless both are strings. If a collection is due it
+   runs first, in main()'s collect block, which comes back to R<offset>. */
+static void addition(Emitter* em, int offset) {
+    int a = em->depth - 2;
+    int b = em->depth - 1;
+    em->isResume[offset] = true;
+    line(em, "if (IS_NUMBER(s%d) && IS_NUMBER(s%d)) {", a, b);
+    line(em, "    s%d = NUMBER_VAL(AS_NUMBER(s%d) + AS_NUMBER(s%d));", a, a, b);
+    line(em, "} else {");
+    line(em, "    if (bytesAllocated > nextGC) { resume = %d; goto collect; }", offset);
+    line(em, "R%04d:", offset);
+    line(em, "    s%d = concatenate(s%d, s%d, %d);", a, a, b, em->sourceLine);
+    line(em, "}");
+    em->depth--;
+}
+
+/* var += constant; `name` is the variable's C name. */
+static void increment(Emitter* em, const char* name, Value step) {
+    char value[64];
+    if (!IS_NUMBER(step) || !literal(step, value, sizeof(value))) {
+        line(em, "addError(%d);", em->sourceLine);
+        return;
+    }
+    line(em, "if (!IS_NUMBER(%s)) addError(%d);", name, em->sourceLine);
+    line(em, "%s = NUMBER_VAL(AS_NUMBER(%s) + AS_NUMBER(%s));", name, name, value);
+}
+
+/* Translates the instruction at `offset`, leaving the stack depth after
+   it in em->depth (-1 if control never falls through). Returns the
+   instruction's length. */
+static int translate(Emitter* em, int offset) {
+    uint8_t* code = em->chunk->code + offset;
+    Value* constants = em->chunk->constants.values;
+    int top = em->depth - 1;
+    switch (code[0]) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: {
+            bool wide = code[0] == OP_CONSTANT_LONG;
+            int index = wide ? readLong(code + 1) : code[1];
+            char value[64];
+            if (IS_STRING(constants[index])) {
+                em->isUsed[index] = true;
+                snprintf(value, sizeof(value), "c%d", index);
+            } else if (!literal(constants[index], value, sizeof(value))) {
+                em->ok = false;
+            }
+            line(em, "s%d = %s;", em->depth++, value);
+            return wide ? 4 : 2;
+        }
+        case OP_NIL: line(em, "s%d = NIL_VAL;", em->depth++); return 1;
+        case OP_TRUE: line(em, "s%d = BOOL_VAL(true);", em->depth++); return 1;
+        case OP_FALSE: line(em, "s%d = BOOL_VAL(false);", em->depth++); return 1;
+        case OP_POP: em->depth--; return 1;
+        case OP_GET_LOCAL: line(em, "s%d = s%d;", em->depth++, code[1]); return 2;
+        case OP_SET_LOCAL: line(em, "s%d = s%d;", code[1], top); return 2;
+        case OP_SET_LOCAL_POP:
+            line(em, "s%d = s%d;", code[1], top);
+            em->depth--;
+            return 2;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_LONG: {
+            bool wide = code[0] == OP_GET_GLOBAL_LONG;
+            int slot = wide ? readLong(code + 1) : readShort(code + 1);
+            checkDefined(em, slot);
+            line(em, "s%d = g%d;", em->depth++, slot);
+            return wide ? 4 : 3;
+        }
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_LONG: {
+            bool wide = code[0] == OP_DEFINE_GLOBAL_LONG;
+            line(em, "g%d = s%d;", wide ? readLong(code + 1) : readShort(code + 1), top);
+            em->depth--;
+            return wide ? 4 : 3;
+        }
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_POP: {
+            bool wide = code[0] == OP_SET_GLOBAL_LONG;
+            int slot = wide ? readLong(code + 1) : readShort(code + 1);
+            checkDefined(em, slot);
+            line(em, "g%d = s%d;", slot, top);
+            if (code[0] == OP_SET_GLOBAL_POP) em->depth--;
+            return wide ? 4 : 3;
+        }
+        case OP_EQUAL: equality(em, false); return 1;
+        case OP_NOT_EQUAL: equality(em, true); return 1;
+        case OP_GREATER:
+        case OP_GREATER_NUM: comparison(em, ">", false); return 1;
+        case OP_LESS:
+        case OP_LESS_NUM: comparison(em, "<", false); return 1;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUM: comparison(em, "<", true); return 1;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM: comparison(em, ">", true); return 1;
+        case OP_ADD:
+        case OP_ADD_NUM: addition(em, offset); return 1;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM: arithmetic(em, "-"); return 1;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM: arithmetic(em, "*"); return 1;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            /* run() tests the divisor before the operand types. */
+            line(em, "if (AS_NUMBER(s%d) == 0) runtimeError(%d, \"Division by zero.\");",
+                 top, em->sourceLine);
+            arithmetic(em, "/");
+            return 1;
+        case OP_NOT: line(em, "s%d = BOOL_VAL(!isTruthy(s%d));", top, top); return 1;
+        case OP_NEGATE:
+            line(em, "if (!IS_NUMBER(s%d)) runtimeError(%d, \"Operand must be a number.\");",
+                 top, em->sourceLine);
+            line(em, "s%d = NUMBER_VAL(-AS_NUMBER(s%d));", top, top);
+            return 1;
+        case OP_PRINT:
+            line(em, "printValue(s%d);", top);
+            line(em, "printf(\"\\n\");");
+            em->depth--;
+            return 1;
+        case OP_JUMP:
+        case OP_JUMP_LONG: {
+            int length = code[0] == OP_JUMP ? 3 : 4;
+            int jump = length == 3 ? readShort(code + 1) : readLong(code + 1);
+            int target = offset + length + jump;
+            line(em, "goto L%04d;", target);
+            jumpTo(em, target, em->depth);
+            em->depth = -1;
+            return length;
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG: {
+            int length = code[0] == OP_JUMP_IF_FALSE ? 3 : 4;
+            int jump = length == 3 ? readShort(code + 1) : readLong(code + 1);
+            int target = offset + length + jump;
+            line(em, "if (!isTruthy(s%d)) goto L%04d;", top, target);
+            jumpTo(em, target, em->depth);
+            return length;
+        }
+        case OP_POP_JUMP_IF_FALSE: {
+            int target = offset + 3 + readShort(code + 1);
+            line(em, "if (!isTruthy(s%d)) goto L%04d;", top, target);
+            em->depth--;
+            jumpTo(em, target, em->depth);
+            return 3;
+        }
+        case OP_LOOP:
+        case OP_LOOP_LONG: {
+            int length = code[0] == OP_LOOP ? 3 : 4;
+            int jump = length == 3 ? readShort(code + 1) : readLong(code + 1);
+            int target = offset + length - jump;
+            line(em, "goto L%04d;", target);
+            jumpTo(em, target, em->depth);
+            em->depth = -1;
+            return length;
+        }
+        case OP_INCREMENT_LOCAL: {
+            char name[16];
+            snprintf(name, sizeof(name), "s%d", code[1]);
+            increment(em, name, constants[code[2]]);
+            return 3;
+        }
+        case OP_INCREMENT_GLOBAL: {
+            int slot = readShort(code + 1);
+            char name[16];
+            snprintf(name, sizeof(name), "g%d", slot);
+            checkDefined(em, slot);
+            increment(em, name, constants[code[3]]);
+            return 4;
+        }
+        case OP_JUMP_IF_NOT_LESS_CONST:
+        case OP_JUMP_IF_NOT_GREATER_CONST: {
+            const char* op = code[0] == OP_JUMP_IF_NOT_LESS_CONST ? "<" : ">";
+            int target = offset + 4 + readShort(code + 2);
+            compareConstantBranch(em, op, constants[code[1]], target);
+            return 4;
+        }
+        case OP_RETURN:
+            line(em, "return 0;");
+            em->depth = -1;
+            return 1;
+    }
+    em->ok = false;
+    return 1;
+}
+
+static void translateChunk(Emitter* em) {
+    em->depth = 0;
+    for (int offset = 0; offset < em->chunk->count;) {
+        if (em->depthAt[offset] != -1) {
+            em->depth = em->depthAt[offset];
+        } else if (em->depth == -1) {
+            em->depth = 0;  /* unreachable: nothing jumps here */
+        }
+        em->depthAt[offset] = em->depth;
+        if (em->out != NULL && em->isTarget[offset]) fprintf(em->out, "L%04d:\n", offset);
+        em->sourceLine = getLine(em->chunk, offset);
+        offset += translate(em, offset);
+        if (em->depth > em->maxDepth) em->maxDepth = em->depth;
+    }
+}
+
+static const char prelude[] =
+    "#include \"object.h\"\n"
+    "#include <limits.h>\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "static inline void runtimeError(int line, const char* message) {\n"
+    "    fprintf(stderr, \"Runtime error: %s\\n[line %d] in script\\n\", message, line);\n"
+    "    exit(70);\n"
+    "}\n"
+    "\n"
+    "static inline void operandsError(int line) {\n"
+    "    runtimeError(line, \"Operands must be numbers.\");\n"
+    "}\n"
+    "\n"
+    "static inline void addError(int line) {\n"
+    "    runtimeError(line, \"" ADD_OPERANDS_ERROR "\");\n"
+    "}\n"
+    "\n"
+    "/* value.c allocates through reallocate(). With no VM to own the\n"
+    "   memory, that is plain realloc. */\n"
+    "void* reallocate(void* pointer, size_t oldSize, size_t newSize) {\n"
+    "    (void)oldSize;\n"
+    "    if (newSize == 0) {\n"
+    "        free(pointer);\n"
+    "        return NULL;\n"
+    "    }\n"
+    "    void* result = realloc(pointer, newSize);\n"
+    "    if (result == NULL) exit(1);\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "/* Strings are collected like run()'s: every one made at run time is\n"
+    "   linked on `objects`, and once they pass `nextGC` bytes, the next +\n"
+    "   first marks whatever main()'s variables hold and frees the rest (see\n"
+    "   writeCollector()). Constants are never linked, so never freed. */\n"
+    "static Obj* objects = NULL;\n"
+    "static size_t bytesAllocated = 0;\n"
+    "static size_t nextGC = 1024 * 1024;\n"
+    "\n"
+    "/* A short string's STRING_SIZE is less than sizeof(ObjString), and gcc\n"
+    "   warns about using such a block as one, so never allocate less. */\n"
+    "#define OBJECT_SIZE(length) \\\n"
+    "    (STRING_SIZE(length) < sizeof(ObjString) ? sizeof(ObjString) : STRING_SIZE(length))\n"
+    "\n"
+    "static inline Obj* makeObject(size_t size, ObjType type) {\n"
+    "    Obj* object = malloc(size);\n"
+    "    if (object == NULL) exit(1);\n"
+    "    object->type = type;\n"
+    "    object->isMarked = false;\n"
+    "    object->next = objects;\n"
+    "    objects = object;\n"
+    "    bytesAllocated += size;\n"
+    "    return object;\n"
+    "}\n"
+    "\n"
+    "static inline ObjString* makeString(int length) {\n"
+    "    ObjString* string = (ObjString*)makeObject(OBJECT_SIZE(length), OBJ_STRING);\n"
+    "    string->length = length;\n"
+    "    string->hash = 0;\n"
+    "    string->interned = false;\n"
+    "    string->chars[length] = '\\0';\n"
+    "    return string;\n"
+    "}\n"
+    "\n"
+    "/* String constants are distinct, so each stands in for an interned one. */\n"
+    "static inline Value newString(const char* chars, int length) {\n"
+    "    ObjString* string = malloc(OBJECT_SIZE(length));\n"
+    "    if (string == NULL) exit(1);\n"
+    "    string->obj.type = OBJ_STRING;\n"
+    "    string->obj.isMarked = false;\n"
+    "    string->obj.next = NULL;\n"
+    "    string->length = length;\n"
+    "    string->hash = 0;\n"
+    "    string->interned = true;\n"
+    "    memcpy(string->chars, chars, length);\n"
+    "    string->chars[length] = '\\0';\n"
+    "    return OBJ_VAL(string);\n"
+    "}\n"
+    "\n"
+    "static inline void markObject(Obj* object) {\n"
+    "    if (object == NULL || object->isMarked) return;\n"
+    "    object->isMarked = true;\n"
+    "    if (object->type == OBJ_ROPE) {\n"
+    "        ObjRope* rope = (ObjRope*)object;\n"
+    "        markObject((Obj*)rope->flat);\n"
+    "        markObject(rope->left);\n"
+    "        markObject(rope->right);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "static inline void markValue(Value value) {\n"
+    "    if (IS_OBJ(value)) markObject(AS_OBJ(value));\n"
+    "}\n"
+    "\n"
+    "static inline void sweep(void) {\n"
+    "    Obj** link = &objects;\n"
+    "    while (*link != NULL) {\n"
+    "        Obj* object = *link;\n"
+    "        if (object->isMarked) {\n"
+    "            object->isMarked = false;\n"
+    "            link = &object->next;\n"
+    "            continue;\n"
+    "        }\n"
+    "        *link = object->next;\n"
+    "        bytesAllocated -= object->type == OBJ_ROPE\n"
+    "                              ? sizeof(ObjRope)\n"
+    "                              : OBJECT_SIZE(((ObjString*)object)->length);\n"
+    "        free(object);\n"
+    "    }\n"
+    "    nextGC = bytesAllocated * 2 > 1024 * 1024 ? bytesAllocated * 2 : 1024 * 1024;\n"
+    "}\n"
+    "\n"
+    "/* Ropes, as in object.c: + past ROPE_MIN_LENGTH characters makes a node\n"
+    "   pointing at the two halves instead of copying them. */\n"
+    "static inline int stringLength(Obj* string) {\n"
+    "    if (string->type == OBJ_ROPE) return ((ObjRope*)string)->length;\n"
+    "    return ((ObjString*)string)->length;\n"
+    "}\n"
+    "\n"
+    "static inline int stringDepth(Obj* string) {\n"
+    "    return string->type == OBJ_ROPE ? ((ObjRope*)string)->depth : 0;\n"
+    "}\n"
+    "\n"
+    "static inline Obj* unwrap(Obj* string) {\n"
+    "    if (string->type == OBJ_ROPE && ((ObjRope*)string)->flat != NULL) {\n"
+    "        return (Obj*)((ObjRope*)string)->flat;\n"
+    "    }\n"
+    "    return string;\n"
+    "}\n"
+    "\n"
+    "static inline Obj* makeRope(Obj* left, Obj* right) {\n"
+    "    ObjRope* rope = (ObjRope*)makeObject(sizeof(ObjRope), OBJ_ROPE);\n"
+    "    rope->length = stringLength(left) + stringLength(right);\n"
+    "    int depth = stringDepth(left) > stringDepth(right) ? stringDepth(left)\n"
+    "                                                       : stringDepth(right);\n"
+    "    rope->depth = depth + 1;\n"
+    "    rope->left = left;\n"
+    "    rope->right = right;\n"
+    "    rope->flat = NULL;\n"
+    "    return (Obj*)rope;\n"
+    "}\n"
+    "\n"
+    "static inline ObjString* joinStrings(ObjString* left, ObjString* right) {\n"
+    "    ObjString* result = makeString(left->length + right->length);\n"
+    "    memcpy(result->chars, left->chars, left->length);\n"
+    "    memcpy(result->chars + left->length, right->chars, right->length);\n"
+    "    return result;\n"
+    "}\n"
+    "\n"
+    "static inline bool isBalanced(ObjRope* rope) {\n"
+    "    uint64_t previous = 1;\n"
+    "    uint64_t fib = 1;\n"
+    "    for (int i = 2; i < rope->depth + 2; i++) {\n"
+    "        uint64_t next = previous + fib;\n"
+    "        previous = fib;\n"
+    "        fib = next;\n"
+    "    }\n"
+    "    return (uint64_t)rope->length >= fib;\n"
+    "}\n"
+    "\n"
+    "static inline void gatherLeaves(Obj* string, Obj*** leaves, int* count, int* capacity) {\n"
+    "    string = unwrap(string);\n"
+    "    if (string->type == OBJ_ROPE) {\n"
+    "        gatherLeaves(((ObjRope*)string)->left, leaves, count, capacity);\n"
+    "        gatherLeaves(((ObjRope*)string)->right, leaves, count, capacity);\n"
+    "        return;\n"
+    "    }\n"
+    "    if (*capacity < *count + 1) {\n"
+    "        *capacity = *capacity < 8 ? 8 : *capacity * 2;\n"
+    "        *leaves = realloc(*leaves, sizeof(Obj*) * (size_t)*capacity);\n"
+    "        if (*leaves == NULL) exit(1);\n"
+    "    }\n"
+    "    (*leaves)[(*count)++] = string;\n"
+    "}\n"
+    "\n"
+    "static inline Obj* buildBalanced(Obj** leaves, int count) {\n"
+    "    if (count == 1) return leaves[0];\n"
+    "    Obj* left = buildBalanced(leaves, count / 2);\n"
+    "    return makeRope(left, buildBalanced(leaves + count / 2, count - count / 2));\n"
+    "}\n"
+    "\n"
+    "/* Never collects: the caller does that first, while it can see main()'s\n"
+    "   variables. */\n"
+    "static inline Value concatenate(Value a, Value b, int line) {\n"
+    "    if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b)) addError(line);\n"
+    "    Obj* left = unwrap(AS_OBJ(a));\n"
+    "    Obj* right = unwrap(AS_OBJ(b));\n"
+    "    if (stringLength(left) > INT_MAX - stringLength(right)) {\n"
+    "        runtimeError(line, \"" STRING_LENGTH_ERROR "\");\n"
+    "    }\n"
+    "    if (stringLength(left) + stringLength(right) <= ROPE_MIN_LENGTH) {\n"
+    "        return OBJ_VAL(joinStrings((ObjString*)left, (ObjString*)right));\n"
+    "    }\n"
+    "    if (left->type == OBJ_ROPE && right->type == OBJ_STRING) {\n"
+    "        Obj* last = unwrap(((ObjRope*)left)->right);\n"
+    "        if (last->type == OBJ_STRING &&\n"
+    "            stringLength(last) + stringLength(right) <= ROPE_MIN_LENGTH) {\n"
+    "            right = (Obj*)joinStrings((ObjString*)last, (ObjString*)right);\n"
+    "            left = unwrap(((ObjRope*)left)->left);\n"
+    "        }\n"
+    "    }\n"
+    "    Obj* rope = makeRope(left, right);\n"
+    "    if (isBalanced((ObjRope*)rope)) return OBJ_VAL(rope);\n"
+    "    Obj** leaves = NULL;\n"
+    "    int count = 0;\n"
+    "    int capacity = 0;\n"
+    "    gatherLeaves(rope, &leaves, &count, &capacity);\n"
+    "    rope = buildBalanced(leaves, count);\n"
+    "    free(leaves);\n"
+    "    return OBJ_VAL(rope);\n"
+    "}\n"
+    "\n"
+    "static inline void copyLeaves(Obj* string, char* to) {\n"
+    "    string = unwrap(string);\n"
+    "    if (string->type == OBJ_ROPE) {\n"
+    "        ObjRope* rope = (ObjRope*)string;\n"
+    "        copyLeaves(rope->left, to);\n"
+    "        copyLeaves(rope->right, to + stringLength(rope->left));\n"
+    "        return;\n"
+    "    }\n"
+    "    memcpy(to, ((ObjString*)string)->chars, ((ObjString*)string)->length);\n"
+    "}\n"
+    "\n"
+    "/* valuesEqual() compares ObjStrings: flatten a rope into one first. */\n"
+    "static inline Value flatten(Value value) {\n"
+    "    if (!IS_ROPE(value)) return value;\n"
+    "    ObjRope* rope = AS_ROPE(value);\n"
+    "    if (rope->flat == NULL) {\n"
+    "        ObjString* flat = makeString(rope->length);\n"
+    "        copyLeaves((Obj*)rope, flat->chars);\n"
+    "        rope->flat = flat;\n"
+    "        rope->left = NULL;\n"
+    "        rope->right = NULL;\n"
+    "    }\n"
+    "    return OBJ_VAL(rope->flat);\n"
+    "}\n"
+    "\n"
+    "static inline bool equal(Value a, Value b) {\n"
+    "    return valuesEqual(flatten(a), flatten(b));\n"
+    "}\n"
+    "\n"
+    "static inline bool isTruthy(Value value) {\n"
+    "    if (IS_NIL(value)) return false;\n"
+    "    if (IS_BOOL(value)) return AS_BOOL(value);\n"
+    "    return true;\n"
+    "}\n"
+    "\n"
+    "static inline double bitsToDouble(uint64_t bits) {\n"
+    "    double number;\n"
+    "    memcpy(&number, &bits, sizeof(number));\n"
+    "    return number;\n"
+    "}\n"
+    "\n";
+
+/* Writes `chars` as a C string literal. Octal escapes keep any byte
+   intact; `?` is escaped so no trigraph can form. */
+static void writeCString(FILE* out, const char* chars, int length) {
+    fputc('"', out);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\' || c == '?') {
+            fprintf(out, "\\%c", c);
+        } else if (c < ' ' || c > '~') {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+static bool concatenates(Emitter* em) {
+    for (int i = 0; i < em->chunk->count; i++) {
+        if (em->isResume[i]) return true;
+    }
+    return false;
+}
+
+/* The collect block at the end of main(): the only place that can see
+   every variable, so the only place a collection can find all the
+   roots. Stack slots above the current depth still hold what was popped,
+   which at worst keeps it until the next collection. */
+static void writeCollector(Emitter* em) {
+    if (!concatenates(em)) return;
+    fprintf(em->out, "collect:\n");
+    for (int i = 0; i < em->maxDepth; i++) line(em, "markValue(s%d);", i);
+    for (int i = 0; i < vm.globalNames.count; i++) line(em, "markValue(g%d);", i);
+    line(em, "sweep();");
+    line(em, "switch (resume) {");
+    for (int i = 0; i < em->chunk->count; i++) {
+        if (em->isResume[i]) line(em, "    case %d: goto R%04d;", i, i);
+    }
+    line(em, "}");
+    line(em, "return 0;");
+}
+
+static void writeProgram(Emitter* em) {
+    FILE* out = em->out;
+    int globals = vm.globalNames.count;
+    fprintf(out, "/* Generated by clox --emit-c. Build with value.c from clox/src:\n"
+                 "     gcc -O2 -std=c99 -Iclox/src -o prog prog.c clox/src/value.c */\n");
+    fprintf(out, "%s", prelude);
+    fprintf(out, "static const char* globalNames[] = {");
+    for (int i = 0; i < globals; i++) {
+        ObjString* name = AS_STRING(vm.globalNames.values[i]);
+        fprintf(out, "\"%.*s\", ", name->length, name->chars);
+    }
+    fprintf(out, "NULL};\n\n");
+    fprintf(out, "static inline void undefinedVariable(int slot, int line) {\n"
+                 "    fprintf(stderr, \"Runtime error: Undefined variable '%%s'.\\n\"\n"
+                 "            \"[line %%d] in script\\n\", globalNames[slot], line);\n"
+                 "    exit(70);\n"
+                 "}\n\n");
+
+    fprintf(out, "int main(void) {\n");
+    for (int i = 0; i < em->maxDepth; i++) fprintf(out, "    Value s%d = NIL_VAL;\n", i);
+    for (int i = 0; i < globals; i++) fprintf(out, "    Value g%d = UNDEFINED_VAL;\n", i);
+    if (concatenates(em)) fprintf(out, "    int resume;\n");
+    ValueArray* constants = &em->chunk->constants;
+    for (int i = 0; i < constants->count; i++) {
+        if (!em->isUsed[i]) continue;
+        ObjString* string = AS_STRING(constants->values[i]);
+        fprintf(out, "    Value c%d = newString(", i);
+        writeCString(out, string->chars, string->length);
+        fprintf(out, ", %d);\n", string->length);
+    }
+    translateChunk(em);
+    writeCollector(em);
+    fprintf(out, "}\n");
+}
+
+InterpretResult emitC(const char* source, FILE* out) {
+    Chunk chunk;
+    if (!compileSource(source, &chunk)) return INTERPRET_COMPILE_ERROR;
+
+    Emitter em;
+    em.chunk = &chunk;
+    em.out = NULL;
+    em.depthAt = ALLOCATE(int, chunk.count + 1);
+    em.isTarget = ALLOCATE(bool, chunk.count + 1);
+    em.isResume = ALLOCATE(bool, chunk.count + 1);
+    em.isUsed = ALLOCATE(bool, chunk.constants.count);
+    em.maxDepth = 0;
+    em.ok = true;
+    for (int i = 0; i <= chunk.count; i++) {
+        em.depthAt[i] = -1;
+        em.isTarget[i] = false;
+        em.isResume[i] = false;
+    }
+    for (int i = 0; i < chunk.constants.count; i++) em.isUsed[i] = false;
+
+    translateChunk(&em);
+    InterpretResult result = INTERPRET_OK;
+    if (em.ok) {
+        em.out = out;
+        writeProgram(&em);
+    } else {
+        fprintf(stderr, "Cannot emit C for this script.\n");
+        result = INTERPRET_COMPILE_ERROR;
+    }
+    FREE_ARRAY(int, em.depthAt, chunk.count + 1);
+    FREE_ARRAY(bool, em.isTarget, chunk.count + 1);
+    FREE_ARRAY(bool, em.isResume, chunk.count + 1);
+    FREE_ARRAY(bool, em.isUsed, chunk.constants.count);
+    freeChunk(&chunk);
+    return result;
+}
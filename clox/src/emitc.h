@@ -0,0 +1,17 @@
+/**
+ * emitc.h - Ahead-of-time backend: writes a compiled script as C.
+ * Used instead of interpret() when clox is started with --emit-c.
+ */
+#ifndef clox_emitc_h
+#define clox_emitc_h
+
+#include "vm.h"
+#include <stdio.h>
+
+/* Compiles `source` (optimizing it under -O) and writes a standalone C
+   program for it to `out`. The program is built against value.c:
+     gcc -O2 -std=c99 -Iclox/src -o prog prog.c clox/src/value.c
+   Returns INTERPRET_COMPILE_ERROR if the script does not compile. */
+InterpretResult emitC(const char* source, FILE* out);
+
+#endif
@@ -0,0 +1,1062 @@
+/**
+ * jit.c - Baseline template JIT for x86-64 Linux.
+ *
+ * Every bytecode instruction is expanded into a fixed machine-code
+ * template doing what its run() handler does, on the same vm.stack and
+ * global slots. While compiled code runs:
+ *   rbx  stack top (next free slot, like run()'s sp)
+ *   r12  stack base, where locals live (run()'s slots)
+ *   r13  vm.globalValues.values
+ * Equality, printing and string concatenation call back into C. A failed
+ * type check jumps to an out-of-line stub that reports the same error
+ * run() would and returns INTERPRET_RUNTIME_ERROR.
+ *
+ * Only NaN-boxed Values are handled: a Value is one 64-bit word, so
+ * constants become immediates and numbers move straight into SSE
+ * registers. In other builds, on other platforms, or for an opcode the
+ * JIT does not know, jitCompile returns NULL and the VM interprets.
+ */
+#define _DEFAULT_SOURCE  /* MAP_ANONYMOUS under -std=c99 */
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if NAN_BOXING && defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+typedef int (*JitEntry)(Value* stackTop, Value* slots, Value* globals);
+
+struct JitCode {
+    void* memory;
+    size_t size;
+    JitEntry entry;
+};
+
+/* Jump targets that are not bytecode offsets. */
+#define LABEL_EPILOGUE -1
+#define LABEL_LOOP     -2  /* traces: top of the loop body */
+
+typedef enum {
+    ERROR_OPERANDS,    /* "Operands must be numbers." */
+    ERROR_ADD,         /* ADD_OPERANDS_ERROR */
+    ERROR_LENGTH,      /* STRING_LENGTH_ERROR */
+    ERROR_OPERAND,     /* "Operand must be a number." */
+    ERROR_DIVISION,    /* "Division by zero." */
+    ERROR_UNDEFINED,   /* undefined global in `slot` */
+} ErrorKind;
+
+typedef struct {
+    int at;            /* native offset of the rel32 to patch */
+    int target;        /* bytecode offset, or a LABEL_* */
+} Fixup;
+
+typedef struct {
+    int at;            /* native offset of the rel32 to patch */
+    int offset;        /* bytecode offset of the failing instruction */
+    ErrorKind kind;
+    int slot;
+} ErrorSite;
+
+/* Traces: a guard that leaves through a snapshot. */
+typedef struct {
+    int at;            /* native offset of the rel32 to patch */
+    int snapshot;
+} ExitSite;
+
+typedef struct {
+    Chunk* chunk;
+    int offset;        /* bytecode offset being translated */
+    uint8_t* code;
+    int count;
+    int capacity;
+    int* nativeAt;     /* native offset of each bytecode offset */
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+    ErrorSite* errors;
+    int errorCount;
+    int errorCapacity;
+    ExitSite* exits;
+    int exitCount;
+    int exitCapacity;
+} Assembler;
+
+/* Registers, by their x86 encoding. */
+#define RAX 0
+#define RCX 1
+#define RSI 6
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int oldCapacity = as->capacity;
+        as->capacity = oldCapacity < 256 ? 256 : oldCapacity * 2;
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emitBytes(Assembler* as, const uint8_t* bytes, int length) {
+    for (int i = 0; i < length; i++) emitByte(as, bytes[i]);
+}
+
+#define EMIT(...) \
+    emitBytes(as, (const uint8_t[]){__VA_ARGS__}, \
+              sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void emit32(Assembler* as, uint32_t value) {
+    for (int i = 0; i < 4; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; i++) emitByte(as, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Assembler* as, int at, int32_t value) {
+    for (int i = 0; i < 4; i++) as->code[at + i] = ((uint32_t)value >> (8 * i)) & 0xff;
+}
+
+/* mov reg, imm64 */
+static void loadImmediate(Assembler* as, int reg, uint64_t value) {
+    EMIT(0x48, 0xb8 + reg);
+    emit64(as, value);
+}
+
+static void callC(Assembler* as, uint64_t function) {
+    loadImmediate(as, RAX, function);
+    EMIT(0xff, 0xd0);                        /* call rax */
+}
+
+/* Emits a jump (E9) or conditional jump (0F 8x) to a bytecode offset or
+   label, resolved once all code is emitted. */
+static void jumpTo(Assembler* as, uint8_t condition, int target) {
+    if (condition == 0) {
+        EMIT(0xe9);
+    } else {
+        EMIT(0x0f, condition);
+    }
+    if (as->fixupCapacity < as->fixupCount + 1) {
+        int oldCapacity = as->fixupCapacity;
+        as->fixupCapacity = GROW_CAPACITY(oldCapacity);
+        as->fixups = GROW_ARRAY(Fixup, as->fixups, oldCapacity, as->fixupCapacity);
+    }
+    as->fixups[as->fixupCount++] = (Fixup){as->count, target};
+    emit32(as, 0);
+}
+
+#define JB  0x82
+#define JE  0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA  0x87
+
+/* Short forward jump (JE_SHORT, JMP_SHORT) within one template; returns where the
+   jump ends, for landShort to patch once the target is reached. */
+static int jumpShort(Assembler* as, uint8_t opcode) {
+    EMIT(opcode, 0x00);
+    return as->count;
+}
+
+static void landShort(Assembler* as, int from) {
+    as->code[from - 1] = (uint8_t)(as->count - from);
+}
+
+#define JE_SHORT  0x74
+#define JMP_SHORT 0xeb
+
+/* Conditional jump to an error stub for the current instruction. */
+static void errorIf(Assembler* as, uint8_t condition, ErrorKind kind, int slot) {
+    EMIT(0x0f, condition);
+    if (as->errorCapacity < as->errorCount + 1) {
+        int oldCapacity = as->errorCapacity;
+        as->errorCapacity = GROW_CAPACITY(oldCapacity);
+        as->errors = GROW_ARRAY(ErrorSite, as->errors, oldCapacity, as->errorCapacity);
+    }
+    as->errors[as->errorCount++] = (ErrorSite){as->count, as->offset, kind, slot};
+    emit32(as, 0);
+}
+
+/* --- Templates ---------------------------------------------------------- */
+
+static void push(Assembler* as) {
+    EMIT(0x48, 0x89, 0x03);                  /* mov [rbx], rax */
+    EMIT(0x48, 0x83, 0xc3, 0x08);            /* add rbx, 8 */
+}
+
+static void pop(Assembler* as) {
+    EMIT(0x48, 0x83, 0xeb, 0x08);            /* sub rbx, 8 */
+    EMIT(0x48, 0x8b, 0x03);                  /* mov rax, [rbx] */
+}
+
+static void loadLocal(Assembler* as, int slot) {
+    EMIT(0x49, 0x8b, 0x84, 0x24);            /* mov rax, [r12 + slot*8] */
+    emit32(as, slot * 8);
+}
+
+static void storeLocal(Assembler* as, int slot) {
+    EMIT(0x49, 0x89, 0x84, 0x24);            /* mov [r12 + slot*8], rax */
+    emit32(as, slot * 8);
+}
+
+static void loadGlobal(Assembler* as, int slot) {
+    EMIT(0x49, 0x8b, 0x85);                  /* mov rax, [r13 + slot*8] */
+    emit32(as, slot * 8);
+}
+
+static void storeGlobal(Assembler* as, int slot) {
+    EMIT(0x49, 0x89, 0x85);                  /* mov [r13 + slot*8], rax */
+    emit32(as, slot * 8);
+}
+
+/* Fails if global `slot` (in rax) has not been defined yet. */
+static void checkDefined(Assembler* as, int slot) {
+    loadImmediate(as, RCX, UNDEFINED_VAL);
+    EMIT(0x48, 0x39, 0xc8);                  /* cmp rax, rcx */
+    errorIf(as, JE, ERROR_UNDEFINED, slot);
+}
+
+/* Fails unless `reg` (rax or rsi) holds a number; rcx must hold QNAN. */
+static void checkNumber(Assembler* as, int reg, ErrorKind kind) {
+    EMIT(0x48, 0x89, 0xc2 | (reg << 3));     /* mov rdx, reg */
+    EMIT(0x48, 0x21, 0xca);                  /* and rdx, rcx */
+    EMIT(0x48, 0x39, 0xca);                  /* cmp rdx, rcx */
+    errorIf(as, JE, kind, 0);
+}
+
+/* Jumps (short) unless `reg` holds a number; rcx must hold QNAN. */
+static int jumpShortIfNotNumber(Assembler* as, int reg) {
+    EMIT(0x48, 0x89, 0xc2 | (reg << 3));     /* mov rdx, reg */
+    EMIT(0x48, 0x21, 0xca);                  /* and rdx, rcx */
+    EMIT(0x48, 0x39, 0xca);                  /* cmp rdx, rcx */
+    return jumpShort(as, JE_SHORT);
+}
+
+/* Checks a (rax) and b (rsi) are numbers and moves them to xmm0/xmm1.
+   A constant b is checked now rather than at run time. */
+static void numberOperands(Assembler* as, bool bIsNumber, ErrorKind kind) {
+    loadImmediate(as, RCX, QNAN);
+    checkNumber(as, RAX, kind);
+    if (!bIsNumber) checkNumber(as, RSI, kind);
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0);      /* movq xmm0, rax */
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xce);      /* movq xmm1, rsi */
+}
+
+/* Loads the two operands of a binary operator: a into rax, b into rsi. */
+static void loadOperands(Assembler* as) {
+    EMIT(0x48, 0x8b, 0x43, 0xf0);            /* mov rax, [rbx-16] */
+    EMIT(0x48, 0x8b, 0x73, 0xf8);            /* mov rsi, [rbx-8] */
+}
+
+/* Replaces the two operands with rax. */
+static void storeBinaryResult(Assembler* as) {
+    EMIT(0x48, 0x89, 0x43, 0xf0);            /* mov [rbx-16], rax */
+    EMIT(0x48, 0x83, 0xeb, 0x08);            /* sub rbx, 8 */
+}
+
+/* rax = BOOL_VAL(al) */
+static void boolFromAl(Assembler* as) {
+    EMIT(0x0f, 0xb6, 0xc0);                  /* movzx eax, al */
+    loadImmediate(as, RCX, FALSE_VAL);
+    EMIT(0x48, 0x01, 0xc8);                  /* add rax, rcx */
+}
+
+/* al = !isTruthy(rax) */
+static void falsey(Assembler* as) {
+    loadImmediate(as, RCX, NIL_VAL);
+    EMIT(0x48, 0x39, 0xc8);                  /* cmp rax, rcx */
+    EMIT(0x0f, 0x94, 0xc2);                  /* sete dl */
+    loadImmediate(as, RCX, FALSE_VAL);
+    EMIT(0x48, 0x39, 0xc8);                  /* cmp rax, rcx */
+    EMIT(0x0f, 0x94, 0xc0);                  /* sete al */
+    EMIT(0x08, 0xd0);                        /* or al, dl */
+}
+
+/* SSE op with xmm0 = a, xmm1 = b; result left in xmm0. */
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SUB 0x5c
+#define SSE_DIV 0x5e
+
+static void arithmetic(Assembler* as, uint8_t sseOp) {
+    loadOperands(as);
+    numberOperands(as, false, ERROR_OPERANDS);
+    EMIT(0xf2, 0x0f, sseOp, 0xc1);           /* <op>sd xmm0, xmm1 */
+    EMIT(0x66, 0x48, 0x0f, 0x7e, 0xc0);      /* movq rax, xmm0 */
+    storeBinaryResult(as);
+}
+
+/* What jitAdd did, in the order its caller tests for. */
+#define ADD_FAILED   0
+#define ADD_DONE     1
+#define ADD_TOO_LONG 2
+
+static int jitAdd(Value* stackTop);
+
+/* Numbers are added inline; anything else calls jitAdd, which
+   concatenates two strings or fails. */
+static void addition(Assembler* as) {
+    loadOperands(as);
+    loadImmediate(as, RCX, QNAN);
+    int slowA = jumpShortIfNotNumber(as, RAX);
+    int slowB = jumpShortIfNotNumber(as, RSI);
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xc0);      /* movq xmm0, rax */
+    EMIT(0x66, 0x48, 0x0f, 0x6e, 0xce);      /* movq xmm1, rsi */
+    EMIT(0xf2, 0x0f, SSE_ADD, 0xc1);         /* addsd xmm0, xmm1 */
+    EMIT(0x66, 0x48, 0x0f, 0x7e, 0xc0);      /* movq rax, xmm0 */
+    EMIT(0x48, 0x89, 0x43, 0xf0);            /* mov [rbx-16], rax */
+    int done = jumpShort(as, JMP_SHORT);
+    landShort(as, slowA);
+    landShort(as, slowB);
+    EMIT(0x48, 0x89, 0xdf);                  /* mov rdi, rbx */
+    callC(as, (uint64_t)(uintptr_t)&jitAdd);
+    EMIT(0x3c, ADD_DONE);                    /* cmp al, ADD_DONE */
+    errorIf(as, JB, ERROR_ADD, 0);
+    errorIf(as, JA, ERROR_LENGTH, 0);
+    landShort(as, done);
+    EMIT(0x48, 0x83, 0xeb, 0x08);            /* sub rbx, 8 */
+}
+
+/* Sets flags so that "above" means a < b (swapped) or a > b. */
+static void compareNumbers(Assembler* as, bool swapped) {
+    if (swapped) {
+        EMIT(0x66, 0x0f, 0x2e, 0xc8);        /* ucomisd xmm1, xmm0 */
+    } else {
+        EMIT(0x66, 0x0f, 0x2e, 0xc1);        /* ucomisd xmm0, xmm1 */
+    }
+}
+
+/* a < b and a > b, or their negations (which are true for NaN, exactly
+   like run()'s !(a < b) spelling of >=). */
+static void comparison(Assembler* as, bool less, bool negate) {
+    loadOperands(as);
+    numberOperands(as, false, ERROR_OPERANDS);
+    compareNumbers(as, less);
+    EMIT(0x0f, negate ? 0x96 : 0x97, 0xc0);  /* setbe/seta al */
+    boolFromAl(as);
+    storeBinaryResult(as);
+}
+
+static bool jitEqual(Value* stackTop);
+
+static void equality(Assembler* as, bool negate) {
+    EMIT(0x48, 0x89, 0xdf);                  /* mov rdi, rbx */
+    callC(as, (uint64_t)(uintptr_t)&jitEqual);
+    if (negate) EMIT(0x34, 0x01);            /* xor al, 1 */
+    boolFromAl(as);
+    storeBinaryResult(as);
+}
+
+/* Pops a and jumps to `target` unless a < constant (or a > constant). */
+static void compareConstantBranch(Assembler* as, bool less, Value constant,
+                                  int target) {
+    pop(as);
+    loadImmediate(as, RSI, constant);
+    numberOperands(as, IS_NUMBER(constant), ERROR_OPERANDS);
+    compareNumbers(as, less);
+    jumpTo(as, JBE, target);
+}
+
+/* rax += constant, checking both are numbers. */
+static void addImmediate(Assembler* as, Value constant) {
+    loadImmediate(as, RSI, constant);
+    numberOperands(as, IS_NUMBER(constant), ERROR_ADD);
+    EMIT(0xf2, 0x0f, SSE_ADD, 0xc1);         /* addsd xmm0, xmm1 */
+    EMIT(0x66, 0x48, 0x0f, 0x7e, 0xc0);      /* movq rax, xmm0 */
+}
+
+/* --- Helpers called from compiled code ---------------------------------- */
+
+static void jitPrint(Value value) {
+    printValue(value);
+    printf("\n");
+}
+
+/* OP_ADD on operands that are not both numbers. Returns ADD_FAILED
+   unless they are two strings, which it concatenates in place. */
+static int jitAdd(Value* stackTop) {
+    if (!IS_ANY_STRING(stackTop[-2]) || !IS_ANY_STRING(stackTop[-1])) return ADD_FAILED;
+    vm.stackTop = stackTop;
+    if (!concatenate()) return ADD_TOO_LONG;
+    /* Compiled code stores globals without a write barrier, so it must
+       not run while marking: finish any cycle the allocation started.
+       (It runs pretenured, so the nursery is still empty.) */
+    if (gcMarking()) gcBeforeCompiledCode();
+    return ADD_DONE;
+}
+
+static bool jitEqual(Value* stackTop) {
+    if (IS_ROPE(stackTop[-2]) || IS_ROPE(stackTop[-1])) {
+        vm.stackTop = stackTop;
+        flattenOperands();
+        if (gcMarking()) gcBeforeCompiledCode();  /* as in jitAdd */
+    }
+    return valuesEqual(stackTop[-2], stackTop[-1]);
+}
+
+static void jitError(int offset, ErrorKind kind, int slot) {
+    vm.ip = vm.chunk->code + offset + 1;  /* as if run() had just read it */
+    switch (kind) {
+        case ERROR_OPERANDS: runtimeError("Operands must be numbers."); break;
+        case ERROR_ADD: runtimeError(ADD_OPERANDS_ERROR); break;
+        case ERROR_LENGTH: runtimeError(STRING_LENGTH_ERROR); break;
+        case ERROR_OPERAND: runtimeError("Operand must be a number."); break;
+        case ERROR_DIVISION: runtimeError("Division by zero."); break;
+        case ERROR_UNDEFINED: undefinedVariable(slot); break;
+    }
+}
+
+/* --- Translation -------------------------------------------------------- */
+
+static int readShort(Chunk* chunk, int offset) {
+    return (chunk->code[offset] << 8) | chunk->code[offset + 1];
+}
+
+static int readLong(Chunk* chunk, int offset) {
+    return (chunk->code[offset] << 16) | readShort(chunk, offset + 1);
+}
+
+/* Translates the instruction at as->offset. Returns its length, or 0 if
+   the JIT does not support it. */
+static int translate(Assembler* as) {
+    Chunk* chunk = as->chunk;
+    int offset = as->offset;
+    uint8_t* code = chunk->code + offset;
+    Value* constants = chunk->constants.values;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            loadImmediate(as, RAX, constants[code[1]]);
+            push(as);
+            return 2;
+        case OP_CONSTANT_LONG:
+            loadImmediate(as, RAX, constants[readLong(chunk, offset + 1)]);
+            push(as);
+            return 4;
+        case OP_NIL: loadImmediate(as, RAX, NIL_VAL); push(as); return 1;
+        case OP_TRUE: loadImmediate(as, RAX, TRUE_VAL); push(as); return 1;
+        case OP_FALSE: loadImmediate(as, RAX, FALSE_VAL); push(as); return 1;
+        case OP_POP:
+            EMIT(0x48, 0x83, 0xeb, 0x08);    /* sub rbx, 8 */
+            return 1;
+        case OP_GET_LOCAL:
+            loadLocal(as, code[1]);
+            push(as);
+            return 2;
+        case OP_SET_LOCAL:
+            EMIT(0x48, 0x8b, 0x43, 0xf8);    /* mov rax, [rbx-8] */
+            storeLocal(as, code[1]);
+            return 2;
+        case OP_SET_LOCAL_POP:
+            pop(as);
+            storeLocal(as, code[1]);
+            return 2;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_LONG: {
+            bool wide = code[0] == OP_GET_GLOBAL_LONG;
+            int slot = wide ? readLong(chunk, offset + 1) : readShort(chunk, offset + 1);
+            loadGlobal(as, slot);
+            checkDefined(as, slot);
+            push(as);
+            return wide ? 4 : 3;
+        }
+        case OP_DEFINE_GLOBAL_SLOT:
+            pop(as);
+            storeGlobal(as, readShort(chunk, offset + 1));
+            return 3;
+        case OP_DEFINE_GLOBAL_LONG:
+            pop(as);
+            storeGlobal(as, readLong(chunk, offset + 1));
+            return 4;
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_GLOBAL_POP: {
+            bool wide = code[0] == OP_SET_GLOBAL_LONG;
+            int slot = wide ? readLong(chunk, offset + 1) : readShort(chunk, offset + 1);
+            loadGlobal(as, slot);
+            checkDefined(as, slot);
+            if (code[0] == OP_SET_GLOBAL_POP) {
+                pop(as);
+            } else {
+                EMIT(0x48, 0x8b, 0x43, 0xf8);  /* mov rax, [rbx-8] */
+            }
+            storeGlobal(as, slot);
+            return wide ? 4 : 3;
+        }
+        case OP_INCREMENT_LOCAL:
+            loadLocal(as, code[1]);
+            addImmediate(as, constants[code[2]]);
+            storeLocal(as, code[1]);
+            return 3;
+        case OP_INCREMENT_GLOBAL: {
+            int slot = readShort(chunk, offset + 1);
+            loadGlobal(as, slot);
+            checkDefined(as, slot);
+            addImmediate(as, constants[code[3]]);
+            storeGlobal(as, slot);
+            return 4;
+        }
+        case OP_EQUAL: equality(as, false); return 1;
+        case OP_NOT_EQUAL: equality(as, true); return 1;
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+            comparison(as, false, false);
+            return 1;
+        case OP_LESS:
+        case OP_LESS_NUM:
+            comparison(as, true, false);
+            return 1;
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUM:
+            comparison(as, true, true);
+            return 1;
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM:
+            comparison(as, false, true);
+            return 1;
+        case OP_ADD: case OP_ADD_NUM: addition(as); return 1;
+        case OP_SUBTRACT: case OP_SUBTRACT_NUM: arithmetic(as, SSE_SUB); return 1;
+        case OP_MULTIPLY: case OP_MULTIPLY_NUM: arithmetic(as, SSE_MUL); return 1;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM:
+            /* run() tests for a zero divisor before the operand types. */
+            EMIT(0x48, 0x8b, 0x73, 0xf8);    /* mov rsi, [rbx-8] */
+            EMIT(0x66, 0x48, 0x0f, 0x6e, 0xce);  /* movq xmm1, rsi */
+            EMIT(0x66, 0x0f, 0x57, 0xd2);    /* xorpd xmm2, xmm2 */
+            EMIT(0x66, 0x0f, 0x2e, 0xca);    /* ucomisd xmm1, xmm2 */
+            EMIT(0x7a, 0x06);                /* jp over the je */
+            errorIf(as, JE, ERROR_DIVISION, 0);
+            arithmetic(as, SSE_DIV);
+            return 1;
+        case OP_NOT:
+            EMIT(0x48, 0x8b, 0x43, 0xf8);    /* mov rax, [rbx-8] */
+            falsey(as);
+            boolFromAl(as);
+            EMIT(0x48, 0x89, 0x43, 0xf8);    /* mov [rbx-8], rax */
+            return 1;
+        case OP_NEGATE:
+            EMIT(0x48, 0x8b, 0x43, 0xf8);    /* mov rax, [rbx-8] */
+            loadImmediate(as, RCX, QNAN);
+            checkNumber(as, RAX, ERROR_OPERAND);
+            EMIT(0x48, 0x0f, 0xba, 0xf8, 0x3f);  /* btc rax, 63 */
+            EMIT(0x48, 0x89, 0x43, 0xf8);    /* mov [rbx-8], rax */
+            return 1;
+        case OP_PRINT:
+            EMIT(0x48, 0x83, 0xeb, 0x08);    /* sub rbx, 8 */
+            EMIT(0x48, 0x8b, 0x3b);          /* mov rdi, [rbx] */
+            callC(as, (uint64_t)(uintptr_t)&jitPrint);
+            return 1;
+        case OP_JUMP:
+            jumpTo(as, 0, offset + 3 + readShort(chunk, offset + 1));
+            return 3;
+        case OP_LOOP:
+            jumpTo(as, 0, offset + 3 - readShort(chunk, offset + 1));
+            return 3;
+        case OP_JUMP_IF_FALSE:
+        case OP_POP_JUMP_IF_FALSE:
+            if (code[0] == OP_POP_JUMP_IF_FALSE) {
+                pop(as);
+            } else {
+                EMIT(0x48, 0x8b, 0x43, 0xf8);  /* mov rax, [rbx-8] */
+            }
+            falsey(as);
+            EMIT(0x84, 0xc0);                /* test al, al */
+            jumpTo(as, JNE, offset + 3 + readShort(chunk, offset + 1));
+            return 3;
+        case OP_JUMP_LONG:
+            jumpTo(as, 0, offset + 4 + readLong(chunk, offset + 1));
+            return 4;
+        case OP_LOOP_LONG:
+            jumpTo(as, 0, offset + 4 - readLong(chunk, offset + 1));
+            return 4;
+        case OP_JUMP_IF_FALSE_LONG:
+            EMIT(0x48, 0x8b, 0x43, 0xf8);    /* mov rax, [rbx-8] */
+            falsey(as);
+            EMIT(0x84, 0xc0);                /* test al, al */
+            jumpTo(as, JNE, offset + 4 + readLong(chunk, offset + 1));
+            return 4;
+        case OP_JUMP_IF_NOT_LESS_CONST:
+        case OP_JUMP_IF_NOT_GREATER_CONST:
+            compareConstantBranch(as, code[0] == OP_JUMP_IF_NOT_LESS_CONST,
+                                  constants[code[1]],
+                                  offset + 4 + readShort(chunk, offset + 2));
+            return 4;
+        case OP_RETURN:
+            EMIT(0xb8);                      /* mov eax, INTERPRET_OK */
+            emit32(as, INTERPRET_OK);
+            jumpTo(as, 0, LABEL_EPILOGUE);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void freeAssembler(Assembler* as) {
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    if (as->nativeAt != NULL) FREE_ARRAY(int, as->nativeAt, as->chunk->count + 1);
+    FREE_ARRAY(Fixup, as->fixups, as->fixupCapacity);
+    FREE_ARRAY(ErrorSite, as->errors, as->errorCapacity);
+    FREE_ARRAY(ExitSite, as->exits, as->exitCapacity);
+}
+
+/* Five pushes keep rsp 16-byte aligned for calls into C. */
+static void emitPrologue(Assembler* as) {
+    EMIT(0x55, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56); /* push rbp..r14 */
+    EMIT(0x48, 0x89, 0xfb);                  /* mov rbx, rdi */
+    EMIT(0x49, 0x89, 0xf4);                  /* mov r12, rsi */
+    EMIT(0x49, 0x89, 0xd5);                  /* mov r13, rdx */
+}
+
+static void emitEpilogue(Assembler* as) {
+    EMIT(0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0x5d); /* pop r14..rbp */
+    EMIT(0xc3);                              /* ret */
+}
+
+/* Resolves jumps; `loop` is only used by traces. */
+static void patchFixups(Assembler* as, int epilogue, int loop) {
+    for (int i = 0; i < as->fixupCount; i++) {
+        Fixup* fixup = &as->fixups[i];
+        int target;
+        if (fixup->target == LABEL_EPILOGUE) {
+            target = epilogue;
+        } else if (fixup->target == LABEL_LOOP) {
+            target = loop;
+        } else {
+            target = as->nativeAt[fixup->target];
+        }
+        patch32(as, fixup->at, target - (fixup->at + 4));
+    }
+}
+
+/* Copies the finished code into executable memory and frees `as`. */
+static JitCode* install(Assembler* as) {
+    void* memory = mmap(NULL, as->count, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        freeAssembler(as);
+        return NULL;
+    }
+    memcpy(memory, as->code, as->count);
+    if (mprotect(memory, as->count, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, as->count);
+        freeAssembler(as);
+        return NULL;
+    }
+
+    JitCode* jit = ALLOCATE(JitCode, 1);
+    jit->memory = memory;
+    jit->size = as->count;
+    jit->entry = (JitEntry)memory;
+    freeAssembler(as);
+    return jit;
+}
+
+JitCode* jitCompile(Chunk* chunk) {
+    Assembler assembler = {0};
+    Assembler* as = &assembler;
+    as->chunk = chunk;
+    as->nativeAt = ALLOCATE(int, chunk->count + 1);
+    emitPrologue(as);
+
+    while (as->offset < chunk->count) {
+        as->nativeAt[as->offset] = as->count;
+        int length = translate(as);
+        if (length == 0) {
+            freeAssembler(as);
+            return NULL;
+        }
+        as->offset += length;
+    }
+    as->nativeAt[chunk->count] = as->count;
+
+    /* Shared tail: report the error described by edi/esi/edx, then
+       return INTERPRET_RUNTIME_ERROR through the epilogue. */
+    int errorLabel = as->count;
+    callC(as, (uint64_t)(uintptr_t)&jitError);
+    EMIT(0xb8);                              /* mov eax, ... */
+    emit32(as, INTERPRET_RUNTIME_ERROR);
+    int epilogueLabel = as->count;
+    emitEpilogue(as);
+
+    /* Out-of-line error stubs, one per check. */
+    for (int i = 0; i < as->errorCount; i++) {
+        ErrorSite* site = &as->errors[i];
+        patch32(as, site->at, as->count - (site->at + 4));
+        emitByte(as, 0xbf);                 /* mov edi, offset */
+        emit32(as, site->offset);
+        emitByte(as, 0xbe);                 /* mov esi, kind */
+        emit32(as, site->kind);
+        emitByte(as, 0xba);                 /* mov edx, slot */
+        emit32(as, site->slot);
+        emitByte(as, 0xe9);                 /* jmp errorLabel */
+        emit32(as, errorLabel - (as->count + 4));
+    }
+
+    patchFixups(as, epilogueLabel, 0);
+    return install(as);
+}
+
+InterpretResult jitRun(JitCode* code) {
+    vm.stackTop = vm.stack;
+    return (InterpretResult)code->entry(vm.stack, vm.stack,
+                                        vm.globalValues.values);
+}
+
+void jitFree(JitCode* code) {
+    munmap(code->memory, code->size);
+    FREE(JitCode, code);
+}
+
+/* --- Traces ------------------------------------------------------------- */
+
+/* Trace values live in xmm2-xmm15 or in spill slots at [rsp]; xmm0 and
+   xmm1 are scratch. Guards jump to stubs that write the snapshot's values
+   back to the stack and globals and return the snapshot's index. */
+#define TRACE_REGISTERS 14
+#define XMM(reg) ((reg) + 2)
+
+/* <prefix> 0F <opcode> xmm dst, xmm src */
+static void sseRegisters(Assembler* as, uint8_t prefix, uint8_t opcode,
+                         int dst, int src) {
+    emitByte(as, prefix);
+    if (dst >= 8 || src >= 8) {
+        emitByte(as, 0x40 | (dst >= 8 ? 0x04 : 0) | (src >= 8 ? 0x01 : 0));
+    }
+    EMIT(0x0f, opcode);
+    emitByte(as, 0xc0 | ((dst & 7) << 3) | (src & 7));
+}
+
+/* <prefix> 0F <opcode> xmm, [rsp + disp] */
+static void sseStack(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm,
+                     int disp) {
+    emitByte(as, prefix);
+    if (xmm >= 8) emitByte(as, 0x44);
+    EMIT(0x0f, opcode);
+    emitByte(as, 0x84 | ((xmm & 7) << 3));
+    emitByte(as, 0x24);
+    emit32(as, disp);
+}
+
+/* movq xmm, rax (toXmm) or movq rax, xmm */
+static void movq(Assembler* as, int xmm, bool toXmm) {
+    emitByte(as, 0x66);
+    emitByte(as, xmm >= 8 ? 0x4c : 0x48);
+    EMIT(0x0f, toXmm ? 0x6e : 0x7e);
+    emitByte(as, 0xc0 | ((xmm & 7) << 3));
+}
+
+static int spillOffset(int spill) {
+    return spill * 8;
+}
+
+/* Where print saves live registers, after the spill slots. */
+static int saveOffset(Trace* trace, int reg) {
+    return (trace->spillCount + reg) * 8;
+}
+
+static void exitIf(Assembler* as, uint8_t condition, int snapshot) {
+    EMIT(0x0f, condition);
+    if (as->exitCapacity < as->exitCount + 1) {
+        int oldCapacity = as->exitCapacity;
+        as->exitCapacity = GROW_CAPACITY(oldCapacity);
+        as->exits = GROW_ARRAY(ExitSite, as->exits, oldCapacity, as->exitCapacity);
+    }
+    as->exits[as->exitCount++] = (ExitSite){as->count, snapshot};
+    emit32(as, 0);
+}
+
+/* xmm `dst` = the number `ref` */
+static void traceNumber(Assembler* as, Trace* trace, int ref, int dst) {
+    IrInstr* value = &trace->ir[ref];
+    if (value->op == IR_CONST) {
+        loadImmediate(as, RAX, value->value);
+        movq(as, dst, true);
+    } else if (value->reg != -1) {
+        sseRegisters(as, 0x66, 0x28, dst, XMM(value->reg));  /* movapd */
+    } else {
+        sseStack(as, 0xf2, 0x10, dst, spillOffset(value->spill));  /* movsd */
+    }
+}
+
+/* rax = `ref` as a Value */
+static void traceBoxed(Assembler* as, Trace* trace, int ref) {
+    IrInstr* value = &trace->ir[ref];
+    if (value->op == IR_CONST) {
+        loadImmediate(as, RAX, value->value);
+    } else if (value->reg != -1) {
+        movq(as, XMM(value->reg), false);
+    } else {
+        EMIT(0x48, 0x8b, 0x84, 0x24);        /* mov rax, [rsp + disp] */
+        emit32(as, spillOffset(value->spill));
+    }
+}
+
+/* Stores xmm0 as the result of `instr`. */
+static void traceSetNumber(Assembler* as, IrInstr* instr) {
+    if (instr->reg != -1) {
+        sseRegisters(as, 0x66, 0x28, XMM(instr->reg), 0);
+    } else {
+        sseStack(as, 0xf2, 0x11, 0, spillOffset(instr->spill));
+    }
+}
+
+/* Stores rax as the result of `instr`. */
+static void traceSetBoxed(Assembler* as, IrInstr* instr) {
+    if (instr->reg != -1) {
+        movq(as, XMM(instr->reg), true);
+    } else if (instr->spill != -1) {
+        EMIT(0x48, 0x89, 0x84, 0x24);        /* mov [rsp + disp], rax */
+        emit32(as, spillOffset(instr->spill));
+    }
+}
+
+/* Exits unless rax holds a value of `type`. */
+static void traceCheckType(Assembler* as, IrType type, int snapshot) {
+    switch (type) {
+        case TYPE_NUMBER:
+            loadImmediate(as, RCX, QNAN);
+            EMIT(0x48, 0x89, 0xc2);          /* mov rdx, rax */
+            EMIT(0x48, 0x21, 0xca);          /* and rdx, rcx */
+            EMIT(0x48, 0x39, 0xca);          /* cmp rdx, rcx */
+            exitIf(as, JE, snapshot);
+            break;
+        case TYPE_BOOL:
+            loadImmediate(as, RCX, TRUE_VAL);
+            EMIT(0x48, 0x89, 0xc2);          /* mov rdx, rax */
+            EMIT(0x48, 0x83, 0xca, 0x01);    /* or rdx, 1 */
+            EMIT(0x48, 0x39, 0xca);          /* cmp rdx, rcx */
+            exitIf(as, JNE, snapshot);
+            break;
+        case TYPE_NIL:
+            loadImmediate(as, RCX, NIL_VAL);
+            EMIT(0x48, 0x39, 0xc8);          /* cmp rax, rcx */
+            exitIf(as, JNE, snapshot);
+            break;
+    }
+}
+
+static void traceLoad(Assembler* as, IrInstr* instr) {
+    if (instr->op == IR_LOAD_LOCAL) {
+        loadLocal(as, instr->slot);
+    } else {
+        loadGlobal(as, instr->slot);
+    }
+}
+
+/* Writes every value a snapshot records back to memory. */
+static void traceWriteBack(Assembler* as, Trace* trace, int index) {
+    Snapshot* snapshot = &trace->snapshots[index];
+    for (int e = snapshot->start; e < snapshot->start + snapshot->count; e++) {
+        SnapshotEntry* entry = &trace->entries[e];
+        traceBoxed(as, trace, entry->ref);
+        if (entry->global) {
+            storeGlobal(as, entry->slot);
+        } else {
+            storeLocal(as, entry->slot);
+        }
+    }
+}
+
+/* Comparisons: whether a < b is tested with swapped operands, and whether
+   the result is negated (LE/GE), so that result = above ^ negate. */
+static bool compareSwapped(uint8_t op) {
+    return op == IR_LT || op == IR_GE;
+}
+
+static bool compareNegated(uint8_t op) {
+    return op == IR_LE || op == IR_GE;
+}
+
+static void tracePrint(Assembler* as, Trace* trace, int index) {
+    traceBoxed(as, trace, trace->ir[index].a);
+    EMIT(0x48, 0x89, 0xc7);                  /* mov rdi, rax */
+    /* Every xmm register is caller-saved. */
+    bool saved[TRACE_REGISTERS] = {false};
+    for (int i = 0; i < index; i++) {
+        IrInstr* value = &trace->ir[i];
+        if (value->live && value->reg != -1 && value->lastUse > index) {
+            saved[value->reg] = true;
+        }
+    }
+    for (int r = 0; r < TRACE_REGISTERS; r++) {
+        if (saved[r]) sseStack(as, 0xf2, 0x11, XMM(r), saveOffset(trace, r));
+    }
+    callC(as, (uint64_t)(uintptr_t)&jitPrint);
+    for (int r = 0; r < TRACE_REGISTERS; r++) {
+        if (saved[r]) sseStack(as, 0xf2, 0x10, XMM(r), saveOffset(trace, r));
+    }
+}
+
+static void traceInstruction(Assembler* as, Trace* trace, int index) {
+    IrInstr* instr = &trace->ir[index];
+    switch (instr->op) {
+        case IR_CONST:
+            break;
+        case IR_LOAD_LOCAL:
+        case IR_LOAD_GLOBAL:
+            traceLoad(as, instr);
+            if (instr->guarded) traceCheckType(as, instr->type, instr->snapshot);
+            traceSetBoxed(as, instr);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV: {
+            static const uint8_t sse[] = {
+                [IR_ADD] = SSE_ADD, [IR_SUB] = SSE_SUB,
+                [IR_MUL] = SSE_MUL, [IR_DIV] = SSE_DIV,
+            };
+            traceNumber(as, trace, instr->a, 0);
+            traceNumber(as, trace, instr->b, 1);
+            EMIT(0xf2, 0x0f, sse[instr->op], 0xc1);  /* <op>sd xmm0, xmm1 */
+            traceSetNumber(as, instr);
+            break;
+        }
+        case IR_NEG:
+            traceBoxed(as, trace, instr->a);
+            EMIT(0x48, 0x0f, 0xba, 0xf8, 0x3f);  /* btc rax, 63 */
+            traceSetBoxed(as, instr);
+            break;
+        case IR_LT:
+        case IR_GT:
+        case IR_LE:
+        case IR_GE:
+            if (instr->fused) break;  /* emitted by its guard */
+            traceNumber(as, trace, instr->a, 0);
+            traceNumber(as, trace, instr->b, 1);
+            compareNumbers(as, compareSwapped(instr->op));
+            EMIT(0x0f, compareNegated(instr->op) ? 0x96 : 0x97, 0xc0);  /* setbe/seta al */
+            boolFromAl(as);
+            traceSetBoxed(as, instr);
+            break;
+        case IR_EQ:
+        case IR_NE:
+            traceNumber(as, trace, instr->a, 0);
+            traceNumber(as, trace, instr->b, 1);
+            EMIT(0x66, 0x0f, 0x2e, 0xc1);    /* ucomisd xmm0, xmm1 */
+            if (instr->op == IR_EQ) {
+                EMIT(0x0f, 0x94, 0xc0);      /* sete al */
+                EMIT(0x0f, 0x9b, 0xc2);      /* setnp dl */
+                EMIT(0x20, 0xd0);            /* and al, dl */
+            } else {
+                EMIT(0x0f, 0x95, 0xc0);      /* setne al */
+                EMIT(0x0f, 0x9a, 0xc2);      /* setp dl */
+                EMIT(0x08, 0xd0);            /* or al, dl */
+            }
+            boolFromAl(as);
+            traceSetBoxed(as, instr);
+            break;
+        case IR_NOT:
+            traceBoxed(as, trace, instr->a);
+            EMIT(0x48, 0x83, 0xf0, 0x01);    /* xor rax, 1: true <-> false */
+            traceSetBoxed(as, instr);
+            break;
+        case IR_GUARD_TRUE:
+        case IR_GUARD_FALSE: {
+            bool expect = instr->op == IR_GUARD_TRUE;
+            IrInstr* cond = &trace->ir[instr->a];
+            if (cond->fused) {
+                traceNumber(as, trace, cond->a, 0);
+                traceNumber(as, trace, cond->b, 1);
+                compareNumbers(as, compareSwapped(cond->op));
+                /* The result is above ^ negated; exit when it is not `expect`. */
+                bool wantAbove = compareNegated(cond->op) != expect;
+                exitIf(as, wantAbove ? JBE : JA, instr->snapshot);
+            } else {
+                traceBoxed(as, trace, instr->a);
+                loadImmediate(as, RCX, TRUE_VAL);
+                EMIT(0x48, 0x39, 0xc8);      /* cmp rax, rcx */
+                exitIf(as, expect ? JNE : JE, instr->snapshot);
+            }
+            break;
+        }
+        case IR_GUARD_NONZERO:
+            traceNumber(as, trace, instr->a, 0);
+            EMIT(0x66, 0x0f, 0x57, 0xc9);    /* xorpd xmm1, xmm1 */
+            EMIT(0x66, 0x0f, 0x2e, 0xc1);    /* ucomisd xmm0, xmm1 */
+            EMIT(0x7a, 0x06);                /* jp over the je */
+            exitIf(as, JE, instr->snapshot);
+            break;
+        case IR_PRINT:
+            tracePrint(as, trace, index);
+            break;
+    }
+}
+
+JitCode* jitCompileTrace(Trace* trace) {
+    traceAllocateRegisters(trace, TRACE_REGISTERS);
+    Assembler assembler = {0};
+    Assembler* as = &assembler;
+    int frame = (trace->spillCount + TRACE_REGISTERS) * 8;
+    frame = (frame + 15) & ~15;
+
+    emitPrologue(as);
+    EMIT(0x48, 0x81, 0xec);                  /* sub rsp, frame */
+    emit32(as, frame);
+
+    /* Type checks that hold for the whole loop once they hold on entry. */
+    for (int i = 0; i < trace->count; i++) {
+        IrInstr* instr = &trace->ir[i];
+        if (!instr->live || !instr->hoisted) continue;
+        traceLoad(as, instr);
+        traceCheckType(as, instr->type, ENTRY_SNAPSHOT);
+    }
+
+    int loopLabel = as->count;
+    for (int i = 0; i < trace->count; i++) {
+        if (trace->ir[i].live) traceInstruction(as, trace, i);
+    }
+    traceWriteBack(as, trace, trace->loopSnapshot);
+    jumpTo(as, 0, LABEL_LOOP);
+
+    int epilogueLabel = as->count;
+    EMIT(0x48, 0x81, 0xc4);                  /* add rsp, frame */
+    emit32(as, frame);
+    emitEpilogue(as);
+
+    for (int i = 0; i < as->exitCount; i++) {
+        ExitSite* site = &as->exits[i];
+        patch32(as, site->at, as->count - (site->at + 4));
+        traceWriteBack(as, trace, site->snapshot);
+        EMIT(0xb8);                          /* mov eax, snapshot */
+        emit32(as, site->snapshot);
+        jumpTo(as, 0, LABEL_EPILOGUE);
+    }
+
+    patchFixups(as, epilogueLabel, loopLabel);
+    return install(as);
+}
+
+int jitRunTrace(JitCode* code) {
+    return code->entry(vm.stack, vm.stack, vm.globalValues.values);
+}
+
+#else
+
+JitCode* jitCompile(Chunk* chunk) {
+    (void)chunk;
+    return NULL;
+}
+
+InterpretResult jitRun(JitCode* code) {
+    (void)code;
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+void jitFree(JitCode* code) {
+    (void)code;
+}
+
+JitCode* jitCompileTrace(struct Trace* trace) {
+    (void)trace;
+    return NULL;
+}
+
+int jitRunTrace(JitCode* code) {
+    (void)code;
+    return 0;
+}
+
+#endif
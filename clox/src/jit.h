@@ -0,0 +1,27 @@
+/**
+ * jit.h - Baseline JIT: translates a whole chunk to x86-64 machine code.
+ * Used instead of run() when clox is started with --jit. Also the code
+ * generator for the traces recorded under --trace-jit (see trace.h).
+ */
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "vm.h"
+
+typedef struct JitCode JitCode;
+
+/* Returns NULL if this build or platform has no JIT, or the chunk uses an
+   opcode the JIT does not handle; the caller then interprets it. */
+JitCode* jitCompile(Chunk* chunk);
+/* Runs compiled code on vm.stack and the current globals. */
+InterpretResult jitRun(JitCode* code);
+void jitFree(JitCode* code);
+
+struct Trace;
+/* Compiles a recorded trace (see trace.h); NULL if the JIT is unavailable. */
+JitCode* jitCompileTrace(struct Trace* trace);
+/* Runs a compiled trace; returns the index of the snapshot it exited by. */
+int jitRunTrace(JitCode* code);
+
+#endif
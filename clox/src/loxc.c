@@ -0,0 +1,539 @@
+/**
+ * loxc.c - Writing and loading compiled bytecode files.
+ *
+ * The writer lays the sections out at aligned offsets so the loader can
+ * point the chunk's code and line runs straight into the mapped file.
+ * Only the constant pool is decoded, since Values are a build-time
+ * representation (NaN-boxed or tagged union) and strings must be
+ * interned. Global names are registered in slot order, which in a fresh
+ * VM reproduces the slots the code was compiled against.
+ */
+#if !defined(_WIN32)
+#define _DEFAULT_SOURCE
+#endif
+#include "loxc.h"
+#include "memory.h"
+#include "object.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define MAP_FILES 0
+#include <process.h>
+#define getpid _getpid
+#else
+#define MAP_FILES 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/* --- Writing ------------------------------------------------------------ */
+
+typedef struct {
+    uint8_t* data;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+static void append(Buffer* buffer, const void* bytes, size_t length) {
+    if (buffer->capacity < buffer->count + length) {
+        size_t capacity = buffer->capacity < 64 ? 64 : buffer->capacity;
+        while (capacity < buffer->count + length) capacity *= 2;
+        buffer->data = reallocate(buffer->data, buffer->capacity, capacity);
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->count, bytes, length);
+    buffer->count += length;
+}
+
+/* Pads with zeros to a multiple of `alignment`; returns the new offset. */
+static uint32_t align(Buffer* buffer, size_t alignment) {
+    static const uint8_t zeros[8] = {0};
+    size_t padding = (alignment - buffer->count % alignment) % alignment;
+    append(buffer, zeros, padding);
+    return (uint32_t)buffer->count;
+}
+
+static LoxcString addString(Buffer* strings, const char* chars, int length) {
+    LoxcString string = {(uint32_t)strings->count, (uint32_t)length};
+    append(strings, chars, length);
+    return string;
+}
+
+/* Writes a sibling temporary file and renames it over `path`, so nobody
+   sharing the file (the compile cache) ever maps half of one. */
+static bool writeAtomically(const Buffer* file, const char* path) {
+    size_t size = strlen(path) + 32;
+    char* temp = malloc(size);
+    snprintf(temp, size, "%s.%ld.tmp", path, (long)getpid());
+    FILE* out = fopen(temp, "wb");
+    bool ok = out != NULL && fwrite(file->data, 1, file->count, out) == file->count;
+    if (out != NULL && fclose(out) != 0) ok = false;
+#if !MAP_FILES
+    if (ok) remove(path);  /* rename() won't replace a file here */
+#endif
+    if (ok) ok = rename(temp, path) == 0;
+    if (!ok) remove(temp);
+    free(temp);
+    return ok;
+}
+
+bool writeLoxcFile(Chunk* chunk, const char* path) {
+    Buffer file = {NULL, 0, 0};
+    Buffer strings = {NULL, 0, 0};
+    LoxcHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOXC_MAGIC, 4);
+    header.version = LOXC_VERSION;
+    header.byteOrder = LOXC_BYTE_ORDER;
+    header.maxStack = (uint32_t)chunk->maxStack;
+    append(&file, &header, sizeof(header));
+
+    header.codeOffset = align(&file, 8);
+    header.codeLength = (uint32_t)chunk->count;
+    append(&file, chunk->code, chunk->count);
+
+    header.linesOffset = align(&file, 4);
+    header.lineCount = (uint32_t)chunk->lineCount;
+    append(&file, chunk->lines, sizeof(LineRun) * chunk->lineCount);
+
+    header.constantsOffset = align(&file, 8);
+    header.constantCount = (uint32_t)chunk->constants.count;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        LoxcConstant constant;
+        memset(&constant, 0, sizeof(constant));
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            constant.type = LOXC_NUMBER;
+            memcpy(&constant.as.bits, &number, sizeof(number));
+        } else if (IS_OBJ(value)) {
+            ObjString* string = AS_STRING(value);
+            constant.type = LOXC_STRING;
+            constant.as.string = addString(&strings, string->chars, string->length);
+        } else if (IS_NIL(value)) {
+            constant.type = LOXC_NIL;
+        } else {
+            constant.type = AS_BOOL(value) ? LOXC_TRUE : LOXC_FALSE;
+        }
+        append(&file, &constant, sizeof(constant));
+    }
+
+    header.globalsOffset = align(&file, 4);
+    header.globalCount = (uint32_t)vm.globalNames.count;
+    for (int i = 0; i < vm.globalNames.count; i++) {
+        ObjString* name = AS_STRING(vm.globalNames.values[i]);
+        LoxcString string = addString(&strings, name->chars, name->length);
+        append(&file, &string, sizeof(string));
+    }
+
+    header.stringsOffset = (uint32_t)file.count;
+    header.stringsLength = (uint32_t)strings.count;
+    if (strings.count > 0) append(&file, strings.data, strings.count);
+    memcpy(file.data, &header, sizeof(header));
+
+    bool ok = writeAtomically(&file, path);
+    reallocate(file.data, file.capacity, 0);
+    reallocate(strings.data, strings.capacity, 0);
+    return ok;
+}
+
+InterpretResult compileToFile(const char* source, const char* path) {
+    Chunk chunk;
+    if (!compileSource(source, &chunk)) return INTERPRET_COMPILE_ERROR;
+    bool ok = writeLoxcFile(&chunk, path);
+    freeChunk(&chunk);
+    if (!ok) {
+        fprintf(stderr, "Could not write \"%s\".\n", path);
+        return INTERPRET_COMPILE_ERROR;
+    }
+    return INTERPRET_OK;
+}
+
+/* --- Loading ------------------------------------------------------------ */
+
+/* Maps the whole file private and writable, or reads it where there is
+   no mmap. */
+static bool mapFile(const char* path, LoxcFile* file) {
+#if MAP_FILES
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return false;
+    file->mapping = mapping;
+    file->size = (size_t)info.st_size;
+#else
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) return false;
+    fseek(in, 0L, SEEK_END);
+    long size = ftell(in);
+    rewind(in);
+    void* data = size > 0 ? malloc((size_t)size) : NULL;
+    if (data == NULL || fread(data, 1, (size_t)size, in) != (size_t)size) {
+        free(data);
+        fclose(in);
+        return false;
+    }
+    fclose(in);
+    file->mapping = data;
+    file->size = (size_t)size;
+#endif
+    return true;
+}
+
+static void unmapFile(LoxcFile* file) {
+#if MAP_FILES
+    munmap(file->mapping, file->size);
+#else
+    free(file->mapping);
+#endif
+}
+
+/* Whether `count` items of `size` bytes at `offset` fit in the file. */
+static bool fits(LoxcFile* file, uint32_t offset, uint32_t count, size_t size) {
+    return (uint64_t)offset + (uint64_t)count * size <= file->size;
+}
+
+/* --- Verifying the code ------------------------------------------------ */
+
+/* run() and the JITs trust the code completely, and a file in a shared
+   cache directory may have been written by anyone, so the code is checked
+   once at load time, in one pass from start to end. That pass tracks the
+   operand stack depth the way the compiler does: each instruction's
+   effect is applied in order, and a jump's target must be reached with
+   the same depth from every edge into it. Code after an unconditional
+   jump that nothing jumps forward to keeps the depth the jump left, as in
+   the compiler. Unless a loop later jumps back into it with that same
+   depth, it never runs. */
+typedef struct {
+    uint8_t* code;
+    int length;
+    uint32_t constantCount;
+    uint32_t globalCount;
+    int* depthAt;      /* depth on arrival at each instruction, or -1 */
+    int depth;         /* before the instruction being checked */
+    int maxDepth;
+} Verifier;
+
+/* Reads the big-endian operand of `width` bytes at `at`, if it fits. */
+static bool readOperand(Verifier* v, int at, int width, int* operand) {
+    if (at + width > v->length) return false;
+    *operand = 0;
+    for (int i = 0; i < width; i++) *operand = (*operand << 8) | v->code[at + i];
+    return true;
+}
+
+/* A jump from the current instruction to `target`, arriving with the
+   current depth. Targets behind have already been checked, so they must
+   be the start of an instruction reached with that depth; targets ahead
+   record it for when the pass gets there. */
+static bool jumpTo(Verifier* v, int target, int offset) {
+    if (target < 0 || target >= v->length) return false;
+    if (target <= offset || v->depthAt[target] != -1) {
+        return v->depthAt[target] == v->depth;
+    }
+    v->depthAt[target] = v->depth;
+    return true;
+}
+
+static bool pop(Verifier* v, int count) {
+    v->depth -= count;
+    return v->depth >= 0;
+}
+
+static void push(Verifier* v, int count) {
+    v->depth += count;
+    if (v->depth > v->maxDepth) v->maxDepth = v->depth;
+}
+
+/* Checks the instruction at `offset`, leaving its length in *length and
+   the depth after it in v->depth. Returns false if it is invalid;
+   *fallsThrough is false after one control never continues past. */
+static bool verifyInstruction(Verifier* v, int offset, int* length, bool* fallsThrough) {
+    uint8_t op = v->code[offset];
+    int a = 0;
+    int b = 0;
+    *fallsThrough = true;
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: {
+            *length = op == OP_CONSTANT ? 2 : 4;
+            if (!readOperand(v, offset + 1, *length - 1, &a)) return false;
+            if ((uint32_t)a >= v->constantCount) return false;
+            push(v, 1);
+            return true;
+        }
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            *length = 1;
+            push(v, 1);
+            return true;
+        case OP_POP:
+        case OP_PRINT:
+            *length = 1;
+            return pop(v, 1);
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            *length = 2;
+            if (!readOperand(v, offset + 1, 1, &a) || a >= v->depth) return false;
+            if (op == OP_GET_LOCAL) push(v, 1);
+            if (op == OP_SET_LOCAL_POP) return pop(v, 1);
+            return true;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_POP:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG: {
+            bool wide = op == OP_GET_GLOBAL_LONG || op == OP_DEFINE_GLOBAL_LONG ||
+                        op == OP_SET_GLOBAL_LONG;
+            *length = wide ? 4 : 3;
+            if (!readOperand(v, offset + 1, *length - 1, &a)) return false;
+            if ((uint32_t)a >= v->globalCount) return false;
+            if (op == OP_GET_GLOBAL_SLOT || op == OP_GET_GLOBAL_LONG) {
+                push(v, 1);
+                return true;
+            }
+            /* Every other form reads the value on top. */
+            if (v->depth < 1) return false;
+            if (op == OP_SET_GLOBAL_SLOT || op == OP_SET_GLOBAL_LONG) return true;
+            return pop(v, 1);
+        }
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY_NUM:
+        case OP_DIVIDE_NUM:
+        case OP_LESS_NUM:
+        case OP_GREATER_NUM:
+        case OP_LESS_EQUAL_NUM:
+        case OP_GREATER_EQUAL_NUM:
+            *length = 1;
+            if (!pop(v, 2)) return false;
+            push(v, 1);
+            return true;
+        case OP_NOT:
+        case OP_NEGATE:
+            *length = 1;
+            return v->depth >= 1;
+        case OP_JUMP:
+        case OP_JUMP_LONG:
+        case OP_LOOP:
+        case OP_LOOP_LONG:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_POP_JUMP_IF_FALSE: {
+            bool wide = op == OP_JUMP_LONG || op == OP_LOOP_LONG ||
+                        op == OP_JUMP_IF_FALSE_LONG;
+            *length = wide ? 4 : 3;
+            if (!readOperand(v, offset + 1, *length - 1, &a)) return false;
+            bool backward = op == OP_LOOP || op == OP_LOOP_LONG;
+            int target = backward ? offset + *length - a : offset + *length + a;
+            if (op != OP_JUMP && op != OP_JUMP_LONG && !backward && v->depth < 1) {
+                return false;  /* the condition */
+            }
+            if (op == OP_POP_JUMP_IF_FALSE) pop(v, 1);
+            *fallsThrough = op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_FALSE_LONG ||
+                            op == OP_POP_JUMP_IF_FALSE;
+            return jumpTo(v, target, offset);
+        }
+        case OP_INCREMENT_LOCAL:
+        case OP_INCREMENT_GLOBAL: {
+            bool local = op == OP_INCREMENT_LOCAL;
+            *length = local ? 3 : 4;
+            if (!readOperand(v, offset + 1, local ? 1 : 2, &a) ||
+                !readOperand(v, offset + *length - 1, 1, &b)) {
+                return false;
+            }
+            if (local ? a >= v->depth : (uint32_t)a >= v->globalCount) return false;
+            return (uint32_t)b < v->constantCount;
+        }
+        case OP_JUMP_IF_NOT_LESS_CONST:
+        case OP_JUMP_IF_NOT_GREATER_CONST:
+            *length = 4;
+            if (!readOperand(v, offset + 1, 1, &a) ||
+                !readOperand(v, offset + 2, 2, &b)) {
+                return false;
+            }
+            if ((uint32_t)a >= v->constantCount || !pop(v, 1)) return false;
+            return jumpTo(v, offset + 4 + b, offset);
+        case OP_RETURN:
+            *length = 1;
+            *fallsThrough = false;
+            return true;
+        default:
+            return false;  /* not an opcode */
+    }
+}
+
+static bool verifyCode(LoxcHeader* header, uint8_t* code) {
+    Verifier v;
+    v.code = code;
+    v.length = (int)header->codeLength;
+    v.constantCount = header->constantCount;
+    v.globalCount = header->globalCount;
+    v.depthAt = ALLOCATE(int, v.length);
+    for (int i = 0; i < v.length; i++) v.depthAt[i] = -1;
+    v.depth = 0;
+    v.maxDepth = 0;
+
+    bool ok = true;
+    bool fallsThrough = true;
+    int offset = 0;
+    while (ok && offset < v.length) {
+        if (v.depthAt[offset] >= 0) {
+            ok = !fallsThrough || v.depthAt[offset] == v.depth;
+            v.depth = v.depthAt[offset];
+        }
+        v.depthAt[offset] = v.depth;
+        int length = 1;
+        ok = ok && verifyInstruction(&v, offset, &length, &fallsThrough);
+        /* Nothing may jump into the middle of an instruction. Jumps back
+           land on an offset the pass has been to, which these are not. */
+        for (int i = offset + 1; ok && i < offset + length; i++) ok = v.depthAt[i] == -1;
+        offset += length;
+    }
+    FREE_ARRAY(int, v.depthAt, v.length);
+    /* Control must not run off the end, and the stack must fit. */
+    return ok && !fallsThrough && v.maxDepth <= (int)header->maxStack;
+}
+
+static const char* validate(LoxcFile* file, LoxcHeader* header) {
+    if (file->size < sizeof(LoxcHeader) ||
+        memcmp(header->magic, LOXC_MAGIC, 4) != 0) {
+        return "not a compiled Lox file";
+    }
+    if (header->byteOrder != LOXC_BYTE_ORDER) return "written on a machine of the other byte order";
+    if (header->version != LOXC_VERSION) return "compiled by a different version of clox";
+    if (header->codeLength == 0 || header->codeLength > INT_MAX ||
+        header->maxStack > header->codeLength ||
+        !fits(file, header->codeOffset, header->codeLength, 1) ||
+        header->lineCount == 0 ||
+        !fits(file, header->linesOffset, header->lineCount, sizeof(LineRun)) ||
+        !fits(file, header->constantsOffset, header->constantCount, sizeof(LoxcConstant)) ||
+        !fits(file, header->globalsOffset, header->globalCount, sizeof(LoxcString)) ||
+        !fits(file, header->stringsOffset, header->stringsLength, 1) ||
+        header->linesOffset % 4 != 0 || header->constantsOffset % 8 != 0 ||
+        header->globalsOffset % 4 != 0) {
+        return "truncated or corrupt";
+    }
+    uint8_t* code = (uint8_t*)file->mapping + header->codeOffset;
+    if (!verifyCode(header, code)) return "invalid bytecode";
+    /* getLine() binary searches the runs, so they must be in order. */
+    LineRun* lines = (LineRun*)((uint8_t*)file->mapping + header->linesOffset);
+    if (lines[0].offset != 0) return "truncated or corrupt";
+    for (uint32_t i = 1; i < header->lineCount; i++) {
+        if (lines[i].offset <= lines[i - 1].offset) return "truncated or corrupt";
+    }
+    return NULL;
+}
+
+static ObjString* loadString(LoxcFile* file, LoxcHeader* header, LoxcString string) {
+    if ((uint64_t)string.offset + string.length > header->stringsLength) return NULL;
+    const char* chars = (const char*)file->mapping + header->stringsOffset + string.offset;
+    return copyString(chars, (int)string.length);
+}
+
+static const char* loadConstants(LoxcFile* file, LoxcHeader* header) {
+    Chunk* chunk = &file->chunk;
+    LoxcConstant* constants =
+        (LoxcConstant*)((uint8_t*)file->mapping + header->constantsOffset);
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        LoxcConstant* constant = &constants[i];
+        Value value;
+        switch (constant->type) {
+            case LOXC_NUMBER: {
+                double number;
+                memcpy(&number, &constant->as.bits, sizeof(number));
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case LOXC_STRING: {
+                ObjString* string = loadString(file, header, constant->as.string);
+                if (string == NULL) return "truncated or corrupt";
+                value = OBJ_VAL(string);
+                break;
+            }
+            case LOXC_NIL: value = NIL_VAL; break;
+            case LOXC_TRUE: value = BOOL_VAL(true); break;
+            case LOXC_FALSE: value = BOOL_VAL(false); break;
+            default: return "truncated or corrupt";
+        }
+        writeValueArray(&chunk->constants, value);
+    }
+    return NULL;
+}
+
+static const char* loadGlobals(LoxcFile* file, LoxcHeader* header) {
+    LoxcString* globals =
+        (LoxcString*)((uint8_t*)file->mapping + header->globalsOffset);
+    for (uint32_t i = 0; i < header->globalCount; i++) {
+        ObjString* name = loadString(file, header, globals[i]);
+        if (name == NULL) return "truncated or corrupt";
+        if (globalSlot(name) != (int)i) return "its globals clash with ones already defined";
+    }
+    return NULL;
+}
+
+static const char* loadSections(LoxcFile* file, LoxcHeader* header) {
+    uint8_t* base = file->mapping;
+    Chunk* chunk = &file->chunk;
+    chunk->code = base + header->codeOffset;
+    chunk->lines = (LineRun*)(base + header->linesOffset);
+    chunk->lineCount = (int)header->lineCount;
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->count = (int)header->codeLength;
+    chunk->capacity = chunk->count;
+    chunk->maxStack = (int)header->maxStack;
+
+    /* Root the constants as they are decoded, and while the global names
+       are: each copyString may collect. */
+    Chunk* rooted = vm.chunk;
+    vm.chunk = chunk;
+    const char* problem = loadConstants(file, header);
+    if (problem == NULL) problem = loadGlobals(file, header);
+    vm.chunk = rooted;
+    return problem;
+}
+
+const char* loadLoxcFile(const char* path, LoxcFile* file) {
+    initChunk(&file->chunk);
+    if (!mapFile(path, file)) return "could not open it";
+    LoxcHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, file->mapping,
+           file->size < sizeof(header) ? file->size : sizeof(header));
+    const char* problem = validate(file, &header);
+    if (problem == NULL) problem = loadSections(file, &header);
+    if (problem != NULL) closeLoxcFile(file);
+    return problem;
+}
+
+void closeLoxcFile(LoxcFile* file) {
+    freeValueArray(&file->chunk.constants);
+    unmapFile(file);
+    initChunk(&file->chunk);
+}
@@ -0,0 +1,94 @@
+/**
+ * loxc.h - Compiled bytecode files (.loxc).
+ *
+ * `clox --compile out.loxc script` writes the compiled chunk to a file;
+ * `clox out.loxc` runs it without scanning or compiling anything. The
+ * file is mapped into memory and its code and line runs are used in
+ * place, so loading costs a few system calls whatever the script's size.
+ *
+ * Layout (every offset is from the start of the file, so the file is
+ * position-independent; integers are in the writer's byte order, which
+ * the loader checks):
+ *
+ *   LoxcHeader
+ *   code       codeLength bytes
+ *   lines      lineCount LineRuns (pairs of int32), 4-byte aligned
+ *   constants  constantCount LoxcConstants, 8-byte aligned
+ *   globals    globalCount LoxcStrings: global names, in slot order
+ *   strings    the characters LoxcStrings point at
+ */
+#ifndef clox_loxc_h
+#define clox_loxc_h
+
+#include "chunk.h"
+#include "vm.h"
+
+#define LOXC_MAGIC "LOXC"
+/* Bump whenever the opcode set or any operand encoding changes. */
+#define LOXC_VERSION 3
+#define LOXC_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t maxStack;
+    uint32_t codeOffset;
+    uint32_t codeLength;
+    uint32_t linesOffset;
+    uint32_t lineCount;
+    uint32_t constantsOffset;
+    uint32_t constantCount;
+    uint32_t globalsOffset;
+    uint32_t globalCount;
+    uint32_t stringsOffset;
+    uint32_t stringsLength;
+} LoxcHeader;
+
+typedef struct {
+    uint32_t offset;   /* into the strings section */
+    uint32_t length;
+} LoxcString;
+
+typedef enum {
+    LOXC_NUMBER,
+    LOXC_STRING,
+    LOXC_NIL,
+    LOXC_TRUE,
+    LOXC_FALSE,
+} LoxcConstantType;
+
+typedef struct {
+    uint32_t type;     /* LoxcConstantType */
+    uint32_t unused;
+    union {
+        uint64_t bits; /* LOXC_NUMBER: the double's bits */
+        LoxcString string;
+    } as;
+} LoxcConstant;
+
+/* A loaded file. chunk.code and chunk.lines point into the mapping; the
+   mapping is private and writable, so quickening can rewrite the code
+   without touching the file. */
+typedef struct {
+    Chunk chunk;
+    void* mapping;
+    size_t size;
+} LoxcFile;
+
+/* Compiles `source` (optimizing it under -O) and writes it to `path`.
+   Returns INTERPRET_COMPILE_ERROR if it does not compile or can't be
+   written. */
+InterpretResult compileToFile(const char* source, const char* path);
+/* Writes an unrun chunk (quickening rewrites code in place) to `path`,
+   atomically replacing anything already there. */
+bool writeLoxcFile(Chunk* chunk, const char* path);
+/* Maps and validates `path`: besides the header and sections, every
+   instruction is checked, so that no file, not even one planted in the
+   cache directory, can make run() or the JITs read or jump out of bounds.
+   Returns NULL on success, otherwise what is wrong with the file. Must run before anything else defines globals,
+   since the code uses the slot numbers it was compiled with. */
+const char* loadLoxcFile(const char* path, LoxcFile* file);
+void closeLoxcFile(LoxcFile* file);
+
+#endif
@@ -0,0 +1,488 @@
+/**
+ * memory.c - Allocation accounting and the mark-sweep collector.
+ *
+ * Marking uses an explicit gray stack rather than recursion, so deep
+ * object graphs can't overflow the C stack. The intern set holds its
+ * strings weakly: entries whose string went unmarked are removed before
+ * the sweep frees it.
+ *
+ * A minor collection promotes every young object reachable from the stack
+ * or a remembered global straight to the old heap (there is one nursery
+ * and no survivor space), leaving a forwarding pointer in the young
+ * copy's `next` field. Walking the nursery afterwards finds each young
+ * interned string, whose intern entry it updates or drops. A
+ * full collection always starts with a minor one, so marking and sweeping
+ * only ever see old objects.
+ *
+ * With vm.incremental set, a collection is spread over slices instead,
+ * each run from an allocation and stopped after vm.pauseTarget:
+ * - GC_MARK: tri-color marking. Black objects are marked and traced, gray
+ *   ones are marked and on the gray stack, white ones unmarked. The global
+ *   slots are traced a few at a time through markCursor. Objects are
+ *   allocated black, and writeBarrierGlobal shades whatever is stored into
+ *   a global, so a black slot never ends up holding a white object. The
+ *   stack has no barrier: the slice that finishes marking rescans it.
+ * - GC_WEAK: unmarked strings leave the intern set, a few entries at a
+ *   time. copyString shades any string it finds there while marking, so
+ *   a string that was unreachable but gets looked up again survives.
+ * - GC_SWEEP: the remaining white objects are freed. Objects allocated
+ *   from here on are white and go on vm.objects, out of the sweep's way.
+ * Compiled code has no write barrier, so gcBeforeCompiledCode() finishes
+ * marking before it runs. Marking on a second thread is not supported:
+ * nothing in the VM is synchronized.
+ */
+#include "memory.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define GC_HEAP_GROW_FACTOR 2
+/* Incremental mode: bytes allocated between slices, and the units of
+   work (objects traced, slots or entries visited, objects swept) done
+   between checks of the clock. */
+#define GC_SLICE_BYTES (64 * 1024)
+#define GC_SLICE_WORK 256
+
+static void startCycle(void);
+static void runSlice(void);
+static void finishCycle(void);
+
+/* Pauses nest (a full collection runs a minor one); only the outermost
+   is timed. */
+static int pauseDepth = 0;
+static clock_t pauseStart;
+static bool cycleFinished = false;
+
+static void beginPause(void) {
+    if (pauseDepth++ == 0) pauseStart = clock();
+}
+
+static void endPause(void) {
+    if (--pauseDepth > 0) return;
+    double micros = (double)(clock() - pauseStart) * 1e6 / CLOCKS_PER_SEC;
+    GCStats* stats = &vm.gcCycle;
+    int bucket = 0;
+    while (bucket < GC_PAUSE_BUCKETS - 1 && micros >= (16 << bucket)) bucket++;
+    stats->pauses[bucket]++;
+    stats->pauseCount++;
+    stats->totalPause += micros;
+    if (micros > stats->maxPause) stats->maxPause = micros;
+
+    if (!cycleFinished) return;
+    cycleFinished = false;
+    stats->cycle++;
+    vm.gcLastCycle = *stats;
+    memset(stats, 0, sizeof(GCStats));
+    stats->cycle = vm.gcLastCycle.cycle;
+    if (vm.logGCStats) printGCStats(&vm.gcLastCycle);
+}
+
+/* Called once a collection has freed everything it will. Its stats are
+   closed when the pause it happens in ends, so they include that one. */
+static void endCycle(void) {
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    if (vm.nextGC < GC_INITIAL_HEAP) vm.nextGC = GC_INITIAL_HEAP;
+    cycleFinished = true;
+}
+
+static void collectIfNeeded(void) {
+    if (!vm.incremental) {
+        if (vm.gcStress || vm.bytesAllocated > vm.nextGC) collectGarbage();
+    } else if (vm.gcPhase == GC_IDLE) {
+        if (vm.gcStress || vm.bytesAllocated > vm.nextGC) startCycle();
+    } else if (vm.gcStress || vm.bytesAllocated >= vm.nextSlice) {
+        beginPause();
+        runSlice();
+        endPause();
+    }
+}
+
+/* Never collects, so the collector can allocate its own bookkeeping and
+   promoted objects through it in the middle of a collection. */
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    vm.bytesAllocated += newSize - oldSize;
+    return allocatorResize(&vm.allocator, pointer, oldSize, newSize);
+}
+
+void* allocateOld(size_t size) {
+    vm.bytesAllocated += size;
+    collectIfNeeded();
+    return allocatorResize(&vm.allocator, NULL, 0, size);
+}
+
+static size_t youngSize(Obj* object) {
+    size_t size = 0;
+    switch (object->type) {
+        case OBJ_STRING:
+            size = STRING_SIZE(((ObjString*)object)->length);
+            break;
+        case OBJ_ROPE:
+            size = sizeof(ObjRope);
+            break;
+    }
+    return (size + 7) & ~(size_t)7;
+}
+
+Obj* allocateYoung(size_t size) {
+    if (!vm.generational || vm.pretenure || size > NURSERY_MAX_OBJECT) return NULL;
+    if (vm.nursery == NULL) {
+        vm.nursery = reallocate(NULL, 0, NURSERY_SIZE);
+        vm.nurseryTop = vm.nursery;
+        vm.nurseryEnd = vm.nursery + NURSERY_SIZE;
+    }
+    size = (size + 7) & ~(size_t)7;
+    if (vm.gcStress || (size_t)(vm.nurseryEnd - vm.nurseryTop) < size) {
+        collectNursery();
+        /* Promotion grows the old heap without checking the threshold. */
+        collectIfNeeded();
+    }
+    Obj* object = (Obj*)vm.nurseryTop;
+    vm.nurseryTop += size;
+    object->isMarked = false;
+    object->next = NULL;
+    return object;
+}
+
+void rememberGlobal(int slot) {
+    if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+        int oldCapacity = vm.rememberedCapacity;
+        vm.rememberedCapacity = GROW_CAPACITY(oldCapacity);
+        vm.rememberedSlots = GROW_ARRAY(int, vm.rememberedSlots,
+                                        oldCapacity, vm.rememberedCapacity);
+    }
+    vm.rememberedSlots[vm.rememberedCount++] = slot;
+    vm.rememberedGlobals[slot] = 1;
+}
+
+/* Returns the old copy of `object`, copying it out of the nursery the
+   first time it is reached. */
+static Obj* promote(Obj* object) {
+    if (!isYoung(object)) return object;
+    if (object->next != NULL) return object->next;
+
+    Obj* copy = NULL;
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* young = (ObjString*)object;
+            size_t size = STRING_SIZE(young->length);
+            ObjString* string = reallocate(NULL, 0, size);
+            string->length = young->length;
+            string->hash = young->hash;
+            string->interned = young->interned;
+            memcpy(string->chars, young->chars, young->length + 1);
+            copy = (Obj*)string;
+            break;
+        }
+        case OBJ_ROPE:
+            copy = reallocate(NULL, 0, sizeof(ObjRope));
+            memcpy(copy, object, sizeof(ObjRope));
+            break;
+    }
+    copy->type = object->type;
+    copy->isMarked = gcMarking();  /* allocated black, like any new object */
+    copy->next = vm.objects;
+    vm.objects = copy;
+    object->next = copy;
+    if (copy->type == OBJ_ROPE) {
+        /* An old rope must not point into the nursery. Ropes are
+           balanced, so this recursion is shallow. */
+        ObjRope* rope = (ObjRope*)copy;
+        rope->left = promote(rope->left);
+        rope->right = promote(rope->right);
+        rope->flat = (ObjString*)promote((Obj*)rope->flat);
+    }
+    return copy;
+}
+
+static Value promoteValue(Value value) {
+    if (IS_OBJ(value) && isYoung(AS_OBJ(value))) return OBJ_VAL(promote(AS_OBJ(value)));
+    return value;
+}
+
+static void minorCollection(void) {
+    if (vm.nurseryTop == vm.nursery) return;
+#if DEBUG_LOG_GC
+    fprintf(stderr, "-- minor gc: %zu bytes young\n",
+            (size_t)(vm.nurseryTop - vm.nursery));
+#endif
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        *slot = promoteValue(*slot);
+    }
+    for (int i = 0; i < vm.rememberedCount; i++) {
+        int slot = vm.rememberedSlots[i];
+        vm.globalValues.values[slot] = promoteValue(vm.globalValues.values[slot]);
+        vm.rememberedGlobals[slot] = 0;
+    }
+    vm.rememberedCount = 0;
+    /* promote() copied whatever promoted ropes point at, so there is
+       nothing left to scan. */
+
+    for (uint8_t* at = vm.nursery; at < vm.nurseryTop; at += youngSize((Obj*)at)) {
+        Obj* object = (Obj*)at;
+        if (object->type != OBJ_STRING || !((ObjString*)object)->interned) continue;
+        tableDelete(&vm.strings, (ObjString*)object);
+        if (object->next != NULL) tableSet(&vm.strings, (ObjString*)object->next, NIL_VAL);
+    }
+    vm.nurseryTop = vm.nursery;
+}
+
+void collectNursery(void) {
+    beginPause();
+    minorCollection();
+    endPause();
+}
+
+void markObject(Obj* object) {
+    /* Young objects are the minor collector's: none are left by the time
+       marking finishes. */
+    if (object == NULL || object->isMarked || isYoung(object)) return;
+#if DEBUG_LOG_GC
+    fprintf(stderr, "%p mark ", (void*)object);
+    printValue(OBJ_VAL(object));
+    fprintf(stderr, "\n");
+#endif
+    object->isMarked = true;
+
+    if (vm.grayCapacity < vm.grayCount + 1) {
+        int oldCapacity = vm.grayCapacity;
+        vm.grayCapacity = GROW_CAPACITY(oldCapacity);
+        vm.grayStack = GROW_ARRAY(Obj*, vm.grayStack, oldCapacity, vm.grayCapacity);
+    }
+    vm.grayStack[vm.grayCount++] = object;
+}
+
+void markValue(Value value) {
+    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+}
+
+static void markArray(ValueArray* array) {
+    for (int i = 0; i < array->count; i++) {
+        markValue(array->values[i]);
+    }
+}
+
+static void blackenObject(Obj* object) {
+#if DEBUG_LOG_GC
+    fprintf(stderr, "%p blacken ", (void*)object);
+    printValue(OBJ_VAL(object));
+    fprintf(stderr, "\n");
+#endif
+    switch (object->type) {
+        case OBJ_STRING:
+            break;  /* strings hold no references */
+        case OBJ_ROPE: {
+            ObjRope* rope = (ObjRope*)object;
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject((Obj*)rope->flat);
+            break;
+        }
+    }
+}
+
+static void markRoots(void) {
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        markValue(*slot);
+    }
+    markTable(&vm.globalSlots);
+    markArray(&vm.globalValues);
+    markArray(&vm.globalNames);
+    if (vm.chunk != NULL) markArray(&vm.chunk->constants);
+    markCompilerRoots();
+}
+
+static void traceReferences(void) {
+    while (vm.grayCount > 0) {
+        Obj* object = vm.grayStack[--vm.grayCount];
+        blackenObject(object);
+    }
+}
+
+static void sweep(void) {
+    Obj* previous = NULL;
+    Obj* object = vm.objects;
+    while (object != NULL) {
+        if (object->isMarked) {
+            object->isMarked = false;
+            previous = object;
+            object = object->next;
+        } else {
+            Obj* unreached = object;
+            object = object->next;
+            if (previous != NULL) {
+                previous->next = object;
+            } else {
+                vm.objects = object;
+            }
+            freeObject(unreached);
+        }
+    }
+}
+
+void collectGarbage(void) {
+    beginPause();
+    if (vm.gcPhase != GC_IDLE) {
+        finishCycle();
+        endPause();
+        return;
+    }
+#if DEBUG_LOG_GC
+    fprintf(stderr, "-- gc begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+
+    minorCollection();
+    markRoots();
+    traceReferences();
+    tableRemoveWhite(&vm.strings);
+    sweep();
+    endCycle();
+
+#if DEBUG_LOG_GC
+    fprintf(stderr, "-- gc end\n");
+    fprintf(stderr, "   collected %zu bytes (from %zu to %zu) next at %zu\n",
+            before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+#endif
+    endPause();
+}
+
+/* --- Incremental collection ---------------------------------------------- */
+
+static void startCycle(void) {
+#if DEBUG_LOG_GC
+    fprintf(stderr, "-- gc cycle begin\n");
+#endif
+    beginPause();
+    minorCollection();
+    vm.gcPhase = GC_MARK;
+    vm.markCursor = 0;
+    /* Constant pools never change while they are in use, and anything
+       added to one from now on is allocated black or shaded. */
+    if (vm.chunk != NULL) markArray(&vm.chunk->constants);
+    markCompilerRoots();
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    endPause();
+}
+
+/* The atomic end of marking: with the nursery empty, rescan the stack,
+   then trace whatever that shaded. */
+static void finishMark(void) {
+    minorCollection();
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        markValue(*slot);
+    }
+    traceReferences();
+    vm.gcPhase = GC_WEAK;
+    vm.weakEntries = vm.strings.entries;
+    vm.weakCursor = 0;
+}
+
+/* One unit of work; returns false once the cycle is over. */
+static bool stepCycle(void) {
+    switch (vm.gcPhase) {
+        case GC_IDLE:
+            return false;
+        case GC_MARK:
+            if (vm.grayCount > 0) {
+                blackenObject(vm.grayStack[--vm.grayCount]);
+            } else if (vm.markCursor < vm.globalValues.count) {
+                markValue(vm.globalValues.values[vm.markCursor]);
+                markValue(vm.globalNames.values[vm.markCursor]);
+                vm.markCursor++;
+            } else {
+                finishMark();
+            }
+            return true;
+        case GC_WEAK: {
+            if (vm.grayCount > 0) {
+                blackenObject(vm.grayStack[--vm.grayCount]);
+                return true;
+            }
+            /* The table grew and rehashed. Starting the walk over could
+               fall behind for good, so finish it in one pass, no slower
+               than the rehash that just happened. */
+            if (vm.strings.entries != vm.weakEntries) {
+                tableRemoveWhite(&vm.strings);
+                vm.weakEntries = vm.strings.entries;
+                vm.weakCursor = vm.strings.capacity;
+            }
+            if (vm.weakCursor < vm.strings.capacity) {
+                Entry* entry = &vm.strings.entries[vm.weakCursor++];
+                if (entry->key != NULL && !entry->key->obj.isMarked) {
+                    tableDelete(&vm.strings, entry->key);
+                }
+                return true;
+            }
+            vm.gcPhase = GC_SWEEP;
+            vm.sweepList = vm.objects;
+            vm.objects = NULL;
+            return true;
+        }
+        case GC_SWEEP: {
+            Obj* object = vm.sweepList;
+            if (object == NULL) {
+                vm.gcPhase = GC_IDLE;
+                endCycle();
+#if DEBUG_LOG_GC
+                fprintf(stderr, "-- gc cycle end: %zu bytes, next at %zu\n",
+                        vm.bytesAllocated, vm.nextGC);
+#endif
+                return false;
+            }
+            vm.sweepList = object->next;
+            if (object->isMarked) {
+                object->isMarked = false;
+                object->next = vm.objects;
+                vm.objects = object;
+            } else {
+                freeObject(object);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+static void runSlice(void) {
+    clock_t start = clock();
+    clock_t budget = (clock_t)(vm.pauseTarget * CLOCKS_PER_SEC / 1e6);
+    int batch = vm.gcStress ? 1 : GC_SLICE_WORK;
+    for (;;) {
+        for (int i = 0; i < batch; i++) {
+            if (!stepCycle()) return;
+        }
+        if (vm.gcStress || clock() - start >= budget) break;
+    }
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+}
+
+static void finishCycle(void) {
+    while (stepCycle()) {}
+}
+
+void gcBeforeCompiledCode(void) {
+    beginPause();
+    minorCollection();
+    while (gcMarking()) stepCycle();
+    endPause();
+}
+
+void getGCStats(GCStats* stats) {
+    *stats = vm.gcLastCycle;
+}
+
+void printGCStats(const GCStats* stats) {
+    fprintf(stderr, "gc %d: %d pauses, max %.0fus, total %.0fus\n", stats->cycle,
+            stats->pauseCount, stats->maxPause, stats->totalPause);
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (stats->pauses[i] == 0) continue;
+        if (i < GC_PAUSE_BUCKETS - 1) {
+            fprintf(stderr, "  <%6dus %d\n", 16 << i, stats->pauses[i]);
+        } else {
+            fprintf(stderr, "  >=%5dus %d\n", 16 << (i - 1), stats->pauses[i]);
+        }
+    }
+}
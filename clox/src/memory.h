@@ -0,0 +1,108 @@
+/**
+ * memory.h - Heap allocation and garbage collection.
+ *
+ * Everything the VM allocates, Lox objects and its own bookkeeping
+ * (chunks, tables, the stack) alike, goes through reallocate() to
+ * vm.allocator (see allocator.h), so vm.bytesAllocated tracks all of it.
+ * Only file buffers owned by the caller use plain malloc. reallocate()
+ * itself never collects: allocating an object does. When
+ * vm.bytesAllocated passes vm.nextGC, the next object allocation runs a
+ * mark-sweep collection first.
+ *
+ * Roots are the VM stack, the global slots and names, vm.chunk's
+ * constants, and the constants of the chunk being compiled. Anything
+ * that allocates while holding an unrooted object must root it first.
+ *
+ * With vm.generational set, objects allocated while a chunk runs are
+ * bump-allocated in a fixed nursery instead. When it fills, a minor
+ * collection copies the survivors out to the old heap and empties it.
+ * Minor collections move objects, so after any allocation an Obj* held
+ * in a C local is stale: reload it from the stack. They only look at
+ * the stack and at the global slots recorded by the write barrier below,
+ * so every store of a Value into a global slot must go through it.
+ *
+ * Objects made while compiling or loading (everything in a constant
+ * pool) go straight to the old heap. Compiled code embeds constants as
+ * immediates, so the nursery is emptied before it runs, and what it
+ * allocates (concatenating strings) is old, so it never sees a young
+ * object. Old objects other than global slots never point at young
+ * ones: a rope's children are promoted with it, and a rope is flattened
+ * into an old string.
+ *
+ * With vm.incremental set, an old-heap collection runs in slices of at
+ * most about vm.pauseTarget microseconds between allocations, and the
+ * same barrier keeps the marker sound while the program runs between
+ * them (see memory.c).
+ */
+#ifndef clox_memory_h
+#define clox_memory_h
+
+#include "common.h"
+#include "value.h"
+#include "vm.h"
+
+/* Heap size that triggers the first collection. */
+#define GC_INITIAL_HEAP (1024 * 1024)
+/* Nursery size; larger objects are allocated old. */
+#define NURSERY_SIZE (128 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 8)
+
+#define ALLOCATE(type, count) \
+    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+
+#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+
+#define GROW_CAPACITY(capacity) \
+    ((capacity) < 8 ? 8 : (capacity) * 2)
+
+#define GROW_ARRAY(type, pointer, oldCount, newCount) \
+    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+        sizeof(type) * (newCount))
+
+#define FREE_ARRAY(type, pointer, oldCount) \
+    reallocate(pointer, sizeof(type) * (oldCount), 0)
+
+/* The one allocation hook: NULL `pointer` allocates, zero `newSize`
+   frees, and `oldSize` must be what the block was allocated with. */
+void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+/* Allocates `size` bytes for an old object, collecting first if the heap
+   has grown enough. */
+void* allocateOld(size_t size);
+/* Bump-allocates `size` bytes in the nursery, running a minor collection
+   first if they don't fit. Returns NULL when the object should be
+   allocated old instead. */
+Obj* allocateYoung(size_t size);
+void collectNursery(void);
+void rememberGlobal(int slot);
+void markObject(Obj* object);
+void markValue(Value value);
+/* Runs a whole collection now, or finishes the incremental one under way. */
+void collectGarbage(void);
+/* Compiled code embeds constants and stores globals without a barrier:
+   empty the nursery and finish any incremental marking before it runs. */
+void gcBeforeCompiledCode(void);
+/* Stats for the most recently completed collection. */
+void getGCStats(GCStats* stats);
+void printGCStats(const GCStats* stats);
+
+static inline bool gcMarking(void) {
+    return vm.gcPhase == GC_MARK || vm.gcPhase == GC_WEAK;
+}
+
+static inline bool isYoung(Obj* object) {
+    return (uint8_t*)object >= vm.nursery && (uint8_t*)object < vm.nurseryEnd;
+}
+
+/* Write barrier for global slot stores: young objects go in the
+   remembered set, and while marking, old ones are shaded. */
+static inline void writeBarrierGlobal(int slot, Value value) {
+    if (!IS_OBJ(value)) return;
+    Obj* object = AS_OBJ(value);
+    if (isYoung(object)) {
+        if (!vm.rememberedGlobals[slot]) rememberGlobal(slot);
+    } else if (gcMarking()) {
+        markObject(object);
+    }
+}
+
+#endif
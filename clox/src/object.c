@@ -1,22 +1,248 @@
 /**
- * object.c - String allocation for variable names.
+ * object.c - Object allocation.
+ *
+ * Old objects are allocated through allocateOld(), which may collect
+ * first, and are linked into vm.objects as they are made. Young ones live
+ * in the nursery, and are not on any list until they are promoted. Either
+ * way a string's characters follow it in the same block.
+ *
+ * Ropes are rebalanced the way Boehm, Atkinson and Plass describe: a rope
+ * of depth d is balanced if it is at least fib(d + 2) characters long,
+ * and one that isn't is rebuilt from its leaves into a tree of depth
+ * log2(leaves). Appending a short string to a rope whose last leaf is
+ * short copies the two into one leaf instead of adding a node, so leaves
+ * stay near ROPE_MIN_LENGTH and the tree stays small.
  */
 #include "object.h"
-#include <stdlib.h>
+#include "memory.h"
+#include "table.h"
+#include "vm.h"
+#include <limits.h>
 #include <string.h>
 
+static Obj* linkObject(Obj* object, ObjType type) {
+    object->type = type;
+    object->isMarked = gcMarking();  /* allocated black while marking */
+    object->next = vm.objects;
+    vm.objects = object;
+    return object;
+}
+
+static Obj* allocateObject(size_t size, ObjType type) {
+    return linkObject((Obj*)allocateOld(size), type);
+}
+
+/* Young if the nursery can take it and `young` allows it. */
+static Obj* allocate(size_t size, ObjType type, bool young) {
+    Obj* object = young ? allocateYoung(size) : NULL;
+    if (object == NULL) return allocateObject(size, type);
+    object->type = type;
+    return object;
+}
+
+static ObjString* newString(int length, bool young) {
+    ObjString* string = (ObjString*)allocate(STRING_SIZE(length), OBJ_STRING, young);
+    string->length = length;
+    string->hash = 0;
+    string->interned = false;
+    string->chars[length] = '\0';
+    return string;
+}
+
+/* Allocates an uninterned string with room for `length` characters;
+   the caller fills them in. */
+ObjString* allocateString(int length) {
+    return newString(length, true);
+}
+
+/* The result is not reachable from any root yet: the caller must store
+   it somewhere the collector marks before allocating anything else. */
 ObjString* copyString(const char* chars, int length) {
-    ObjString* str = malloc(sizeof(ObjString));
-    str->length = length;
-    str->chars = malloc(length + 1);
-    memcpy(str->chars, chars, length);
-    str->chars[length] = '\0';
-    return str;
-}
-
-void freeObject(ObjString* obj) {
-    if (obj) {
-        free(obj->chars);
-        free(obj);
+    uint32_t hash = hashString(chars, length);
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL) {
+        /* It may be garbage the marker hasn't freed yet: it isn't now. */
+        if (gcMarking()) markObject((Obj*)interned);
+        return interned;
+    }
+
+    ObjString* string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+    string->interned = true;
+    tableSet(&vm.strings, string, NIL_VAL);
+    return string;
+}
+
+/* --- Ropes --------------------------------------------------------------- */
+
+static int stringLength(Obj* string) {
+    if (string->type == OBJ_ROPE) return ((ObjRope*)string)->length;
+    return ((ObjString*)string)->length;
+}
+
+static int stringDepth(Obj* string) {
+    return string->type == OBJ_ROPE ? ((ObjRope*)string)->depth : 0;
+}
+
+/* A flattened rope stands for its characters: use those. */
+static Obj* unwrap(Obj* string) {
+    if (string->type == OBJ_ROPE && ((ObjRope*)string)->flat != NULL) {
+        return (Obj*)((ObjRope*)string)->flat;
+    }
+    return string;
+}
+
+/* The caller has checked that the two lengths add up to at most INT_MAX,
+   as they do for any subtree of a rope that exists. */
+static void initRope(ObjRope* rope, Obj* left, Obj* right) {
+    rope->length = stringLength(left) + stringLength(right);
+    int depth = stringDepth(left) > stringDepth(right) ? stringDepth(left)
+                                                       : stringDepth(right);
+    rope->depth = depth + 1;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    /* A node allocated black must not point at white children. */
+    if (gcMarking()) {
+        markObject(left);
+        markObject(right);
+    }
+}
+
+static bool isBalanced(ObjRope* rope) {
+    uint64_t previous = 1;
+    uint64_t fib = 1;  /* fib(2) */
+    for (int i = 2; i < rope->depth + 2; i++) {
+        uint64_t next = previous + fib;
+        previous = fib;
+        fib = next;
+    }
+    return (uint64_t)rope->length >= fib;
+}
+
+static void gatherLeaves(Obj* string, Obj*** leaves, int* count, int* capacity) {
+    string = unwrap(string);
+    if (string->type == OBJ_ROPE) {
+        gatherLeaves(((ObjRope*)string)->left, leaves, count, capacity);
+        gatherLeaves(((ObjRope*)string)->right, leaves, count, capacity);
+        return;
+    }
+    if (*capacity < *count + 1) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *leaves = GROW_ARRAY(Obj*, *leaves, oldCapacity, *capacity);
+    }
+    (*leaves)[(*count)++] = string;
+}
+
+/* Nodes are allocated old and without collecting: nothing built here is
+   rooted until the whole tree is. */
+static Obj* buildBalanced(Obj** leaves, int count) {
+    if (count == 1) return leaves[0];
+    Obj* left = buildBalanced(leaves, count / 2);
+    Obj* right = buildBalanced(leaves + count / 2, count - count / 2);
+    ObjRope* rope = (ObjRope*)linkObject(reallocate(NULL, 0, sizeof(ObjRope)), OBJ_ROPE);
+    initRope(rope, left, right);
+    return (Obj*)rope;
+}
+
+static void rebalance(Value* slot) {
+    /* The new nodes are old, so their leaves must be too. */
+    if (vm.generational) collectNursery();
+    Obj** leaves = NULL;
+    int count = 0;
+    int capacity = 0;
+    gatherLeaves(AS_OBJ(*slot), &leaves, &count, &capacity);
+    *slot = OBJ_VAL(buildBalanced(leaves, count));
+    FREE_ARRAY(Obj*, leaves, capacity);
+}
+
+Obj* concatenateStrings(Value* operands) {
+    Obj* a = unwrap(AS_OBJ(operands[0]));
+    Obj* b = unwrap(AS_OBJ(operands[1]));
+    /* Ropes make doubling cheap, so this is easy to reach. */
+    if (stringLength(a) > INT_MAX - stringLength(b)) return NULL;
+    int length = stringLength(a) + stringLength(b);
+    if (length <= ROPE_MIN_LENGTH) {
+        /* Both are ObjStrings: a rope is always longer than this. */
+        ObjString* result = allocateString(length);
+        /* Read the operands after allocating: a minor GC may have moved them. */
+        ObjString* left = (ObjString*)unwrap(AS_OBJ(operands[0]));
+        ObjString* right = (ObjString*)unwrap(AS_OBJ(operands[1]));
+        memcpy(result->chars, left->chars, left->length);
+        memcpy(result->chars + left->length, right->chars, right->length);
+        return (Obj*)result;
+    }
+
+    if (a->type == OBJ_ROPE && b->type == OBJ_STRING) {
+        Obj* last = unwrap(((ObjRope*)a)->right);
+        if (last->type == OBJ_STRING &&
+            stringLength(last) + stringLength(b) <= ROPE_MIN_LENGTH) {
+            /* Append into the last leaf. The merged leaf replaces b, which
+               is no longer needed, as the root of the new node's right. */
+            ObjString* leaf = allocateString(stringLength(last) + stringLength(b));
+            ObjRope* rope = (ObjRope*)unwrap(AS_OBJ(operands[0]));
+            ObjString* tail = (ObjString*)unwrap(rope->right);
+            ObjString* piece = (ObjString*)unwrap(AS_OBJ(operands[1]));
+            memcpy(leaf->chars, tail->chars, tail->length);
+            memcpy(leaf->chars + tail->length, piece->chars, piece->length);
+            operands[1] = OBJ_VAL(leaf);
+            ObjRope* result = (ObjRope*)allocate(sizeof(ObjRope), OBJ_ROPE, true);
+            rope = (ObjRope*)unwrap(AS_OBJ(operands[0]));
+            initRope(result, unwrap(rope->left), AS_OBJ(operands[1]));
+            return (Obj*)result;
+        }
+    }
+
+    ObjRope* result = (ObjRope*)allocate(sizeof(ObjRope), OBJ_ROPE, true);
+    initRope(result, unwrap(AS_OBJ(operands[0])), unwrap(AS_OBJ(operands[1])));
+    if (isBalanced(result)) return (Obj*)result;
+    operands[0] = OBJ_VAL(result);
+    rebalance(&operands[0]);
+    return AS_OBJ(operands[0]);
+}
+
+static void copyLeaves(Obj* string, char* to) {
+    string = unwrap(string);
+    if (string->type == OBJ_ROPE) {
+        ObjRope* rope = (ObjRope*)string;
+        copyLeaves(rope->left, to);
+        copyLeaves(rope->right, to + stringLength(rope->left));
+        return;
+    }
+    memcpy(to, ((ObjString*)string)->chars, ((ObjString*)string)->length);
+}
+
+ObjString* flattenString(Value* slot) {
+    if (IS_STRING(*slot)) return AS_STRING(*slot);
+    if (AS_ROPE(*slot)->flat == NULL) {
+        /* Old, since the rope may be: an old object must not point at a
+           young one outside a global slot. */
+        ObjString* flat = newString(AS_ROPE(*slot)->length, false);
+        ObjRope* rope = AS_ROPE(*slot);
+        copyLeaves((Obj*)rope, flat->chars);
+        rope->flat = flat;
+        rope->left = NULL;
+        rope->right = NULL;
+    }
+    ObjString* flat = AS_ROPE(*slot)->flat;
+    *slot = OBJ_VAL(flat);
+    return flat;
+}
+
+void freeObject(Obj* object) {
+#if DEBUG_LOG_GC
+    fprintf(stderr, "%p free type %d\n", (void*)object, object->type);
+#endif
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            reallocate(object, STRING_SIZE(string->length), 0);
+            break;
+        }
+        case OBJ_ROPE:
+            FREE(ObjRope, object);
+            break;
     }
 }
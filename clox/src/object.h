@@ -1,18 +1,106 @@
 /**
- * object.h - Runtime objects (strings for variable names).
- * Minimal implementation for storing variable names in bytecode.
+ * object.h - Heap-allocated runtime objects.
+ *
+ * Every object starts with an Obj header: its type, the collector's mark
+ * bit, and a link in vm.objects, the list the sweep walks.
+ *
+ * A Lox string is an ObjString, holding its characters, or an ObjRope.
+ * Strings made by copyString (names and literals) are interned: it returns
+ * the existing ObjString when one with the same characters exists. Strings
+ * built at run time, by concatenation, are not; they are never hashed
+ * unless compared, so building a long string doesn't hash every
+ * intermediate. Two interned strings are equal exactly when their
+ * pointers are; valuesEqual compares characters otherwise.
+ *
+ * Concatenations longer than ROPE_MIN_LENGTH make a rope: a node pointing
+ * at its two halves, built in O(1) without copying them, so a loop
+ * appending to a string is linear rather than quadratic. Ropes are kept
+ * balanced, and flattenString() copies one out to an ObjString the first
+ * time something needs its characters in one piece.
  */
 #ifndef clox_object_h
 #define clox_object_h
 
 #include "common.h"
+#include "value.h"
+#include <stddef.h>
 
-typedef struct ObjString {
+typedef enum {
+    OBJ_STRING,
+    OBJ_ROPE,
+} ObjType;
+
+struct Obj {
+    ObjType type;
+    bool isMarked;
+    struct Obj* next;  /* next in vm.objects */
+};
+
+/* One allocation: the characters follow the header, NUL-terminated. */
+struct ObjString {
+    Obj obj;
+    uint32_t hash;     /* FNV-1a of chars; 0 until stringHash() is called */
+    int length;
+    bool interned;     /* in vm.strings */
+    char chars[];
+};
+
+/* Bytes in an ObjString of `length` characters. */
+#define STRING_SIZE(length) (offsetof(ObjString, chars) + (size_t)(length) + 1)
+
+/* Concatenations up to this long are copied into an ObjString. */
+#define ROPE_MIN_LENGTH 512
+
+/* The concatenation of `left` and `right`, each an ObjString or ObjRope.
+   Once flattened, `flat` holds the characters and the children are
+   dropped. */
+typedef struct {
+    Obj obj;
     int length;
-    char* chars;
-} ObjString;
+    int depth;         /* 1 + the deeper child's; an ObjString counts as 0 */
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+#define OBJ_TYPE(value)   (AS_OBJ(value)->type)
+#define IS_STRING(value)  isObjType(value, OBJ_STRING)
+#define IS_ROPE(value)    isObjType(value, OBJ_ROPE)
+/* Either representation: what Lox code sees as a string. */
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
+#define AS_STRING(value)  ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value)    ((ObjRope*)AS_OBJ(value))
 
+ObjString* allocateString(int length);
 ObjString* copyString(const char* chars, int length);
-void freeObject(ObjString* obj);
+/* Concatenates the strings in operands[0] and operands[1]. Both slots
+   must be GC roots; they are reused as scratch roots and overwritten.
+   Returns NULL, leaving them alone, if the result would be longer than
+   INT_MAX characters. */
+Obj* concatenateStrings(Value* operands);
+/* Replaces the string in *slot, a GC root, with an ObjString holding its
+   characters, flattening a rope. May allocate. */
+ObjString* flattenString(Value* slot);
+void freeObject(Obj* object);
+
+static inline bool isObjType(Value value, ObjType type) {
+    return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+static inline uint32_t hashString(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* Computes the hash on first use. A string that really hashes to 0 is
+   just rehashed each time. */
+static inline uint32_t stringHash(ObjString* string) {
+    if (string->hash == 0) string->hash = hashString(string->chars, string->length);
+    return string->hash;
+}
 
 #endif
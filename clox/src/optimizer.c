@@ -0,0 +1,571 @@
+/**
+ * optimizer.c - Peephole optimizer over bytecode chunks.
+ *
+ * The chunk is decoded into a list of instructions whose jumps name their
+ * target instruction rather than a byte offset. The passes below rewrite
+ * that list until nothing changes, then it is encoded back into the chunk
+ * with fresh offsets. Every instruction keeps its source line, so
+ * disassembleChunk and runtime errors see the same lines as before.
+ *
+ * Passes:
+ * - negated comparisons: OP_EQUAL OP_NOT -> OP_NOT_EQUAL, and likewise
+ *   OP_GREATER/OP_LESS followed by OP_NOT
+ * - constant folding of unary and binary operators on literal operands
+ * - literal conditions: OP_JUMP_IF_FALSE after a literal is dropped or
+ *   turned into OP_JUMP
+ * - push/pop pairs of side-effect-free pushes are removed
+ * - jump threading: a jump to an unconditional jump goes straight to the
+ *   final target; a jump to the next instruction is dropped
+ * - unreachable code (e.g. after OP_JUMP/OP_LOOP/OP_RETURN) is removed
+ *
+ * Once those reach a fixed point, common sequences are fused into
+ * superinstructions. The set was picked from DEBUG_OPCODE_PAIRS profiles
+ * of bench/, where loop tests, counter updates and assignment statements
+ * dominate:
+ * - OP_CONSTANT OP_LESS|OP_GREATER OP_JUMP_IF_FALSE OP_POP, with an OP_POP
+ *   at the jump target, -> OP_JUMP_IF_NOT_LESS_CONST/_GREATER_CONST
+ * - OP_JUMP_IF_FALSE OP_POP with the same target shape -> OP_POP_JUMP_IF_FALSE
+ * - OP_GET_x n OP_CONSTANT OP_ADD OP_SET_x n OP_POP -> OP_INCREMENT_x
+ * - OP_SET_x OP_POP -> OP_SET_x_POP
+ *
+ * Instructions are only ever removed or replaced by ones that use no more
+ * stack, so chunk->maxStack stays a valid bound.
+ */
+#include "optimizer.h"
+#include "memory.h"
+#include <string.h>
+
+typedef struct {
+    uint8_t op;
+    int operands[2];   /* constant indexes and slots, in encoding order */
+    int target;        /* jumps: index of the target instruction */
+    int offset;        /* byte offset in the original chunk */
+    int line;
+    bool removed;
+} Instr;
+
+typedef struct {
+    Chunk* chunk;
+    Arena arena;       /* arrays that live as long as the optimizer */
+    Instr* code;
+    int count;
+    int* refs;         /* how many live jumps land on each instruction */
+    bool changed;
+} Optimizer;
+
+/* Operand layout: up to two plain operands of 1 to 3 bytes, then a 2- or
+   3-byte offset if the instruction jumps. */
+typedef struct {
+    int widths[2];
+    int jumpWidth;     /* 0 if the instruction does not jump */
+} OpFormat;
+
+static OpFormat formatOf(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_SET_LOCAL_POP:
+            return (OpFormat){{1, 0}, 0};
+        case OP_GET_GLOBAL_SLOT:
+        case OP_DEFINE_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_POP:
+            return (OpFormat){{2, 0}, 0};
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            return (OpFormat){{3, 0}, 0};
+        case OP_INCREMENT_LOCAL:
+            return (OpFormat){{1, 1}, 0};
+        case OP_INCREMENT_GLOBAL:
+            return (OpFormat){{2, 1}, 0};
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_POP_JUMP_IF_FALSE:
+            return (OpFormat){{0, 0}, 2};
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return (OpFormat){{0, 0}, 3};
+        case OP_JUMP_IF_NOT_LESS_CONST:
+        case OP_JUMP_IF_NOT_GREATER_CONST:
+            return (OpFormat){{1, 0}, 2};
+        default:
+            return (OpFormat){{0, 0}, 0};
+    }
+}
+
+static int instrLength(uint8_t op) {
+    OpFormat format = formatOf(op);
+    return 1 + format.widths[0] + format.widths[1] + format.jumpWidth;
+}
+
+static bool isJump(uint8_t op) {
+    return formatOf(op).jumpWidth > 0;
+}
+
+static bool isUnconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_JUMP_LONG || op == OP_LOOP_LONG;
+}
+
+/* Control never falls through these. */
+static bool isTerminator(uint8_t op) {
+    return isUnconditional(op) || op == OP_RETURN;
+}
+
+static void decode(Optimizer* opt) {
+    Chunk* chunk = opt->chunk;
+    int* indexAt = arenaAllocate(&opt->arena, sizeof(int) * (chunk->count + 1));
+    opt->code = arenaAllocate(&opt->arena, sizeof(Instr) * chunk->count);
+    opt->count = 0;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        Instr* instr = &opt->code[opt->count];
+        OpFormat format = formatOf(op);
+        instr->op = op;
+        instr->target = -1;
+        instr->offset = offset;
+        instr->line = getLine(chunk, offset);
+        instr->removed = false;
+        int at = offset + 1;
+        for (int n = 0; n < 2; n++) {
+            instr->operands[n] = 0;
+            for (int byte = 0; byte < format.widths[n]; byte++) {
+                instr->operands[n] = (instr->operands[n] << 8) | chunk->code[at++];
+            }
+        }
+        if (format.jumpWidth > 0) {
+            /* Stash the raw offset until every instruction has an index. */
+            int jump = 0;
+            for (int byte = 0; byte < format.jumpWidth; byte++) {
+                jump = (jump << 8) | chunk->code[at++];
+            }
+            bool backward = op == OP_LOOP || op == OP_LOOP_LONG;
+            instr->target = backward ? at - jump : at + jump;
+        }
+        indexAt[offset] = opt->count++;
+        offset += instrLength(op);
+    }
+    /* Second pass: byte offsets -> instruction indexes. */
+    for (int i = 0; i < opt->count; i++) {
+        Instr* instr = &opt->code[i];
+        if (isJump(instr->op)) instr->target = indexAt[instr->target];
+    }
+    opt->refs = arenaAllocate(&opt->arena, sizeof(int) * opt->count);
+}
+
+/* Drops removed instructions, redirecting jumps that pointed at one to the
+   next surviving instruction (a removed instruction behaves as a no-op). */
+static void compact(Optimizer* opt) {
+    int oldCount = opt->count;
+    int* newIndex = ALLOCATE(int, oldCount + 1);
+    int live = 0;
+    for (int i = 0; i < opt->count; i++) {
+        newIndex[i] = live;
+        if (!opt->code[i].removed) live++;
+    }
+    newIndex[opt->count] = live;
+    int j = 0;
+    for (int i = 0; i < opt->count; i++) {
+        if (opt->code[i].removed) continue;
+        Instr instr = opt->code[i];
+        if (isJump(instr.op)) instr.target = newIndex[instr.target];
+        opt->code[j++] = instr;
+    }
+    opt->count = j;
+    FREE_ARRAY(int, newIndex, oldCount + 1);
+}
+
+static void countRefs(Optimizer* opt) {
+    for (int i = 0; i < opt->count; i++) opt->refs[i] = 0;
+    for (int i = 0; i < opt->count; i++) {
+        if (isJump(opt->code[i].op)) opt->refs[opt->code[i].target]++;
+    }
+}
+
+static void removeInstr(Optimizer* opt, int index) {
+    opt->code[index].removed = true;
+    opt->changed = true;
+}
+
+/* Index of the next live instruction after `index`, or -1. */
+static int nextLive(Optimizer* opt, int index) {
+    for (int i = index + 1; i < opt->count; i++) {
+        if (!opt->code[i].removed) return i;
+    }
+    return -1;
+}
+
+/* A pushed literal the optimizer knows the value of. */
+static bool literalValue(Optimizer* opt, Instr* instr, Value* out) {
+    switch (instr->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            *out = opt->chunk->constants.values[instr->operands[0]];
+            return true;
+        case OP_NIL: *out = NIL_VAL; return true;
+        case OP_TRUE: *out = BOOL_VAL(true); return true;
+        case OP_FALSE: *out = BOOL_VAL(false); return true;
+        default: return false;
+    }
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/* Rewrites `instr` to push `value`. Fails if that would take a longer
+   instruction than `instr` already is. */
+static bool setLiteral(Optimizer* opt, Instr* instr, Value value) {
+    if (IS_BOOL(value)) {
+        instr->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        return true;
+    }
+    if (IS_NIL(value)) {
+        instr->op = OP_NIL;
+        return true;
+    }
+    int constant = opt->chunk->constants.count;
+    uint8_t op = constant <= UINT8_MAX ? OP_CONSTANT : OP_CONSTANT_LONG;
+    if (constant > UINT24_MAX || instrLength(op) > instrLength(instr->op)) return false;
+    instr->op = op;
+    instr->operands[0] = addConstant(opt->chunk, value);
+    return true;
+}
+
+/* Evaluates a binary operator on two literals, or returns false if the
+   operation would be a runtime error (which must still happen at run). */
+static bool foldBinary(uint8_t op, Value a, Value b, Value* result) {
+    switch (op) {
+        case OP_EQUAL: *result = BOOL_VAL(valuesEqual(a, b)); return true;
+        case OP_NOT_EQUAL: *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        default: break;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD: *result = NUMBER_VAL(x + y); return true;
+        case OP_SUBTRACT: *result = NUMBER_VAL(x - y); return true;
+        case OP_MULTIPLY: *result = NUMBER_VAL(x * y); return true;
+        case OP_DIVIDE:
+            if (y == 0) return false;
+            *result = NUMBER_VAL(x / y);
+            return true;
+        case OP_GREATER: *result = BOOL_VAL(x > y); return true;
+        case OP_LESS: *result = BOOL_VAL(x < y); return true;
+        case OP_GREATER_EQUAL: *result = BOOL_VAL(!(x < y)); return true;
+        case OP_LESS_EQUAL: *result = BOOL_VAL(!(x > y)); return true;
+        default: return false;
+    }
+}
+
+static void peephole(Optimizer* opt) {
+    for (int i = 0; i < opt->count; i++) {
+        Instr* a = &opt->code[i];
+        if (a->removed) continue;
+        int j = nextLive(opt, i);
+        if (j == -1) break;
+        Instr* b = &opt->code[j];
+        if (opt->refs[j] > 0) continue;  /* b is entered from elsewhere */
+
+        /* Negated comparisons. */
+        if (b->op == OP_NOT &&
+            (a->op == OP_EQUAL || a->op == OP_GREATER || a->op == OP_LESS)) {
+            a->op = a->op == OP_EQUAL ? OP_NOT_EQUAL
+                  : a->op == OP_GREATER ? OP_LESS_EQUAL : OP_GREATER_EQUAL;
+            removeInstr(opt, j);
+            continue;
+        }
+
+        Value x;
+        if (!literalValue(opt, a, &x)) continue;
+
+        /* Unary operators on a literal. */
+        if (b->op == OP_NOT) {
+            setLiteral(opt, a, BOOL_VAL(isFalsey(x)));
+            removeInstr(opt, j);
+            continue;
+        }
+        if (b->op == OP_NEGATE && IS_NUMBER(x)) {
+            if (setLiteral(opt, a, NUMBER_VAL(-AS_NUMBER(x)))) removeInstr(opt, j);
+            continue;
+        }
+        /* A literal that is immediately discarded. */
+        if (b->op == OP_POP) {
+            removeInstr(opt, i);
+            removeInstr(opt, j);
+            continue;
+        }
+        /* Branch on a literal condition. The condition stays pushed, so a
+           taken branch becomes a plain jump. */
+        if (b->op == OP_JUMP_IF_FALSE || b->op == OP_JUMP_IF_FALSE_LONG) {
+            if (isFalsey(x)) {
+                b->op = b->op == OP_JUMP_IF_FALSE ? OP_JUMP : OP_JUMP_LONG;
+                opt->changed = true;
+            } else {
+                removeInstr(opt, j);
+            }
+            continue;
+        }
+
+        /* Binary operators on two literals. */
+        Value y;
+        if (!literalValue(opt, b, &y)) continue;
+        int k = nextLive(opt, j);
+        if (k == -1 || opt->refs[k] > 0) continue;
+        Value result;
+        if (!foldBinary(opt->code[k].op, x, y, &result)) continue;
+        Instr folded = *a;
+        folded.line = opt->code[k].line;
+        if (!setLiteral(opt, &folded, result)) continue;
+        *a = folded;
+        removeInstr(opt, j);
+        removeInstr(opt, k);
+    }
+}
+
+static void threadJumps(Optimizer* opt) {
+    for (int i = 0; i < opt->count; i++) {
+        Instr* jump = &opt->code[i];
+        if (jump->removed || !isJump(jump->op)) continue;
+        int target = jump->target;
+        int limit = formatOf(jump->op).jumpWidth == 3 ? UINT24_MAX : UINT16_MAX;
+        /* Follow chains of unconditional jumps; the hop limit guards
+           against jump cycles (an empty infinite loop). */
+        for (int hops = 0; hops < opt->count; hops++) {
+            Instr* next = &opt->code[target];
+            if (!isUnconditional(next->op)) break;
+            int dest = next->target;
+            if (dest == target) break;
+            /* Only unconditional jumps may change direction. */
+            if (!isUnconditional(jump->op) && dest <= i) break;
+            /* Old offsets bound the new distance, which must fit the
+               jump's operand. */
+            int distance = opt->code[dest].offset - jump->offset;
+            if (distance > limit || -distance > limit) break;
+            target = dest;
+        }
+        if (target != jump->target) {
+            jump->target = target;
+            opt->changed = true;
+        }
+        /* A jump to the instruction right after it does nothing. Removing
+           OP_JUMP_IF_FALSE is fine too: the condition stays pushed either
+           way. Fused conditional jumps also pop, so they must stay. */
+        bool plain = jump->op == OP_JUMP || jump->op == OP_JUMP_IF_FALSE ||
+                     jump->op == OP_JUMP_LONG || jump->op == OP_JUMP_IF_FALSE_LONG;
+        if (plain && nextLive(opt, i) == jump->target) {
+            removeInstr(opt, i);
+        }
+    }
+}
+
+static void removeUnreachable(Optimizer* opt) {
+    bool* reached = ALLOCATE(bool, opt->count);
+    int* worklist = ALLOCATE(int, opt->count);
+    memset(reached, 0, sizeof(bool) * opt->count);
+    int pending = 0;
+    worklist[pending++] = 0;
+    reached[0] = true;
+    while (pending > 0) {
+        int i = worklist[--pending];
+        Instr* instr = &opt->code[i];
+        int successors[2];
+        int count = 0;
+        if (isJump(instr->op)) successors[count++] = instr->target;
+        if (!isTerminator(instr->op) && i + 1 < opt->count) successors[count++] = i + 1;
+        for (int s = 0; s < count; s++) {
+            if (reached[successors[s]]) continue;
+            reached[successors[s]] = true;
+            worklist[pending++] = successors[s];
+        }
+    }
+    for (int i = 0; i < opt->count; i++) {
+        if (!reached[i]) removeInstr(opt, i);
+    }
+    FREE_ARRAY(int, worklist, opt->count);
+    FREE_ARRAY(bool, reached, opt->count);
+}
+
+/* Index of the previous live instruction before `index`, or -1. */
+static int prevLive(Optimizer* opt, int index) {
+    for (int i = index - 1; i >= 0; i--) {
+        if (!opt->code[i].removed) return i;
+    }
+    return -1;
+}
+
+/* The shape every if/while condition compiles to:
+       OP_JUMP_IF_FALSE else; OP_POP; ...; <jump or return>; else: OP_POP
+   When the jump at `index` is the only way into that second OP_POP, both
+   pops can be folded into a single popping branch. Returns the index of
+   the target's OP_POP, or -1. */
+static int conditionPopTarget(Optimizer* opt, int index) {
+    Instr* jump = &opt->code[index];
+    int next = nextLive(opt, index);
+    if (jump->op != OP_JUMP_IF_FALSE || next == -1) return -1;
+    if (opt->code[next].op != OP_POP || opt->refs[next] > 0) return -1;
+    int target = jump->target;
+    if (opt->code[target].removed || opt->code[target].op != OP_POP) return -1;
+    if (opt->refs[target] != 1) return -1;
+    int before = prevLive(opt, target);
+    if (before == -1 || !isTerminator(opt->code[before].op)) return -1;
+    return target;
+}
+
+/* Matches ops[0..count) against the live instructions starting at
+   `index`; only the first may be a jump target. Fills `at` with their
+   indexes. */
+static bool matchSequence(Optimizer* opt, int index, const uint8_t* ops,
+                          int count, int* at) {
+    int i = index;
+    for (int n = 0; n < count; n++) {
+        if (i == -1 || opt->code[i].op != ops[n]) return false;
+        if (n > 0 && opt->refs[i] > 0) return false;
+        at[n] = i;
+        i = nextLive(opt, i);
+    }
+    return true;
+}
+
+static void fuseIncrements(Optimizer* opt, int i) {
+    static const uint8_t globalOps[] = {
+        OP_GET_GLOBAL_SLOT, OP_CONSTANT, OP_ADD, OP_SET_GLOBAL_SLOT, OP_POP
+    };
+    static const uint8_t localOps[] = {
+        OP_GET_LOCAL, OP_CONSTANT, OP_ADD, OP_SET_LOCAL, OP_POP
+    };
+    int at[5];
+    bool global = matchSequence(opt, i, globalOps, 5, at);
+    if (!global && !matchSequence(opt, i, localOps, 5, at)) return;
+    Instr* get = &opt->code[at[0]];
+    if (get->operands[0] != opt->code[at[3]].operands[0]) return;
+    /* `s = s + "x"` is a concatenation: leave it to OP_ADD. */
+    int step = opt->code[at[1]].operands[0];
+    if (!IS_NUMBER(opt->chunk->constants.values[step])) return;
+    get->op = global ? OP_INCREMENT_GLOBAL : OP_INCREMENT_LOCAL;
+    get->operands[1] = opt->code[at[1]].operands[0];
+    for (int n = 1; n < 5; n++) removeInstr(opt, at[n]);
+}
+
+static void fuseCompareBranch(Optimizer* opt, int i) {
+    int at[3];
+    static const uint8_t lessOps[] = { OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE };
+    static const uint8_t greaterOps[] = { OP_CONSTANT, OP_GREATER, OP_JUMP_IF_FALSE };
+    bool less = matchSequence(opt, i, lessOps, 3, at);
+    if (!less && !matchSequence(opt, i, greaterOps, 3, at)) return;
+    int elsePop = conditionPopTarget(opt, at[2]);
+    if (elsePop == -1) return;
+    Instr* fused = &opt->code[at[0]];
+    fused->op = less ? OP_JUMP_IF_NOT_LESS_CONST : OP_JUMP_IF_NOT_GREATER_CONST;
+    fused->target = elsePop;  /* lands just past it once it is removed */
+    removeInstr(opt, at[1]);
+    removeInstr(opt, at[2]);
+    removeInstr(opt, nextLive(opt, at[2]));
+    removeInstr(opt, elsePop);
+}
+
+static void fusePops(Optimizer* opt, int i) {
+    Instr* instr = &opt->code[i];
+    int elsePop = conditionPopTarget(opt, i);
+    if (elsePop != -1) {
+        instr->op = OP_POP_JUMP_IF_FALSE;
+        removeInstr(opt, nextLive(opt, i));
+        removeInstr(opt, elsePop);
+        return;
+    }
+    int next = nextLive(opt, i);
+    if (next == -1 || opt->code[next].op != OP_POP || opt->refs[next] > 0) return;
+    if (instr->op == OP_SET_GLOBAL_SLOT) {
+        instr->op = OP_SET_GLOBAL_POP;
+        removeInstr(opt, next);
+    } else if (instr->op == OP_SET_LOCAL) {
+        instr->op = OP_SET_LOCAL_POP;
+        removeInstr(opt, next);
+    }
+}
+
+static void fuseSuperinstructions(Optimizer* opt) {
+    countRefs(opt);
+    for (int i = 0; i < opt->count; i++) {
+        if (!opt->code[i].removed) fuseIncrements(opt, i);
+    }
+    for (int i = 0; i < opt->count; i++) {
+        if (!opt->code[i].removed) fuseCompareBranch(opt, i);
+    }
+    for (int i = 0; i < opt->count; i++) {
+        if (!opt->code[i].removed) fusePops(opt, i);
+    }
+    compact(opt);
+}
+
+static void writeOperand(Chunk* chunk, int operand, int bytes, int line) {
+    for (int byte = bytes - 1; byte >= 0; byte--) {
+        writeChunk(chunk, (operand >> (8 * byte)) & 0xff, line);
+    }
+}
+
+static void encode(Optimizer* opt) {
+    Chunk* chunk = opt->chunk;
+    int* offsets = ALLOCATE(int, opt->count);
+    int offset = 0;
+    for (int i = 0; i < opt->count; i++) {
+        offsets[i] = offset;
+        offset += instrLength(opt->code[i].op);
+    }
+    /* The new code is never longer, so it can be written in place. */
+    chunk->count = 0;
+    chunk->lineCount = 0;
+    for (int i = 0; i < opt->count; i++) {
+        Instr* instr = &opt->code[i];
+        uint8_t op = instr->op;
+        OpFormat format = formatOf(op);
+        int end = offsets[i] + instrLength(op);
+        int jump = 0;
+        if (format.jumpWidth > 0) {
+            int dest = offsets[instr->target];
+            if (op == OP_JUMP || op == OP_LOOP) op = dest >= end ? OP_JUMP : OP_LOOP;
+            if (op == OP_JUMP_LONG || op == OP_LOOP_LONG) {
+                op = dest >= end ? OP_JUMP_LONG : OP_LOOP_LONG;
+            }
+            jump = op == OP_LOOP || op == OP_LOOP_LONG ? end - dest : dest - end;
+        }
+        writeChunk(chunk, op, instr->line);
+        for (int n = 0; n < 2; n++) {
+            writeOperand(chunk, instr->operands[n], format.widths[n], instr->line);
+        }
+        writeOperand(chunk, jump, format.jumpWidth, instr->line);
+    }
+    FREE_ARRAY(int, offsets, opt->count);
+}
+
+static void runToFixedPoint(Optimizer* opt) {
+    do {
+        opt->changed = false;
+        countRefs(opt);
+        peephole(opt);
+        compact(opt);
+        countRefs(opt);
+        threadJumps(opt);
+        compact(opt);
+        removeUnreachable(opt);
+        compact(opt);
+    } while (opt->changed);
+}
+
+void optimizeChunk(Chunk* chunk) {
+    Optimizer opt;
+    opt.chunk = chunk;
+    initArena(&opt.arena);
+    decode(&opt);
+    runToFixedPoint(&opt);
+    fuseSuperinstructions(&opt);
+    /* Fusing can leave a jump aimed at the very next instruction. */
+    runToFixedPoint(&opt);
+    encode(&opt);
+    freeArena(&opt.arena);
+}
@@ -0,0 +1,12 @@
+/**
+ * optimizer.h - Peephole optimizer for compiled chunks.
+ * Runs between compile() and run() when clox is started with -O.
+ */
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+void optimizeChunk(Chunk* chunk);
+
+#endif
@@ -0,0 +1,141 @@
+/**
+ * table.c - Open-addressing hash table implementation.
+ *
+ * The table grows by doubling once it is 75% full, so lookups stay O(1)
+ * no matter how many keys are stored. Deleted entries leave tombstones so
+ * that probe sequences through them keep working.
+ */
+#include "table.h"
+#include "memory.h"
+#include "object.h"
+#include <string.h>
+
+#define TABLE_MAX_LOAD 0.75
+
+void initTable(Table* table) {
+    table->count = 0;
+    table->capacity = 0;
+    table->entries = NULL;
+}
+
+void freeTable(Table* table) {
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    initTable(table);
+}
+
+static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
+    uint32_t index = key->hash & (capacity - 1);
+    Entry* tombstone = NULL;
+    for (;;) {
+        Entry* entry = &entries[index];
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) {
+                /* Empty slot: reuse an earlier tombstone if we passed one. */
+                return tombstone != NULL ? tombstone : entry;
+            }
+            if (tombstone == NULL) tombstone = entry;
+        } else if (entry->key == key) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void adjustCapacity(Table* table, int capacity) {
+    Entry* entries = ALLOCATE(Entry, capacity);
+    for (int i = 0; i < capacity; i++) {
+        entries[i].key = NULL;
+        entries[i].value = NIL_VAL;
+    }
+    /* Re-insert live entries only; tombstones are dropped. */
+    table->count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        Entry* dest = findEntry(entries, capacity, entry->key);
+        dest->key = entry->key;
+        dest->value = entry->value;
+        table->count++;
+    }
+    FREE_ARRAY(Entry, table->entries, table->capacity);
+    table->entries = entries;
+    table->capacity = capacity;
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+    if (table->count == 0) return false;
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+    *value = entry->value;
+    return true;
+}
+
+static int liveEntries(Table* table) {
+    int live = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) live++;
+    }
+    return live;
+}
+
+/* Returns true if the key was not already present. */
+bool tableSet(Table* table, ObjString* key, Value value) {
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        /* Tombstones count toward the load. When they are most of it, as
+           in the intern set once minor GCs drop dead young strings,
+           clearing them is enough and the table need not grow. */
+        int capacity = table->capacity < 8 ? 8 : table->capacity * 2;
+        if (liveEntries(table) < table->capacity / 2) capacity = table->capacity;
+        adjustCapacity(table, capacity);
+    }
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    bool isNewKey = entry->key == NULL;
+    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    entry->key = key;
+    entry->value = value;
+    return isNewKey;
+}
+
+bool tableDelete(Table* table, ObjString* key) {
+    if (table->count == 0) return false;
+    Entry* entry = findEntry(table->entries, table->capacity, key);
+    if (entry->key == NULL) return false;
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+/* Content lookup used by the intern set: the only place that compares
+   string bytes instead of pointers. */
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
+    if (table->count == 0) return NULL;
+    uint32_t index = hash & (table->capacity - 1);
+    for (;;) {
+        Entry* entry = &table->entries[index];
+        if (entry->key == NULL) {
+            if (IS_NIL(entry->value)) return NULL;
+        } else if (entry->key->length == length &&
+                   entry->key->hash == hash &&
+                   memcmp(entry->key->chars, chars, length) == 0) {
+            return entry->key;
+        }
+        index = (index + 1) & (table->capacity - 1);
+    }
+}
+
+void markTable(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        markObject((Obj*)entry->key);
+        markValue(entry->value);
+    }
+}
+
+void tableRemoveWhite(Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key != NULL && !entry->key->obj.isMarked) {
+            tableDelete(table, entry->key);
+        }
+    }
+}
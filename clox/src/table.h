@@ -0,0 +1,35 @@
+/**
+ * table.h - Hash table keyed by interned strings.
+ *
+ * Open addressing with linear probing. Keys are ObjString pointers; since
+ * every string is interned, key comparison is a pointer compare. Used for
+ * the string intern set and for global variables.
+ */
+#ifndef clox_table_h
+#define clox_table_h
+
+#include "common.h"
+#include "value.h"
+
+typedef struct {
+    ObjString* key;    /* NULL for empty slots and tombstones */
+    Value value;       /* tombstone: key NULL, value true */
+} Entry;
+
+typedef struct {
+    int count;         /* live entries plus tombstones */
+    int capacity;
+    Entry* entries;
+} Table;
+
+void initTable(Table* table);
+void freeTable(Table* table);
+bool tableGet(Table* table, ObjString* key, Value* value);
+bool tableSet(Table* table, ObjString* key, Value value);
+bool tableDelete(Table* table, ObjString* key);
+ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
+void markTable(Table* table);
+/* Deletes entries whose key the collector left unmarked. */
+void tableRemoveWhite(Table* table);
+
+#endif
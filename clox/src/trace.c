@@ -0,0 +1,768 @@
+/**
+ * trace.c - Trace recording and optimization for the tracing JIT.
+ *
+ * While recording, an abstract stack and a global map mirror run()'s
+ * state: each entry is the IR value now held there, or NO_REF while the
+ * slot still holds whatever it held when the iteration began. The first
+ * read of such a slot becomes a typed load. Writes only update the maps;
+ * the values reach memory through snapshots, at an exit or at the end of
+ * the iteration.
+ *
+ * Optimizations:
+ * - constant propagation and folding while recording, so guards on
+ *   constant conditions are never emitted
+ * - guard elimination: a number is always truthy and needs no branch
+ *   guard; a load's type guard moves to trace entry when the trace
+ *   itself keeps the slot at that type, and a slot is loaded and
+ *   checked at most once per iteration
+ * - dead code elimination of values nothing observes
+ * - linear-scan register allocation (traceAllocateRegisters)
+ */
+#include "trace.h"
+#include "memory.h"
+#include <stdio.h>
+#include <string.h>
+
+#define HOT_LOOP 50        /* back-edges before a loop is recorded */
+#define MAX_ATTEMPTS 3     /* failed recordings before giving up on a loop */
+#define MAX_TRACE_IR 1000
+#define NO_REF -1
+
+typedef struct {
+    Chunk* chunk;
+    int* counters;         /* per header offset; -1 once given up */
+    uint8_t* attempts;
+    Trace** traces;        /* per header offset */
+    /* Recording state */
+    Trace* recording;
+    int stackCount;        /* vm.stackCapacity when recording began */
+    int* stackRefs;
+    bool* stackDirty;
+    int depth;
+    int* globalRefs;
+    bool* globalDirty;
+    int globalCount;
+} Tracer;
+
+static Tracer tracer;
+
+#define APPEND(array, count, capacity, item) \
+    do { \
+        if ((capacity) < (count) + 1) { \
+            int oldCapacity = (capacity); \
+            (capacity) = GROW_CAPACITY(oldCapacity); \
+            (array) = reallocate((array), sizeof(*(array)) * oldCapacity, \
+                                 sizeof(*(array)) * (capacity)); \
+        } \
+        (array)[(count)++] = (item); \
+    } while (0)
+
+void traceInit(Chunk* chunk) {
+    tracer.chunk = chunk;
+    tracer.counters = ALLOCATE(int, chunk->count);
+    tracer.attempts = ALLOCATE(uint8_t, chunk->count);
+    tracer.traces = ALLOCATE(Trace*, chunk->count);
+    memset(tracer.counters, 0, sizeof(int) * chunk->count);
+    memset(tracer.attempts, 0, sizeof(uint8_t) * chunk->count);
+    for (int i = 0; i < chunk->count; i++) tracer.traces[i] = NULL;
+    tracer.recording = NULL;
+    tracer.stackRefs = NULL;
+    tracer.stackDirty = NULL;
+    tracer.globalRefs = NULL;
+    tracer.globalDirty = NULL;
+}
+
+static void freeTrace(Trace* trace) {
+    if (trace->native != NULL) jitFree(trace->native);
+    FREE_ARRAY(IrInstr, trace->ir, trace->capacity);
+    FREE_ARRAY(Snapshot, trace->snapshots, trace->snapshotCapacity);
+    FREE_ARRAY(SnapshotEntry, trace->entries, trace->entryCapacity);
+    FREE(Trace, trace);
+}
+
+static void freeRecordingState(void) {
+    if (tracer.stackRefs != NULL) {
+        FREE_ARRAY(int, tracer.stackRefs, tracer.stackCount);
+        FREE_ARRAY(bool, tracer.stackDirty, tracer.stackCount);
+        FREE_ARRAY(int, tracer.globalRefs, tracer.globalCount + 1);
+        FREE_ARRAY(bool, tracer.globalDirty, tracer.globalCount + 1);
+    }
+    tracer.stackRefs = NULL;
+    tracer.stackDirty = NULL;
+    tracer.globalRefs = NULL;
+    tracer.globalDirty = NULL;
+}
+
+void traceFree(void) {
+    if (tracer.chunk == NULL) return;
+    if (tracer.recording != NULL) freeTrace(tracer.recording);
+    freeRecordingState();
+    for (int i = 0; i < tracer.chunk->count; i++) {
+        if (tracer.traces[i] != NULL) freeTrace(tracer.traces[i]);
+    }
+    FREE_ARRAY(int, tracer.counters, tracer.chunk->count);
+    FREE_ARRAY(uint8_t, tracer.attempts, tracer.chunk->count);
+    FREE_ARRAY(Trace*, tracer.traces, tracer.chunk->count);
+    tracer.chunk = NULL;
+}
+
+Trace* traceAt(uint8_t* header) {
+    return tracer.traces[header - tracer.chunk->code];
+}
+
+/* --- Building IR -------------------------------------------------------- */
+
+static bool typeOf(Value value, IrType* type) {
+    if (IS_NUMBER(value)) {
+        *type = TYPE_NUMBER;
+    } else if (IS_BOOL(value)) {
+        *type = TYPE_BOOL;
+    } else if (IS_NIL(value)) {
+        *type = TYPE_NIL;
+    } else {
+        return false;  /* strings and undefined globals are not traced */
+    }
+    return true;
+}
+
+static int emit(IrOp op, IrType type, int a, int b) {
+    Trace* trace = tracer.recording;
+    IrInstr instr;
+    memset(&instr, 0, sizeof(instr));
+    instr.op = op;
+    instr.type = type;
+    instr.a = a;
+    instr.b = b;
+    instr.snapshot = -1;
+    instr.reg = -1;
+    instr.spill = -1;
+    APPEND(trace->ir, trace->count, trace->capacity, instr);
+    return trace->count - 1;
+}
+
+static IrInstr* ir(int ref) {
+    return &tracer.recording->ir[ref];
+}
+
+static int constant(Value value) {
+    IrType type = TYPE_NIL;
+    typeOf(value, &type);
+    int ref = emit(IR_CONST, type, NO_REF, NO_REF);
+    ir(ref)->value = value;
+    return ref;
+}
+
+static bool isConstant(int ref) {
+    return ir(ref)->op == IR_CONST;
+}
+
+/* Records the state run() must see to resume at `offset`. */
+static int takeSnapshot(int offset) {
+    Trace* trace = tracer.recording;
+    Snapshot snapshot;
+    snapshot.offset = offset;
+    snapshot.depth = tracer.depth;
+    snapshot.start = trace->entryCount;
+    for (int i = 0; i < tracer.depth; i++) {
+        if (i < trace->entryDepth && !tracer.stackDirty[i]) continue;
+        SnapshotEntry entry = {i, false, tracer.stackRefs[i]};
+        APPEND(trace->entries, trace->entryCount, trace->entryCapacity, entry);
+    }
+    for (int i = 0; i < tracer.globalCount; i++) {
+        if (!tracer.globalDirty[i]) continue;
+        SnapshotEntry entry = {i, true, tracer.globalRefs[i]};
+        APPEND(trace->entries, trace->entryCount, trace->entryCapacity, entry);
+    }
+    snapshot.count = trace->entryCount - snapshot.start;
+    APPEND(trace->snapshots, trace->snapshotCount, trace->snapshotCapacity, snapshot);
+    return trace->snapshotCount - 1;
+}
+
+/* A typed load of a slot not yet touched this iteration. The type check
+   exits to `offset`, i.e. before the instruction doing the load. */
+static int load(IrOp op, int slot, Value observed, int offset) {
+    IrType type;
+    if (!typeOf(observed, &type)) return NO_REF;
+    int snapshot = takeSnapshot(offset);
+    int ref = emit(op, type, NO_REF, NO_REF);
+    ir(ref)->slot = slot;
+    ir(ref)->guarded = true;
+    ir(ref)->snapshot = snapshot;
+    if (type == TYPE_NIL) {
+        /* Uses see the constant; the load stays for its guard. */
+        ir(ref)->keep = true;
+        return constant(NIL_VAL);
+    }
+    return ref;
+}
+
+static int getLocal(int slot, int offset) {
+    if (tracer.stackRefs[slot] == NO_REF) {
+        tracer.stackRefs[slot] = load(IR_LOAD_LOCAL, slot, vm.stack[slot], offset);
+    }
+    return tracer.stackRefs[slot];
+}
+
+static void setLocal(int slot, int ref) {
+    tracer.stackRefs[slot] = ref;
+    tracer.stackDirty[slot] = true;
+}
+
+static int getGlobal(int slot, int offset) {
+    if (tracer.globalRefs[slot] == NO_REF) {
+        tracer.globalRefs[slot] = load(IR_LOAD_GLOBAL, slot,
+                                       vm.globalValues.values[slot], offset);
+    }
+    return tracer.globalRefs[slot];
+}
+
+/* OP_SET_GLOBAL_SLOT fails on an undefined global, so the first store to
+   a slot loads it for the guard. */
+static bool setGlobal(int slot, int ref, int offset) {
+    if (getGlobal(slot, offset) == NO_REF) return false;
+    for (int i = tracer.recording->count - 1; i >= 0; i--) {
+        IrInstr* instr = ir(i);
+        if (instr->op == IR_LOAD_GLOBAL && instr->slot == slot) {
+            instr->keep = true;
+            break;
+        }
+    }
+    tracer.globalRefs[slot] = ref;
+    tracer.globalDirty[slot] = true;
+    return true;
+}
+
+static void push(int ref) {
+    tracer.stackRefs[tracer.depth++] = ref;
+}
+
+static int pop(void) {
+    int ref = tracer.stackRefs[--tracer.depth];
+    tracer.stackRefs[tracer.depth] = NO_REF;
+    return ref;
+}
+
+static int peek(int distance) {
+    return tracer.stackRefs[tracer.depth - 1 - distance];
+}
+
+/* Arithmetic on two numbers, folded when both are constants. */
+static int arithmetic(IrOp op, int a, int b) {
+    if (ir(a)->type != TYPE_NUMBER || ir(b)->type != TYPE_NUMBER) return NO_REF;
+    if (isConstant(a) && isConstant(b)) {
+        double x = AS_NUMBER(ir(a)->value);
+        double y = AS_NUMBER(ir(b)->value);
+        switch (op) {
+            case IR_ADD: return constant(NUMBER_VAL(x + y));
+            case IR_SUB: return constant(NUMBER_VAL(x - y));
+            case IR_MUL: return constant(NUMBER_VAL(x * y));
+            case IR_DIV: return constant(NUMBER_VAL(x / y));
+            default: break;
+        }
+    }
+    return emit(op, TYPE_NUMBER, a, b);
+}
+
+static int comparison(IrOp op, int a, int b) {
+    if (ir(a)->type != TYPE_NUMBER || ir(b)->type != TYPE_NUMBER) return NO_REF;
+    if (isConstant(a) && isConstant(b)) {
+        double x = AS_NUMBER(ir(a)->value);
+        double y = AS_NUMBER(ir(b)->value);
+        switch (op) {
+            case IR_LT: return constant(BOOL_VAL(x < y));
+            case IR_GT: return constant(BOOL_VAL(x > y));
+            case IR_LE: return constant(BOOL_VAL(!(x > y)));
+            case IR_GE: return constant(BOOL_VAL(!(x < y)));
+            default: break;
+        }
+    }
+    return emit(op, TYPE_BOOL, a, b);
+}
+
+static int equality(int a, int b, bool negate) {
+    IrInstr* x = ir(a);
+    IrInstr* y = ir(b);
+    if (isConstant(a) && isConstant(b)) {
+        return constant(BOOL_VAL(valuesEqual(x->value, y->value) != negate));
+    }
+    if (x->type != y->type) return constant(BOOL_VAL(negate));
+    if (x->type == TYPE_NIL) return constant(BOOL_VAL(!negate));
+    if (x->type != TYPE_NUMBER) return NO_REF;
+    return emit(negate ? IR_NE : IR_EQ, TYPE_BOOL, a, b);
+}
+
+static int logicalNot(int a) {
+    IrInstr* x = ir(a);
+    if (x->type == TYPE_NUMBER) return constant(BOOL_VAL(false));
+    if (x->type == TYPE_NIL) return constant(BOOL_VAL(true));
+    if (isConstant(a)) return constant(BOOL_VAL(!AS_BOOL(x->value)));
+    return emit(IR_NOT, TYPE_BOOL, a, NO_REF);
+}
+
+static int negate(int a) {
+    if (ir(a)->type != TYPE_NUMBER) return NO_REF;
+    if (isConstant(a)) return constant(NUMBER_VAL(-AS_NUMBER(ir(a)->value)));
+    return emit(IR_NEG, TYPE_NUMBER, a, NO_REF);
+}
+
+/* Records that the interpreter found `cond` to be `truthy`. If that can
+   change, a guard exits to `exitOffset` (the other branch) with the
+   opposite outcome; `onStack` says whether cond is still on the stack
+   there (OP_JUMP_IF_FALSE) or was popped. */
+static void guardCondition(int cond, bool truthy, int exitOffset, bool onStack) {
+    IrInstr* instr = ir(cond);
+    if (instr->type != TYPE_BOOL || isConstant(cond)) return;
+    if (onStack) tracer.stackRefs[tracer.depth - 1] = constant(BOOL_VAL(!truthy));
+    int snapshot = takeSnapshot(exitOffset);
+    if (onStack) tracer.stackRefs[tracer.depth - 1] = cond;
+    int guard = emit(truthy ? IR_GUARD_TRUE : IR_GUARD_FALSE, TYPE_NIL, cond, NO_REF);
+    ir(guard)->snapshot = snapshot;
+}
+
+static int divide(int a, int b, int offset) {
+    if (ir(a)->type != TYPE_NUMBER || ir(b)->type != TYPE_NUMBER) return NO_REF;
+    if (isConstant(b)) {
+        if (AS_NUMBER(ir(b)->value) == 0) return NO_REF;  /* run() reports it */
+    } else {
+        /* Exit before the OP_DIVIDE, with both operands still pushed. */
+        push(a);
+        push(b);
+        int snapshot = takeSnapshot(offset);
+        pop();
+        pop();
+        int guard = emit(IR_GUARD_NONZERO, TYPE_NIL, b, NO_REF);
+        ir(guard)->snapshot = snapshot;
+    }
+    return arithmetic(IR_DIV, a, b);
+}
+
+/* --- Recording ---------------------------------------------------------- */
+
+bool traceHotLoop(uint8_t* header, Value* sp) {
+    int offset = (int)(header - tracer.chunk->code);
+    if (tracer.recording != NULL || tracer.counters[offset] < 0) return false;
+    if (++tracer.counters[offset] < HOT_LOOP) return false;
+    tracer.counters[offset] = 0;
+
+    Trace* trace = ALLOCATE(Trace, 1);
+    memset(trace, 0, sizeof(Trace));
+    trace->header = offset;
+    trace->entryDepth = (int)(sp - vm.stack);
+    tracer.recording = trace;
+    tracer.depth = trace->entryDepth;
+    tracer.stackCount = vm.stackCapacity;
+    tracer.stackRefs = ALLOCATE(int, tracer.stackCount);
+    tracer.stackDirty = ALLOCATE(bool, tracer.stackCount);
+    memset(tracer.stackDirty, 0, sizeof(bool) * tracer.stackCount);
+    for (int i = 0; i < tracer.stackCount; i++) tracer.stackRefs[i] = NO_REF;
+    tracer.globalCount = vm.globalValues.count;
+    tracer.globalRefs = ALLOCATE(int, tracer.globalCount + 1);
+    tracer.globalDirty = ALLOCATE(bool, tracer.globalCount + 1);
+    memset(tracer.globalDirty, 0, sizeof(bool) * (tracer.globalCount + 1));
+    for (int i = 0; i < tracer.globalCount; i++) tracer.globalRefs[i] = NO_REF;
+    takeSnapshot(offset);  /* ENTRY_SNAPSHOT */
+    return true;
+}
+
+static bool abortRecording(void) {
+    Trace* trace = tracer.recording;
+    if (++tracer.attempts[trace->header] >= MAX_ATTEMPTS) {
+        tracer.counters[trace->header] = -1;
+    }
+    freeTrace(trace);
+    tracer.recording = NULL;
+    freeRecordingState();
+    return false;
+}
+
+/* Decides where each load's type guard runs. A slot the trace leaves at
+   the type it was loaded as keeps that type in every later iteration,
+   so checking it once on entry is enough. */
+static void hoistGuards(Trace* trace) {
+    Snapshot* loop = &trace->snapshots[trace->loopSnapshot];
+    for (int i = 0; i < trace->count; i++) {
+        IrInstr* instr = &trace->ir[i];
+        if (instr->op != IR_LOAD_LOCAL && instr->op != IR_LOAD_GLOBAL) continue;
+        bool global = instr->op == IR_LOAD_GLOBAL;
+        bool invariant = true;
+        for (int e = loop->start; e < loop->start + loop->count; e++) {
+            SnapshotEntry* entry = &trace->entries[e];
+            if (entry->global != global || entry->slot != instr->slot) continue;
+            invariant = trace->ir[entry->ref].type == instr->type;
+        }
+        instr->hoisted = invariant;
+        instr->guarded = !invariant;
+    }
+}
+
+static bool isGuard(IrInstr* instr) {
+    return instr->op == IR_GUARD_TRUE || instr->op == IR_GUARD_FALSE ||
+           instr->op == IR_GUARD_NONZERO || instr->guarded;
+}
+
+static void markSnapshot(Trace* trace, int index, int* uses) {
+    Snapshot* snapshot = &trace->snapshots[index];
+    for (int e = snapshot->start; e < snapshot->start + snapshot->count; e++) {
+        int ref = trace->entries[e].ref;
+        trace->ir[ref].live = true;
+        uses[ref]++;
+    }
+}
+
+/* Keeps what an exit, a print or the next iteration can observe, and
+   marks comparisons whose only use is the guard right after them. */
+static void eliminateDeadCode(Trace* trace) {
+    int* uses = ALLOCATE(int, trace->count + 1);
+    memset(uses, 0, sizeof(int) * (trace->count + 1));
+    markSnapshot(trace, trace->loopSnapshot, uses);
+    for (int i = trace->count - 1; i >= 0; i--) {
+        IrInstr* instr = &trace->ir[i];
+        if (isGuard(instr) || instr->op == IR_PRINT || instr->keep) instr->live = true;
+        if (!instr->live) continue;
+        if (instr->a != NO_REF) {
+            trace->ir[instr->a].live = true;
+            uses[instr->a]++;
+        }
+        if (instr->b != NO_REF) {
+            trace->ir[instr->b].live = true;
+            uses[instr->b]++;
+        }
+        if (instr->guarded || instr->op == IR_GUARD_TRUE ||
+            instr->op == IR_GUARD_FALSE || instr->op == IR_GUARD_NONZERO) {
+            markSnapshot(trace, instr->snapshot, uses);
+        }
+    }
+    for (int i = 0; i < trace->count; i++) {
+        IrInstr* instr = &trace->ir[i];
+        if (instr->op < IR_LT || instr->op > IR_GE || uses[i] != 1) continue;
+        /* Only constants (which emit no code) may sit in between. */
+        int next = i + 1;
+        while (next < trace->count && trace->ir[next].op == IR_CONST) next++;
+        if (next == trace->count) continue;
+        IrInstr* guard = &trace->ir[next];
+        if ((guard->op == IR_GUARD_TRUE || guard->op == IR_GUARD_FALSE) && guard->a == i) {
+            instr->fused = true;
+        }
+    }
+    FREE_ARRAY(int, uses, trace->count + 1);
+}
+
+#if DEBUG_PRINT_TRACES
+static void printTrace(Trace* trace) {
+    static const char* names[] = {
+        "CONST", "LOAD_LOCAL", "LOAD_GLOBAL", "ADD", "SUB", "MUL", "DIV",
+        "NEG", "LT", "GT", "LE", "GE", "EQ", "NE", "NOT", "GUARD_TRUE",
+        "GUARD_FALSE", "GUARD_NONZERO", "PRINT",
+    };
+    printf("== trace at %04d ==\n", trace->header);
+    for (int i = 0; i < trace->count; i++) {
+        IrInstr* instr = &trace->ir[i];
+        if (!instr->live) continue;
+        printf("%04d %-13s", i, names[instr->op]);
+        if (instr->op == IR_CONST) {
+            printValue(instr->value);
+        } else if (instr->op == IR_LOAD_LOCAL || instr->op == IR_LOAD_GLOBAL) {
+            printf("[%d]%s", instr->slot, instr->hoisted ? " hoisted" : "");
+        } else {
+            if (instr->a != NO_REF) printf("%04d", instr->a);
+            if (instr->b != NO_REF) printf(" %04d", instr->b);
+        }
+        if (instr->fused) printf(" fused");
+        if (instr->snapshot != -1 && (instr->guarded || instr->op >= IR_GUARD_TRUE)) {
+            printf(" -> #%d", instr->snapshot);
+        }
+        if (instr->reg != -1) printf(" xmm%d", instr->reg + 2);
+        if (instr->spill != -1) printf(" spill %d", instr->spill);
+        printf("\n");
+    }
+    for (int i = 0; i < trace->snapshotCount; i++) {
+        Snapshot* snapshot = &trace->snapshots[i];
+        printf("#%d @%04d depth %d:", i, snapshot->offset, snapshot->depth);
+        for (int e = snapshot->start; e < snapshot->start + snapshot->count; e++) {
+            SnapshotEntry* entry = &trace->entries[e];
+            printf(" %s%d=%04d", entry->global ? "g" : "s", entry->slot, entry->ref);
+        }
+        printf("\n");
+    }
+}
+#endif
+
+static bool finishRecording(void) {
+    Trace* trace = tracer.recording;
+    trace->loopSnapshot = takeSnapshot(trace->header);
+    hoistGuards(trace);
+    eliminateDeadCode(trace);
+    trace->native = jitCompileTrace(trace);
+    if (trace->native == NULL) return abortRecording();
+#if DEBUG_PRINT_TRACES
+    printTrace(trace);
+#endif
+    tracer.traces[trace->header] = trace;
+    tracer.recording = NULL;
+    freeRecordingState();
+    return false;
+}
+
+static int readShort(uint8_t* ip) {
+    return (ip[0] << 8) | ip[1];
+}
+
+static int readLong(uint8_t* ip) {
+    return (ip[0] << 16) | (ip[1] << 8) | ip[2];
+}
+
+#define CHECK(ref) do { if ((ref) == NO_REF) return abortRecording(); } while (0)
+
+bool traceRecord(uint8_t* ip, Value* sp) {
+    Trace* trace = tracer.recording;
+    Chunk* chunk = tracer.chunk;
+    Value* constants = chunk->constants.values;
+    int offset = (int)(ip - chunk->code);
+    if (trace->count > MAX_TRACE_IR) return abortRecording();
+
+    switch (*ip) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG: {
+            Value value = constants[*ip == OP_CONSTANT ? ip[1] : readLong(ip + 1)];
+            IrType type;
+            if (!typeOf(value, &type)) return abortRecording();
+            push(constant(value));
+            break;
+        }
+        case OP_NIL: push(constant(NIL_VAL)); break;
+        case OP_TRUE: push(constant(BOOL_VAL(true))); break;
+        case OP_FALSE: push(constant(BOOL_VAL(false))); break;
+        case OP_POP: pop(); break;
+        case OP_GET_LOCAL: {
+            int ref = getLocal(ip[1], offset);
+            CHECK(ref);
+            push(ref);
+            break;
+        }
+        case OP_SET_LOCAL: setLocal(ip[1], peek(0)); break;
+        case OP_SET_LOCAL_POP: setLocal(ip[1], pop()); break;
+        case OP_GET_GLOBAL_SLOT:
+        case OP_GET_GLOBAL_LONG: {
+            int slot = *ip == OP_GET_GLOBAL_SLOT ? readShort(ip + 1) : readLong(ip + 1);
+            int ref = getGlobal(slot, offset);
+            CHECK(ref);
+            push(ref);
+            break;
+        }
+        case OP_SET_GLOBAL_SLOT:
+        case OP_SET_GLOBAL_LONG: {
+            int slot = *ip == OP_SET_GLOBAL_SLOT ? readShort(ip + 1) : readLong(ip + 1);
+            if (!setGlobal(slot, peek(0), offset)) return abortRecording();
+            break;
+        }
+        case OP_SET_GLOBAL_POP:
+            if (!setGlobal(readShort(ip + 1), peek(0), offset)) return abortRecording();
+            pop();
+            break;
+        case OP_INCREMENT_LOCAL: {
+            int value = getLocal(ip[1], offset);
+            CHECK(value);
+            int sum = arithmetic(IR_ADD, value, constant(constants[ip[2]]));
+            CHECK(sum);
+            setLocal(ip[1], sum);
+            break;
+        }
+        case OP_INCREMENT_GLOBAL: {
+            int slot = readShort(ip + 1);
+            int value = getGlobal(slot, offset);
+            CHECK(value);
+            int sum = arithmetic(IR_ADD, value, constant(constants[ip[3]]));
+            CHECK(sum);
+            setGlobal(slot, sum, offset);
+            break;
+        }
+        case OP_EQUAL:
+        case OP_NOT_EQUAL: {
+            int b = pop();
+            int a = pop();
+            int result = equality(a, b, *ip == OP_NOT_EQUAL);
+            CHECK(result);
+            push(result);
+            break;
+        }
+        case OP_GREATER:
+        case OP_GREATER_NUM:
+        case OP_LESS:
+        case OP_LESS_NUM:
+        case OP_GREATER_EQUAL:
+        case OP_GREATER_EQUAL_NUM:
+        case OP_LESS_EQUAL:
+        case OP_LESS_EQUAL_NUM: {
+            IrOp op;
+            switch (*ip) {
+                case OP_GREATER: case OP_GREATER_NUM: op = IR_GT; break;
+                case OP_LESS: case OP_LESS_NUM: op = IR_LT; break;
+                case OP_GREATER_EQUAL: case OP_GREATER_EQUAL_NUM: op = IR_GE; break;
+                default: op = IR_LE; break;
+            }
+            int b = pop();
+            int a = pop();
+            int result = comparison(op, a, b);
+            CHECK(result);
+            push(result);
+            break;
+        }
+        case OP_ADD:
+        case OP_ADD_NUM:
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUM:
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUM: {
+            IrOp op = IR_MUL;
+            if (*ip == OP_ADD || *ip == OP_ADD_NUM) op = IR_ADD;
+            if (*ip == OP_SUBTRACT || *ip == OP_SUBTRACT_NUM) op = IR_SUB;
+            int b = pop();
+            int a = pop();
+            int result = arithmetic(op, a, b);
+            CHECK(result);
+            push(result);
+            break;
+        }
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUM: {
+            int b = pop();
+            int a = pop();
+            int result = divide(a, b, offset);
+            CHECK(result);
+            push(result);
+            break;
+        }
+        case OP_NOT: push(logicalNot(pop())); break;
+        case OP_NEGATE: {
+            int result = negate(pop());
+            CHECK(result);
+            push(result);
+            break;
+        }
+        case OP_PRINT:
+            emit(IR_PRINT, TYPE_NIL, pop(), NO_REF);
+            break;
+        case OP_JUMP:
+            break;
+        case OP_JUMP_IF_FALSE: {
+            bool truthy = !(IS_NIL(sp[-1]) || (IS_BOOL(sp[-1]) && !AS_BOOL(sp[-1])));
+            int target = offset + 3 + readShort(ip + 1);
+            guardCondition(peek(0), truthy, truthy ? target : offset + 3, true);
+            break;
+        }
+        case OP_POP_JUMP_IF_FALSE: {
+            bool truthy = !(IS_NIL(sp[-1]) || (IS_BOOL(sp[-1]) && !AS_BOOL(sp[-1])));
+            int target = offset + 3 + readShort(ip + 1);
+            guardCondition(pop(), truthy, truthy ? target : offset + 3, false);
+            break;
+        }
+        case OP_JUMP_IF_NOT_LESS_CONST:
+        case OP_JUMP_IF_NOT_GREATER_CONST: {
+            bool less = *ip == OP_JUMP_IF_NOT_LESS_CONST;
+            Value bound = constants[ip[1]];
+            if (!IS_NUMBER(sp[-1]) || !IS_NUMBER(bound)) return abortRecording();
+            double a = AS_NUMBER(sp[-1]);
+            double b = AS_NUMBER(bound);
+            bool holds = less ? a < b : a > b;
+            int target = offset + 4 + readShort(ip + 2);
+            int result = comparison(less ? IR_LT : IR_GT, pop(), constant(bound));
+            CHECK(result);
+            guardCondition(result, holds, holds ? target : offset + 4, false);
+            break;
+        }
+        case OP_LOOP: {
+            int target = offset + 3 - readShort(ip + 1);
+            if (target != trace->header || tracer.depth != trace->entryDepth) {
+                return abortRecording();
+            }
+            return finishRecording();
+        }
+        default:
+            /* OP_DEFINE_GLOBAL_*, OP_RETURN: not inside a loop body. The
+               _LONG jumps only appear in bodies far too long to trace. */
+            return abortRecording();
+    }
+    return true;
+}
+
+#undef CHECK
+
+uint8_t* traceRun(Trace* trace, Value* sp) {
+    vm.stackTop = sp;
+    uint8_t* header = tracer.chunk->code + trace->header;
+    if (sp - vm.stack != trace->entryDepth) return header;
+    gcBeforeCompiledCode();
+    Snapshot* exit = &trace->snapshots[jitRunTrace(trace->native)];
+    vm.stackTop = vm.stack + exit->depth;
+    return tracer.chunk->code + exit->offset;
+}
+
+/* --- Register allocation ------------------------------------------------ */
+
+static bool needsHome(IrInstr* instr) {
+    if (!instr->live || instr->fused) return false;
+    switch (instr->op) {
+        case IR_CONST:
+        case IR_GUARD_TRUE:
+        case IR_GUARD_FALSE:
+        case IR_GUARD_NONZERO:
+        case IR_PRINT:
+            return false;
+        default:
+            return instr->type != TYPE_NIL;
+    }
+}
+
+static void useAt(Trace* trace, int ref, int index) {
+    if (ref != NO_REF && trace->ir[ref].lastUse < index) trace->ir[ref].lastUse = index;
+}
+
+static void useSnapshotAt(Trace* trace, int snapshot, int index) {
+    Snapshot* s = &trace->snapshots[snapshot];
+    for (int e = s->start; e < s->start + s->count; e++) {
+        useAt(trace, trace->entries[e].ref, index);
+    }
+}
+
+/* Linear scan over the trace. Numbers get registers while any are free
+   and spill otherwise; other values are kept boxed in spill slots. A
+   value's register is reusable by the instruction that last uses it,
+   because code reads operands before writing the result. */
+void traceAllocateRegisters(Trace* trace, int registers) {
+    for (int i = 0; i < trace->count; i++) trace->ir[i].lastUse = i;
+    for (int i = 0; i < trace->count; i++) {
+        IrInstr* instr = &trace->ir[i];
+        if (!instr->live) continue;
+        useAt(trace, instr->a, i);
+        useAt(trace, instr->b, i);
+        if (instr->a != NO_REF && trace->ir[instr->a].fused) {
+            /* The comparison runs here, at its guard. */
+            useAt(trace, trace->ir[instr->a].a, i);
+            useAt(trace, trace->ir[instr->a].b, i);
+        }
+        if (isGuard(instr)) useSnapshotAt(trace, instr->snapshot, i);
+    }
+    useSnapshotAt(trace, trace->loopSnapshot, trace->count);
+
+    int* owner = ALLOCATE(int, registers);  /* ref in each register */
+    for (int r = 0; r < registers; r++) owner[r] = NO_REF;
+    trace->spillCount = 0;
+    for (int i = 0; i < trace->count; i++) {
+        IrInstr* instr = &trace->ir[i];
+        if (!needsHome(instr)) continue;
+        for (int r = 0; r < registers; r++) {
+            if (owner[r] != NO_REF && trace->ir[owner[r]].lastUse <= i) owner[r] = NO_REF;
+        }
+        if (instr->type == TYPE_NUMBER) {
+            for (int r = 0; r < registers; r++) {
+                if (owner[r] == NO_REF) {
+                    owner[r] = i;
+                    instr->reg = r;
+                    break;
+                }
+            }
+        }
+        if (instr->reg == -1) instr->spill = trace->spillCount++;
+    }
+    FREE_ARRAY(int, owner, registers);
+}
@@ -0,0 +1,117 @@
+/**
+ * trace.h - Tracing JIT: records hot loops as typed linear traces.
+ *
+ * With --trace-jit, run() counts taken OP_LOOP back-edges per loop
+ * header. Once a header is hot, the next iteration is recorded as it is
+ * interpreted: every instruction becomes typed IR specialized to the
+ * types it saw, with guards wherever the trace assumes something (a
+ * type, a branch direction, a non-zero divisor). The trace is optimized
+ * and handed to jit.c for native code; from then on, run() enters it at
+ * that OP_LOOP. A failing guard leaves the trace through its snapshot,
+ * which rebuilds the interpreter's stack and globals for the bytecode
+ * offset the snapshot names.
+ */
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "chunk.h"
+#include "jit.h"
+#include "vm.h"
+
+typedef enum {
+    IR_CONST,         /* value */
+    IR_LOAD_LOCAL,    /* slot; value on the stack at the start of an iteration */
+    IR_LOAD_GLOBAL,   /* slot; likewise for a global */
+    IR_ADD,           /* a + b, numbers */
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_NEG,           /* -a */
+    IR_LT,            /* a < b, numbers; bool result */
+    IR_GT,
+    IR_LE,            /* !(a > b), so true for NaN like OP_LESS_EQUAL */
+    IR_GE,            /* !(a < b) */
+    IR_EQ,            /* a == b, numbers */
+    IR_NE,
+    IR_NOT,           /* !a, bool */
+    IR_GUARD_TRUE,    /* exit unless bool a is true */
+    IR_GUARD_FALSE,   /* exit unless bool a is false */
+    IR_GUARD_NONZERO, /* exit if number a is 0 */
+    IR_PRINT,         /* print a */
+} IrOp;
+
+typedef enum {
+    TYPE_NUMBER,
+    TYPE_BOOL,
+    TYPE_NIL,
+} IrType;
+
+typedef struct {
+    uint8_t op;
+    uint8_t type;      /* IrType of the result */
+    bool live;
+    bool guarded;      /* loads: check the type in the loop body */
+    bool hoisted;      /* loads: check the type once, on trace entry */
+    bool keep;         /* loads: needed for their guard even if unused */
+    bool fused;        /* comparisons: folded into the guard after them */
+    int a;
+    int b;
+    int slot;
+    Value value;
+    int snapshot;      /* guards and guarded loads: where to exit to */
+    int lastUse;       /* set by traceAllocateRegisters */
+    int reg;           /* register index, or -1 */
+    int spill;         /* spill slot, or -1 */
+} IrInstr;
+
+/* One value to write back on exit: a stack slot or global slot gets the
+   (boxed) value of IR instruction `ref`. */
+typedef struct {
+    int slot;
+    bool global;
+    int ref;
+} SnapshotEntry;
+
+typedef struct {
+    int offset;        /* bytecode offset run() resumes at */
+    int depth;         /* stack depth there */
+    int start;         /* entries[start, start + count) */
+    int count;
+} Snapshot;
+
+typedef struct Trace {
+    int header;        /* bytecode offset of the loop header */
+    int entryDepth;    /* stack depth at the header */
+    IrInstr* ir;
+    int count;
+    int capacity;
+    Snapshot* snapshots;
+    int snapshotCount;
+    int snapshotCapacity;
+    SnapshotEntry* entries;
+    int entryCount;
+    int entryCapacity;
+    int loopSnapshot;  /* write-backs made before each next iteration */
+    int spillCount;
+    JitCode* native;
+} Trace;
+
+/* Snapshot 0 of every trace: the loop header, nothing changed. */
+#define ENTRY_SNAPSHOT 0
+
+void traceInit(Chunk* chunk);
+void traceFree(void);
+/* The compiled trace for the loop starting at `header`, or NULL. */
+Trace* traceAt(uint8_t* header);
+/* Counts a back-edge to `header`; returns true if recording started. */
+bool traceHotLoop(uint8_t* header, Value* sp);
+/* Records the instruction at `ip` before run() executes it. Returns false
+   once recording has stopped, either finished or given up. */
+bool traceRecord(uint8_t* ip, Value* sp);
+/* Runs `trace` from stack top `sp`; returns the ip to resume at and leaves
+   the stack top to resume with in vm.stackTop. */
+uint8_t* traceRun(Trace* trace, Value* sp);
+/* Assigns each IR value one of `registers` registers or a spill slot. */
+void traceAllocateRegisters(Trace* trace, int registers);
+
+#endif
@@ -2,9 +2,10 @@
  * value.c - Implementation of Value types.
  */
 #include "value.h"
+#include "memory.h"
 #include "object.h"
 #include <stdio.h>
-#include <stdlib.h>
+#include <string.h>
 
 void initValueArray(ValueArray* array) {
     array->values = NULL;
@@ -15,26 +16,84 @@ void initValueArray(ValueArray* array) {
 void writeValueArray(ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
-        array->capacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
-        array->values = realloc(array->values, sizeof(Value) * array->capacity);
+        array->capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
     }
     array->values[array->count] = value;
     array->count++;
 }
 
 void freeValueArray(ValueArray* array) {
-    free(array->values);
+    FREE_ARRAY(Value, array->values, array->capacity);
     initValueArray(array);
 }
 
+/* Ropes are printed leaf by leaf: no need to flatten them for that. */
+static void printString(Obj* string) {
+    if (string->type == OBJ_ROPE) {
+        ObjRope* rope = (ObjRope*)string;
+        if (rope->flat != NULL) {
+            printString((Obj*)rope->flat);
+        } else {
+            printString(rope->left);
+            printString(rope->right);
+        }
+        return;
+    }
+    fwrite(((ObjString*)string)->chars, 1, ((ObjString*)string)->length, stdout);
+}
+
+void printValue(Value value) {
+#if NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        printString(AS_OBJ(value));
+    }
+#else
+    switch (value.type) {
+        case VAL_BOOL:   printf(AS_BOOL(value) ? "true" : "false"); break;
+        case VAL_NIL:    printf("nil"); break;
+        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+        case VAL_OBJ:    printString(AS_OBJ(value)); break;
+        default:         break;
+    }
+#endif
+}
+
+/* Interned strings are the same object when they are equal; only a
+   string built at run time has to be compared by its characters. */
+static bool stringsEqual(ObjString* a, ObjString* b) {
+    if (a == b) return true;
+    if (a->interned && b->interned) return false;
+    return a->length == b->length &&
+           stringHash(a) == stringHash(b) &&
+           memcmp(a->chars, b->chars, a->length) == 0;
+}
 
 bool valuesEqual(Value a, Value b) {
+#if NAN_BOXING
+    /* Compare numbers as doubles so that NaN != NaN; strings by content;
+       everything else is equal exactly when the bits are. */
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+    if (IS_STRING(a) && IS_STRING(b)) return stringsEqual(AS_STRING(a), AS_STRING(b));
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
         case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
         case VAL_NIL:    return true;
         case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ:
+            if (IS_STRING(a) && IS_STRING(b)) {
+                return stringsEqual(AS_STRING(a), AS_STRING(b));
+            }
+            return AS_OBJ(a) == AS_OBJ(b);
         default:         return false;
     }
+#endif
 }
@@ -1,21 +1,76 @@
 /**
  * value.h - Runtime value types for the VM.
  * 
- * Lox values: numbers (double), booleans, nil, and strings (ObjString*).
- * We use a tagged union: a type tag + the actual value.
+ * Lox values: numbers (double), booleans, nil, and heap objects (Obj*).
+ *
+ * With NAN_BOXING, a Value is one 64-bit word: any double is stored as
+ * itself, and everything else hides in the payload of a quiet NaN
+ * (singletons as small tags, objects as a pointer with the sign bit set).
+ * Otherwise we use a tagged union: a type tag + the actual value.
+ * Either way, the rest of the VM only touches Values through the IS_*,
+ * AS_* and *_VAL macros below.
  */
 #ifndef clox_value_h
 #define clox_value_h
 
 #include "common.h"
+#include <string.h>
 
+typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#if NAN_BOXING
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL       1  // 001
+#define TAG_FALSE     2  // 010
+#define TAG_TRUE      3  // 011
+#define TAG_UNDEFINED 4  // 100: global slot declared but not yet defined
+
+typedef uint64_t Value;
+
+#define FALSE_VAL         ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL          ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNum(value)
+#define AS_OBJ(value)     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b)       ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(num)   numToValue(num)
+#define OBJ_VAL(obj)      (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+#define UNDEFINED_VAL     ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+/* memcpy is the portable type pun; compilers lower it to a register move. */
+static inline double valueToNum(Value value) {
+    double num;
+    memcpy(&num, &value, sizeof(Value));
+    return num;
+}
+
+static inline Value numToValue(double num) {
+    Value value;
+    memcpy(&value, &num, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
-    VAL_OBJ,  /* ObjString* for variable names in constant pool */
+    VAL_OBJ,  /* heap object; see object.h */
+    VAL_UNDEFINED,  /* internal: global slot declared but not yet defined */
 } ValueType;
 
 typedef struct {
@@ -23,7 +78,7 @@ typedef struct {
     union {
         bool boolean;
         double number;
-        ObjString* obj;
+        Obj* obj;
     } as;
 } Value;
 
@@ -31,6 +86,7 @@ typedef struct {
 #define IS_NIL(value)     ((value).type == VAL_NIL)
 #define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)    ((value).as.boolean)
 #define AS_NUMBER(value)  ((value).as.number)
@@ -39,7 +95,10 @@ typedef struct {
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
-#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (ObjString*)(object)}})
+#define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)(object)}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+
+#endif
 
 typedef struct {
     int capacity;
@@ -51,6 +110,7 @@ void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
 void printValue(Value value);
+/* Ropes must be flattened first (see flattenString in object.h). */
 bool valuesEqual(Value a, Value b);
 
 #endif
@@ -3,252 +3,648 @@
  */
 #include "vm.h"
 #include "compiler.h"
+#include "memory.h"
 #include "object.h"
 #include "debug.h"
+#include "jit.h"
+#include "trace.h"
+#include "optimizer.h"
 #include <stdio.h>
-#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 
-static VM vm;
+VM vm;
 
 static void resetStack(void) {
-    vm.stackTop = 0;
+    vm.stackTop = vm.stack;
 }
 
-static void push(Value value) {
-    if (vm.stackCapacity < vm.stackTop + 1) {
-        int oldCap = vm.stackCapacity;
-        vm.stackCapacity = oldCap < 8 ? 8 : oldCap * 2;
-        vm.stack = realloc(vm.stack, sizeof(Value) * vm.stackCapacity);
-    }
-    vm.stack[vm.stackTop++] = value;
+/* Grows the stack to hold at least `needed` values. Called once per chunk
+   before run(), using the depth the compiler computed, so pushes inside
+   the interpreter loop never need to check capacity. */
+static void reserveStack(int needed) {
+    if (vm.stackCapacity >= needed) return;
+    int capacity = vm.stackCapacity < 8 ? 8 : vm.stackCapacity;
+    while (capacity < needed) capacity *= 2;
+    vm.stack = GROW_ARRAY(Value, vm.stack, vm.stackCapacity, capacity);
+    vm.stackCapacity = capacity;
 }
 
-static Value pop(void) {
-    return vm.stack[--vm.stackTop];
+static bool isTruthy(Value value) {
+    if (IS_NIL(value)) return false;
+    if (IS_BOOL(value)) return AS_BOOL(value);
+    return true;
 }
 
-static Value peek(int distance) {
-    return vm.stack[vm.stackTop - 1 - distance];
+void runtimeError(const char* format, ...) {
+    fprintf(stderr, "Runtime error: ");
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    /* Every caller has stored an ip just past the failing opcode. */
+    int offset = (int)(vm.ip - vm.chunk->code) - 1;
+    fprintf(stderr, "[line %d] in script\n", getLine(vm.chunk, offset));
 }
 
-/* Global variables: simple array of (name, value) pairs */
-#define MAX_GLOBALS 256
-static struct {
-    ObjString* name;
-    Value value;
-} globals[MAX_GLOBALS];
-static int globalCount = 0;
-
-static ObjString* getConstantName(Chunk* chunk, uint8_t index) {
-    Value v = chunk->constants.values[index];
-    if (IS_OBJ(v)) return AS_OBJ(v);
-    return NULL;
+void undefinedVariable(int slot) {
+    ObjString* name = AS_STRING(vm.globalNames.values[slot]);
+    runtimeError("Undefined variable '%.*s'.", name->length, name->chars);
 }
 
-static bool stringsEqual(ObjString* a, ObjString* b) {
-    if (a == b) return true;
-    if (!a || !b || a->length != b->length) return false;
-    return memcmp(a->chars, b->chars, a->length) == 0;
+/* Replaces the two strings on top of the stack with their concatenation:
+   a new string allocated once at its final size, or a rope if it is
+   long. Either way it isn't interned, and it is hashed only if it is
+   ever compared. */
+bool concatenate(void) {
+    Obj* result = concatenateStrings(vm.stackTop - 2);
+    if (result == NULL) return false;
+    vm.stackTop[-2] = OBJ_VAL(result);
+    vm.stackTop--;
+    return true;
 }
 
-static bool getGlobal(ObjString* name, Value* out) {
-    for (int i = 0; i < globalCount; i++) {
-        if (stringsEqual(globals[i].name, name)) {
-            *out = globals[i].value;
-            return true;
-        }
-    }
-    return false;
+void flattenOperands(void) {
+    if (IS_ROPE(vm.stackTop[-2])) flattenString(&vm.stackTop[-2]);
+    if (IS_ROPE(vm.stackTop[-1])) flattenString(&vm.stackTop[-1]);
 }
 
-static void setGlobal(ObjString* name, Value value) {
-    for (int i = 0; i < globalCount; i++) {
-        if (stringsEqual(globals[i].name, name)) {
-            globals[i].value = value;
-            return;
-        }
-    }
-    if (globalCount < MAX_GLOBALS) {
-        globals[globalCount].name = name;
-        globals[globalCount].value = value;
-        globalCount++;
+/* Returns the slot for a global name, allocating the next free one the
+   first time the name is seen. Slots persist across compile() calls so
+   REPL lines share globals. */
+int globalSlot(ObjString* name) {
+    Value slot;
+    if (tableGet(&vm.globalSlots, name, &slot)) return (int)AS_NUMBER(slot);
+    int index = vm.globalValues.count;
+    tableSet(&vm.globalSlots, name, NUMBER_VAL(index));
+    int oldCapacity = vm.globalValues.capacity;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    if (vm.globalValues.capacity != oldCapacity) {
+        vm.rememberedGlobals = GROW_ARRAY(uint8_t, vm.rememberedGlobals,
+                                          oldCapacity, vm.globalValues.capacity);
+        memset(vm.rememberedGlobals + oldCapacity, 0,
+               vm.globalValues.capacity - oldCapacity);
     }
+    return index;
 }
 
-static bool isTruthy(Value value) {
-    if (IS_NIL(value)) return false;
-    if (IS_BOOL(value)) return AS_BOOL(value);
-    return true;
+#if DEBUG_TRACE_EXECUTION
+static void traceExecution(void) {
+    printf("          ");
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
 }
+#define TRACE_INSTRUCTION() (SAVE_REGISTERS(), traceExecution())
+#else
+#define TRACE_INSTRUCTION() ((void)0)
+#endif
 
-static void runtimeError(const char* format, ...) {
-    fprintf(stderr, "Runtime error: ");
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fprintf(stderr, "\n");
-}
+#if DEBUG_OPCODE_PAIRS
+#define PROFILE_OPCODE() recordOpcode(*ip)
+#else
+#define PROFILE_OPCODE() ((void)0)
+#endif
 
 static InterpretResult run(void) {
-#define READ_BYTE() (*vm.ip++)
-#define READ_SHORT() (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
+    /* The instruction pointer and stack top live in locals so the compiler
+       can keep them in registers; they are written back to vm only when
+       something outside run() needs them (errors, tracing, return). */
+    register uint8_t* ip = vm.ip;
+    register Value* sp = vm.stackTop;
+    Value* slots = vm.stack;
+    Value* globals = vm.globalValues.values;
+
+#define SAVE_REGISTERS() (vm.ip = ip, vm.stackTop = sp)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(op) \
+/* Unchecked: the stack was sized to chunk->maxStack before run(). */
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define STORE_GLOBAL(slot, value) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        Value stored = (value); \
+        globals[slot] = stored; \
+        writeBarrierGlobal(slot, stored); \
+    } while (0)
+#define NOT_BOOL_VAL(b) BOOL_VAL(!(b))
+/* Generic handlers quicken: having checked both operands are numbers,
+   they overwrite their own opcode (ip[-1]) with the _NUM variant. */
+#define BINARY_OP(valueType, op, quickened) \
+    do { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            SAVE_REGISTERS(); \
             runtimeError("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(NUMBER_VAL(a op b)); \
+        ip[-1] = (quickened); \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        PUSH(valueType(a op b)); \
+    } while (0)
+/* The _NUM variants only guard. If the guard fails they put the generic
+   opcode back and step ip back onto it, so the next dispatch re-runs the
+   instruction the slow way (and reports any error from there). */
+#define NUMBER_OP(valueType, op, generic) \
+    do { \
+        if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) { \
+            double b = AS_NUMBER(POP()); \
+            PEEK(0) = valueType(AS_NUMBER(PEEK(0)) op b); \
+        } else { \
+            ip[-1] = (generic); \
+            ip--; \
+        } \
     } while (0)
 
+#if COMPUTED_GOTO
+    /* One label per opcode; every handler jumps straight to the next
+       handler, so each gets its own indirect branch for the predictor. */
+    static void* dispatchTable[] = {
+        [OP_CONSTANT] = &&L_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&L_OP_CONSTANT_LONG,
+        [OP_NIL] = &&L_OP_NIL,
+        [OP_TRUE] = &&L_OP_TRUE,
+        [OP_FALSE] = &&L_OP_FALSE,
+        [OP_POP] = &&L_OP_POP,
+        [OP_GET_LOCAL] = &&L_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&L_OP_SET_LOCAL,
+        [OP_GET_GLOBAL_SLOT] = &&L_OP_GET_GLOBAL_SLOT,
+        [OP_DEFINE_GLOBAL_SLOT] = &&L_OP_DEFINE_GLOBAL_SLOT,
+        [OP_SET_GLOBAL_SLOT] = &&L_OP_SET_GLOBAL_SLOT,
+        [OP_GET_GLOBAL_LONG] = &&L_OP_GET_GLOBAL_LONG,
+        [OP_DEFINE_GLOBAL_LONG] = &&L_OP_DEFINE_GLOBAL_LONG,
+        [OP_SET_GLOBAL_LONG] = &&L_OP_SET_GLOBAL_LONG,
+        [OP_EQUAL] = &&L_OP_EQUAL,
+        [OP_GREATER] = &&L_OP_GREATER,
+        [OP_LESS] = &&L_OP_LESS,
+        [OP_NOT_EQUAL] = &&L_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&L_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&L_OP_LESS_EQUAL,
+        [OP_ADD] = &&L_OP_ADD,
+        [OP_SUBTRACT] = &&L_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&L_OP_MULTIPLY,
+        [OP_DIVIDE] = &&L_OP_DIVIDE,
+        [OP_NOT] = &&L_OP_NOT,
+        [OP_NEGATE] = &&L_OP_NEGATE,
+        [OP_PRINT] = &&L_OP_PRINT,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&L_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&L_OP_LOOP,
+        [OP_JUMP_LONG] = &&L_OP_JUMP_LONG,
+        [OP_JUMP_IF_FALSE_LONG] = &&L_OP_JUMP_IF_FALSE_LONG,
+        [OP_LOOP_LONG] = &&L_OP_LOOP_LONG,
+        [OP_SET_LOCAL_POP] = &&L_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&L_OP_SET_GLOBAL_POP,
+        [OP_INCREMENT_LOCAL] = &&L_OP_INCREMENT_LOCAL,
+        [OP_INCREMENT_GLOBAL] = &&L_OP_INCREMENT_GLOBAL,
+        [OP_POP_JUMP_IF_FALSE] = &&L_OP_POP_JUMP_IF_FALSE,
+        [OP_JUMP_IF_NOT_LESS_CONST] = &&L_OP_JUMP_IF_NOT_LESS_CONST,
+        [OP_JUMP_IF_NOT_GREATER_CONST] = &&L_OP_JUMP_IF_NOT_GREATER_CONST,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_SUBTRACT_NUM] = &&L_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&L_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&L_OP_DIVIDE_NUM,
+        [OP_LESS_NUM] = &&L_OP_LESS_NUM,
+        [OP_GREATER_NUM] = &&L_OP_GREATER_NUM,
+        [OP_LESS_EQUAL_NUM] = &&L_OP_LESS_EQUAL_NUM,
+        [OP_GREATER_EQUAL_NUM] = &&L_OP_GREATER_EQUAL_NUM,
+        [OP_RETURN] = &&L_OP_RETURN,
+    };
+    /* While a trace is being recorded, dispatch goes through L_RECORD
+       first, so the normal handlers pay nothing for it. */
+    static void* recordTable[] = {[0 ... OP_RETURN] = &&L_RECORD};
+    void** dispatch = dispatchTable;
+#define DISPATCH() \
+    do { \
+        TRACE_INSTRUCTION(); \
+        PROFILE_OPCODE(); \
+        goto *dispatch[READ_BYTE()]; \
+    } while (0)
+#define CASE(op) L_##op
+#define START_RECORDING() (dispatch = recordTable)
+    DISPATCH();
+L_RECORD:
+    ip--;
+    SAVE_REGISTERS();
+    if (!traceRecord(ip, sp)) dispatch = dispatchTable;
+    goto *dispatchTable[READ_BYTE()];
+#else
+#define DISPATCH() break
+#define CASE(op) case op
+#define START_RECORDING() (recording = true)
+    bool recording = false;
     for (;;) {
-#if DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (int i = 0; i < vm.stackTop; i++) {
-            printf("[ ");
-            printValue(vm.stack[i]);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+        TRACE_INSTRUCTION();
+        PROFILE_OPCODE();
+        if (recording) {
+            SAVE_REGISTERS();
+            recording = traceRecord(ip, sp);
+        }
+        switch (READ_BYTE()) {
 #endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
-            case OP_GET_GLOBAL: {
-                ObjString* name = getConstantName(vm.chunk, READ_BYTE());
-                Value value;
-                if (!getGlobal(name, &value)) {
-                    runtimeError("Undefined variable '%.*s'.", name->length, name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(value);
-                break;
-            }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = getConstantName(vm.chunk, READ_BYTE());
-                setGlobal(name, peek(0));
-                pop();
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                ObjString* name = getConstantName(vm.chunk, READ_BYTE());
-                Value v = pop();
-                /* Check if exists - we need to add to globals if defining */
-                Value old;
-                if (!getGlobal(name, &old)) {
-                    runtimeError("Undefined variable '%.*s'.", name->length, name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                setGlobal(name, v);
-                push(v);  /* assignment yields the value */
-                break;
-            }
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
-                break;
-            }
-            case OP_GREATER: BINARY_OP(>); break;
-            case OP_LESS: BINARY_OP(<); break;
-            case OP_ADD: {
-                if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                } else {
-                    runtimeError("Operands must be numbers.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
+        CASE(OP_CONSTANT): {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG): {
+            Value constant = vm.chunk->constants.values[READ_LONG()];
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP): sp--; DISPATCH();
+        CASE(OP_GET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = PEEK(0);  /* assignment yields the value */
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            Value value = globals[slot];
+            if (IS_UNDEFINED(value)) {
+                SAVE_REGISTERS();
+                undefinedVariable(slot);
+                return INTERPRET_RUNTIME_ERROR;
             }
-            case OP_SUBTRACT: BINARY_OP(-); break;
-            case OP_MULTIPLY: BINARY_OP(*); break;
-            case OP_DIVIDE: {
-                if (AS_NUMBER(peek(0)) == 0) {
-                    runtimeError("Division by zero.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                BINARY_OP(/);
-                break;
-            }
-            case OP_NOT:
-                push(BOOL_VAL(!isTruthy(pop())));
-                break;
-            case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            STORE_GLOBAL(slot, POP());
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_SLOT): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(globals[slot])) {
+                SAVE_REGISTERS();
+                undefinedVariable(slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            STORE_GLOBAL(slot, PEEK(0));  /* assignment yields the value */
+            DISPATCH();
+        }
+        CASE(OP_GET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            Value value = globals[slot];
+            if (IS_UNDEFINED(value)) {
+                SAVE_REGISTERS();
+                undefinedVariable(slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_DEFINE_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            STORE_GLOBAL(slot, POP());
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_LONG): {
+            uint32_t slot = READ_LONG();
+            if (IS_UNDEFINED(globals[slot])) {
+                SAVE_REGISTERS();
+                undefinedVariable(slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            STORE_GLOBAL(slot, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL): {
+            if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {
+                SAVE_REGISTERS();
+                flattenOperands();
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(valuesEqual(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+        CASE(OP_LESS): BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+        CASE(OP_NOT_EQUAL): {
+            if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) {
+                SAVE_REGISTERS();
+                flattenOperands();
+            }
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(!valuesEqual(a, b)));
+            DISPATCH();
+        }
+        /* Spelled as negations so NaN compares exactly as the OP_LESS/
+           OP_GREATER + OP_NOT pairs they replace. */
+        CASE(OP_GREATER_EQUAL): BINARY_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL_NUM); DISPATCH();
+        CASE(OP_LESS_EQUAL): BINARY_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL_NUM); DISPATCH();
+        CASE(OP_ADD): {
+            if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+                ip[-1] = OP_ADD_NUM;
+                double b = AS_NUMBER(POP());
+                double a = AS_NUMBER(POP());
+                PUSH(NUMBER_VAL(a + b));
+            } else if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+                SAVE_REGISTERS();
+                if (!concatenate()) {
+                    runtimeError(STRING_LENGTH_ERROR);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            case OP_PRINT:
-                printValue(pop());
-                printf("\n");
-                break;
-            case OP_JUMP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip += offset;
-                break;
-            }
-            case OP_JUMP_IF_FALSE: {
-                uint16_t offset = READ_SHORT();
-                if (!isTruthy(peek(0))) {
-                    pop();  /* pop the condition */
-                    vm.ip += offset;
+                sp = vm.stackTop;
+            } else {
+                SAVE_REGISTERS();
+                runtimeError(ADD_OPERANDS_ERROR);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+        CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+        CASE(OP_DIVIDE): {
+            if (AS_NUMBER(PEEK(0)) == 0) {
+                SAVE_REGISTERS();
+                runtimeError("Division by zero.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM);
+            DISPATCH();
+        }
+        CASE(OP_NOT):
+            PEEK(0) = BOOL_VAL(!isTruthy(PEEK(0)));
+            DISPATCH();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0))) {
+                SAVE_REGISTERS();
+                runtimeError("Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+            DISPATCH();
+        CASE(OP_PRINT):
+            printValue(POP());
+            printf("\n");
+            DISPATCH();
+        CASE(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            /* Condition stays on the stack; both paths emit OP_POP. */
+            if (!isTruthy(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            if (vm.traceJit) {
+                Trace* trace = traceAt(ip);
+                if (trace != NULL) {
+                    ip = traceRun(trace, sp);
+                    sp = vm.stackTop;
+                } else if (traceHotLoop(ip, sp)) {
+                    START_RECORDING();
                 }
-                break;
             }
-            case OP_LOOP: {
-                uint16_t offset = READ_SHORT();
-                vm.ip -= offset;
-                break;
+            DISPATCH();
+        }
+        /* Loops this long are far past what a trace could hold, so the
+           _LONG forms skip the tracing JIT's hooks. */
+        CASE(OP_JUMP_LONG): {
+            uint32_t offset = READ_LONG();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_LONG): {
+            uint32_t offset = READ_LONG();
+            if (!isTruthy(PEEK(0))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_LOOP_LONG): {
+            uint32_t offset = READ_LONG();
+            ip -= offset;
+            DISPATCH();
+        }
+        /* Superinstructions: each behaves exactly like the sequence the
+           optimizer fused, including which error is reported first. */
+        CASE(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_POP): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(globals[slot])) {
+                SAVE_REGISTERS();
+                undefinedVariable(slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            STORE_GLOBAL(slot, POP());
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT_LOCAL): {
+            uint8_t slot = READ_BYTE();
+            Value step = READ_CONSTANT();
+            if (!IS_NUMBER(slots[slot]) || !IS_NUMBER(step)) {
+                SAVE_REGISTERS();
+                runtimeError(ADD_OPERANDS_ERROR);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[slot] = NUMBER_VAL(AS_NUMBER(slots[slot]) + AS_NUMBER(step));
+            DISPATCH();
+        }
+        CASE(OP_INCREMENT_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value step = READ_CONSTANT();
+            Value value = globals[slot];
+            if (IS_UNDEFINED(value)) {
+                SAVE_REGISTERS();
+                undefinedVariable(slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!IS_NUMBER(value) || !IS_NUMBER(step)) {
+                SAVE_REGISTERS();
+                runtimeError(ADD_OPERANDS_ERROR);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            globals[slot] = NUMBER_VAL(AS_NUMBER(value) + AS_NUMBER(step));
+            DISPATCH();
+        }
+        CASE(OP_POP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (!isTruthy(POP())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS_CONST): {
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            Value a = POP();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                SAVE_REGISTERS();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER_CONST): {
+            Value b = READ_CONSTANT();
+            uint16_t offset = READ_SHORT();
+            Value a = POP();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                SAVE_REGISTERS();
+                runtimeError("Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!(AS_NUMBER(a) > AS_NUMBER(b))) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM): NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+        CASE(OP_SUBTRACT_NUM): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+        CASE(OP_MULTIPLY_NUM): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+        CASE(OP_DIVIDE_NUM):
+            /* A zero divisor also goes back to OP_DIVIDE, which reports it. */
+            if (IS_NUMBER(PEEK(0)) && AS_NUMBER(PEEK(0)) == 0) {
+                ip[-1] = OP_DIVIDE;
+                ip--;
+                DISPATCH();
             }
-            case OP_RETURN:
-                return INTERPRET_OK;
+            NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE);
+            DISPATCH();
+        CASE(OP_LESS_NUM): NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+        CASE(OP_GREATER_NUM): NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+        CASE(OP_LESS_EQUAL_NUM): NUMBER_OP(NOT_BOOL_VAL, >, OP_LESS_EQUAL); DISPATCH();
+        CASE(OP_GREATER_EQUAL_NUM): NUMBER_OP(NOT_BOOL_VAL, <, OP_GREATER_EQUAL); DISPATCH();
+        CASE(OP_RETURN):
+            SAVE_REGISTERS();
+            return INTERPRET_OK;
+#if !COMPUTED_GOTO
         }
     }
+#endif
 
+#undef SAVE_REGISTERS
 #undef READ_BYTE
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_CONSTANT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef STORE_GLOBAL
+#undef NOT_BOOL_VAL
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef DISPATCH
+#undef CASE
+#undef START_RECORDING
 }
 
 void initVM(void) {
+    initAllocator(&vm.allocator);
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
+    vm.optimize = false;
+    vm.jit = false;
+    vm.traceJit = false;
+    vm.chunk = NULL;
+    vm.objects = NULL;
+    vm.bytesAllocated = 0;
+    vm.nextGC = GC_INITIAL_HEAP;
+    vm.gcStress = false;
+    vm.grayCount = 0;
+    vm.grayCapacity = 0;
+    vm.grayStack = NULL;
+    vm.generational = false;
+    vm.pretenure = true;
+    vm.nursery = NULL;
+    vm.nurseryTop = NULL;
+    vm.nurseryEnd = NULL;
+    vm.rememberedGlobals = NULL;
+    vm.rememberedSlots = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
+    vm.incremental = false;
+    vm.pauseTarget = 500;
+    vm.logGCStats = false;
+    vm.gcPhase = GC_IDLE;
+    vm.nextSlice = 0;
+    vm.markCursor = 0;
+    vm.weakEntries = NULL;
+    vm.weakCursor = 0;
+    vm.sweepList = NULL;
+    memset(&vm.gcCycle, 0, sizeof(GCStats));
+    memset(&vm.gcLastCycle, 0, sizeof(GCStats));
     resetStack();
-    globalCount = 0;
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    initTable(&vm.strings);
 }
 
 void freeVM(void) {
-    free(vm.stack);
+#if DEBUG_OPCODE_PAIRS
+    printOpcodePairs();
+#endif
+    /* Everything, objects included, is in the allocator's blocks: drop
+       them wholesale rather than freeing each one. */
+    freeAllocator(&vm.allocator);
+    initVM();
+}
+
+bool compileSource(const char* source, Chunk* chunk) {
+    initChunk(chunk);
+    if (!compile(source, chunk)) {
+        freeChunk(chunk);
+        return false;
+    }
+    if (vm.optimize) optimizeChunk(chunk);
+    return true;
 }
 
 InterpretResult interpret(const char* source) {
     Chunk chunk;
-    initChunk(&chunk);
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
-    }
-    vm.chunk = &chunk;
-    vm.ip = chunk.code;
-    InterpretResult result = run();
+    if (!compileSource(source, &chunk)) return INTERPRET_COMPILE_ERROR;
+    InterpretResult result = interpretChunk(&chunk);
     freeChunk(&chunk);
     return result;
 }
+
+InterpretResult interpretChunk(Chunk* chunk) {
+    reserveStack(chunk->maxStack);
+    resetStack();
+    vm.chunk = chunk;
+    vm.ip = chunk->code;
+    InterpretResult result;
+    JitCode* native = vm.jit ? jitCompile(chunk) : NULL;
+    if (native != NULL) {
+        gcBeforeCompiledCode();
+        result = jitRun(native);
+        jitFree(native);
+    } else {
+        if (vm.traceJit) traceInit(chunk);
+        vm.pretenure = false;
+        result = run();
+        vm.pretenure = true;
+        if (vm.traceJit) traceFree();
+    }
+    vm.chunk = NULL;  /* the caller frees it; the GC must stop marking it */
+    return result;
+}
@@ -4,14 +4,78 @@
 #ifndef clox_vm_h
 #define clox_vm_h
 
+#include "allocator.h"
 #include "chunk.h"
+#include "table.h"
+
+/* Where an incremental collection is (see memory.c). */
+typedef enum {
+    GC_IDLE,
+    GC_MARK,           /* tracing from the roots in slices */
+    GC_WEAK,           /* dropping unmarked strings from the intern set */
+    GC_SWEEP,          /* freeing unmarked objects in slices */
+} GCPhase;
+
+/* Collector pauses leading up to one completed collection, bucketed by
+   length: pauses[i] counts those shorter than 16 << i microseconds, and
+   the last bucket the rest. */
+#define GC_PAUSE_BUCKETS 12
+
+typedef struct {
+    int cycle;         /* which collection, counting from 1 */
+    int pauseCount;
+    int pauses[GC_PAUSE_BUCKETS];
+    double maxPause;   /* microseconds */
+    double totalPause;
+} GCStats;
 
 typedef struct {
     Chunk* chunk;
     uint8_t* ip;       /* Instruction pointer */
     Value* stack;
     int stackCapacity;
-    int stackTop;
+    Value* stackTop;   /* Next free slot; synced from run()'s register copy */
+    /* Globals are resolved to dense slots at compile time. globalSlots
+       maps each name to its slot; globalValues holds UNDEFINED_VAL until
+       the slot's 'var' runs; globalNames is kept for error messages. */
+    Table globalSlots;
+    ValueArray globalValues;
+    ValueArray globalNames;
+    Table strings;     /* Intern set: every live ObjString, held weakly */
+    Obj* objects;      /* Every heap object, newest first; the GC sweeps this */
+    size_t bytesAllocated;
+    size_t nextGC;     /* Collect once bytesAllocated passes this */
+    bool gcStress;     /* Collect on every allocation (--gc-stress) */
+    int grayCount;     /* Marked objects whose references aren't traced yet */
+    int grayCapacity;
+    Obj** grayStack;
+    bool generational; /* Allocate in a nursery, with minor GCs (--gc-generational) */
+    bool pretenure;    /* Allocate old; cleared while a chunk runs */
+    uint8_t* nursery;  /* NURSERY_SIZE bytes, NULL unless generational */
+    uint8_t* nurseryTop;
+    uint8_t* nurseryEnd;
+    /* Remembered set: global slots written a young object since the last
+       minor collection. rememberedGlobals[slot] flags membership and has
+       room for every slot in globalValues. */
+    uint8_t* rememberedGlobals;
+    int* rememberedSlots;
+    int rememberedCount;
+    int rememberedCapacity;
+    bool incremental;  /* Mark and sweep in slices between allocations (--gc-incremental) */
+    double pauseTarget;  /* Microseconds a slice may take (--gc-pause) */
+    bool logGCStats;   /* Print each collection's pauses (--gc-stats) */
+    GCPhase gcPhase;
+    size_t nextSlice;  /* Run a slice once bytesAllocated reaches this */
+    int markCursor;    /* Next global slot to mark */
+    Entry* weakEntries;  /* vm.strings.entries when the weak phase began */
+    int weakCursor;
+    Obj* sweepList;    /* Objects not swept yet; survivors go back on vm.objects */
+    GCStats gcCycle;   /* Pauses since the last collection finished */
+    GCStats gcLastCycle;
+    bool optimize;     /* Run the peephole optimizer on each chunk (-O) */
+    bool jit;          /* Compile chunks to machine code when possible (--jit) */
+    bool traceJit;     /* Record and compile hot loops (--trace-jit) */
+    Allocator allocator;  /* Owns all of the VM's memory (see memory.h) */
 } VM;
 
 typedef enum {
@@ -20,8 +84,27 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
+extern VM vm;
+
 void initVM(void);
+int globalSlot(ObjString* name);
 void freeVM(void);
+/* compile(), then the peephole optimizer under -O. Leaves nothing to
+   free when it returns false. */
+bool compileSource(const char* source, Chunk* chunk);
 InterpretResult interpret(const char* source);
+/* Runs an already compiled chunk, e.g. one loaded from a .loxc file. */
+InterpretResult interpretChunk(Chunk* chunk);
+/* Error reporting shared by run() and JIT-compiled code. */
+void runtimeError(const char* format, ...);
+void undefinedVariable(int slot);
+#define ADD_OPERANDS_ERROR "Operands must be two numbers or two strings."
+#define STRING_LENGTH_ERROR "String too long."
+/* Pops two strings and pushes their concatenation. May collect. Returns
+   false, leaving the stack alone, if the result would be too long. */
+bool concatenate(void);
+/* Flattens either of the top two values that is a rope, for valuesEqual.
+   May collect. */
+void flattenOperands(void);
 
 #endif
@@ -0,0 +1,100 @@
+#!/bin/sh
+# diff.sh - Differential test of the optimizer and JITs against the
+# interpreter.
+#
+# Runs every script in examples/, bench/ and tests/ with no flags, then
+# with -O, --jit, -O --jit, --trace-jit and -O --trace-jit, and fails if
+# any run's stdout, stderr or exit code differs from the plain
+# interpreter's. The compile cache is bypassed so each run really
+# compiles the script it is given.
+#
+# Each script is also saved with --compile, with and without -O, and the
+# .loxc file must run just like the source. Finally, truncated and
+# corrupted .loxc files must be rejected with a clean "Could not load"
+# error rather than crash the VM.
+#
+#   tests/diff.sh [clox]      (from the clox folder; `make test` runs it)
+
+CLOX=${1:-./clox}
+TESTS=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(cd "$TESTS/../.." && pwd)
+OUT=$(mktemp -d) || exit 1
+trap 'rm -rf "$OUT"' EXIT
+
+failures=0
+
+# Compares the run saved as got.* with the one saved as want.*.
+compare() {
+    for part in out err code; do
+        if ! cmp -s "$OUT/want.$part" "$OUT/got.$part"; then
+            case $part in
+                code) what="exit code" ;;
+                *) what="std$part" ;;
+            esac
+            echo "FAIL $1: $what differs"
+            diff "$OUT/want.$part" "$OUT/got.$part" | head -n 10
+            failures=$((failures + 1))
+        fi
+    done
+}
+
+# Runs clox with the given arguments, saving the run as $1.*.
+run() {
+    name=$1
+    shift
+    "$CLOX" "$@" >"$OUT/$name.out" 2>"$OUT/$name.err"
+    echo $? >"$OUT/$name.code"
+}
+
+for script in "$ROOT"/examples/*.lox "$ROOT"/bench/*.lox "$TESTS"/*.lox; do
+    run want --no-cache "$script"
+    for flags in "-O" "--jit" "-O --jit" "--trace-jit" "-O --trace-jit"; do
+        # $flags is split into separate arguments on purpose.
+        run got --no-cache $flags "$script"
+        compare "$script ($flags)"
+    done
+
+    for flags in "" "-O"; do
+        run want --no-cache $flags "$script"
+        # A script that fails to compile must fail the same way here.
+        if "$CLOX" $flags --compile "$OUT/script.loxc" "$script" 2>"$OUT/got.err"; then
+            run got "$OUT/script.loxc"
+        else
+            echo $? >"$OUT/got.code"
+            : >"$OUT/got.out"
+        fi
+        compare "$script ($flags --compile)"
+    done
+done
+
+# Expects clox to refuse the .loxc file at $OUT/bad.loxc.
+reject() {
+    run got "$OUT/bad.loxc"
+    code=$(cat "$OUT/got.code")
+    if [ "$code" -ne 65 ] || ! grep -q '^Could not load' "$OUT/got.err"; then
+        echo "FAIL $1: exit code $code"
+        head -n 5 "$OUT/got.err"
+        failures=$((failures + 1))
+    fi
+}
+
+"$CLOX" --compile "$OUT/good.loxc" "$ROOT/examples/05_comprehensive.lox"
+size=$(wc -c <"$OUT/good.loxc")
+for length in 0 4 16 $((size / 3)) $((size / 2)) $((size - 1)); do
+    head -c "$length" "$OUT/good.loxc" >"$OUT/bad.loxc"
+    reject "loxc truncated to $length bytes"
+done
+# Overwrite a run of bytes at several offsets with 0xff, which no
+# opcode, count or index in a sane file is made of.
+for offset in 8 $((size / 4)) $((size / 2)) $((size * 3 / 4)); do
+    cp "$OUT/good.loxc" "$OUT/bad.loxc"
+    printf '\377\377\377\377\377\377\377\377' |
+        dd of="$OUT/bad.loxc" bs=1 seek="$offset" conv=notrunc 2>/dev/null
+    reject "loxc corrupted at byte $offset"
+done
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures difference(s)."
+    exit 1
+fi
+echo "All scripts match under -O, both JITs and --compile."